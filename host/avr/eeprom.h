@@ -0,0 +1,17 @@
+/*
+ * eeprom.h
+ *
+ * Host replacement for avr/eeprom.h: the eeprom is ordinary memory.
+ */
+
+#ifndef HOST_EEPROM_H_
+#define HOST_EEPROM_H_
+
+#include <stddef.h>
+
+#define EEMEM
+
+void eeprom_read_block(void *destination, const void *source, size_t length);
+void eeprom_write_block(const void *source, void *destination, size_t length);
+
+#endif /* HOST_EEPROM_H_ */
@@ -0,0 +1,27 @@
+/*
+ * pgmspace.h
+ *
+ * Host replacement for avr/pgmspace.h: program memory is ordinary memory.
+ */
+
+#ifndef HOST_PGMSPACE_H_
+#define HOST_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(s) (s)
+
+#define pgm_read_byte(address) (*(const uint8_t *) (address))
+#define pgm_read_word(address) (*(const uint16_t *) (address))
+#define pgm_read_dword(address) (*(const uint32_t *) (address))
+#define pgm_read_ptr(address) (*(void * const *) (address))
+
+#define strlen_P strlen
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+
+#endif /* HOST_PGMSPACE_H_ */
@@ -0,0 +1,167 @@
+/*
+ * bench.c
+ *
+ * Micro benchmarks of single parts of the stack.
+ */
+
+#include "bench.h"
+#include "tcpip.h"
+#include "enc28j60.h"
+#include "encemu.h"
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define DEMUX_PORT 8000
+#define DEMUX_LOOKUPS 2000000
+
+static TCPChannel demuxChannels[TCP_MAX_CHANNELS];
+static IpAddress demuxIps[TCP_MAX_CHANNELS];
+static uint16_t demuxPorts[TCP_MAX_CHANNELS];
+static uint16_t demuxConnected;
+
+static TCPChannel *demuxConnect() {
+	if (demuxConnected < TCP_MAX_CHANNELS) {
+		return &demuxChannels[demuxConnected++];
+	}
+	return NULL;
+}
+
+static void demuxReceive(TCPChannel *channel) {
+	(void) channel;
+}
+
+static void demuxDisconnect(TCPChannel *channel) {
+	(void) channel;
+}
+
+static TCPApp demuxApp = { DEMUX_PORT, demuxConnect, demuxReceive,
+		demuxDisconnect, 0 };
+
+static double nanosSince(struct timespec *start) {
+	struct timespec end;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+	return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+/**
+ * Lets the stack handle all received frames and forgets what it sent.
+ */
+static void runUntilIdle(void) {
+	uint8_t frame[ENCEMU_MAX_FRAME];
+	for (int i = 0; i < 8; i++) {
+		pollEnc();
+		while (encEmuTakeSent(frame) > 0) {
+		}
+	}
+}
+
+/**
+ * Sends a segment without payload from a client. The stack does not check
+ * the checksums, so they are left 0.
+ */
+static void sendFromClient(const uint8_t *deviceIp, uint16_t client,
+		uint8_t flags, uint32_t seq, uint32_t ack) {
+	static const uint8_t deviceMac[6] = MY_MAC;
+	uint8_t frame[54];
+	memset(frame, 0, sizeof(frame));
+	memcpy(frame, deviceMac, 6);
+	frame[6] = 0x02;
+	frame[11] = (uint8_t) client;
+	frame[12] = 0x08;
+
+	uint8_t *ip = frame + 14;
+	ip[0] = 0x45;
+	ip[3] = 40;
+	ip[8] = 64;
+	ip[9] = PROTOCOL_TCP;
+	memcpy(ip + 12, &demuxIps[client], 4);
+	memcpy(ip + 16, deviceIp, 4);
+
+	uint8_t *tcp = ip + 20;
+	tcp[0] = (uint8_t) (demuxPorts[client] >> 8);
+	tcp[1] = (uint8_t) demuxPorts[client];
+	tcp[2] = (uint8_t) (DEMUX_PORT >> 8);
+	tcp[3] = (uint8_t) DEMUX_PORT;
+	for (int i = 0; i < 4; i++) {
+		tcp[4 + i] = (uint8_t) (seq >> (24 - 8 * i));
+		tcp[8 + i] = (uint8_t) (ack >> (24 - 8 * i));
+	}
+	tcp[12] = 5 << 4;
+	tcp[13] = flags;
+	tcp[14] = 0xff;
+	tcp[15] = 0xff;
+	encEmuReceive(frame, sizeof(frame));
+}
+
+/**
+ * The lookup the stack did before channels were hashed.
+ */
+static TCPChannel *linearLookup(IpAddress *ip, uint16_t remotePort,
+		uint16_t localPort) {
+	for (int i = 0; i < demuxConnected; i++) {
+		TCPChannel *channel = &demuxChannels[i];
+		if (channel->app->port == localPort && channel->port == remotePort
+				&& memcmp(ip, &channel->ip, sizeof(IpAddress)) == 0) {
+			return channel;
+		}
+	}
+	return 0;
+}
+
+static double measureLookups(uint16_t count,
+		TCPChannel *(*lookup)(IpAddress*, uint16_t, uint16_t)) {
+	uint32_t found = 0;
+	struct timespec start;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+	for (uint32_t i = 0; i < DEMUX_LOOKUPS; i++) {
+		uint16_t client = i % count;
+		TCPChannel *channel = lookup(&demuxIps[client], demuxPorts[client],
+				DEMUX_PORT);
+		found += channel == &demuxChannels[client];
+	}
+	double nanos = nanosSince(&start);
+	if (found != DEMUX_LOOKUPS) {
+		printf("demux: %u of %u lookups failed\n", DEMUX_LOOKUPS - found,
+				DEMUX_LOOKUPS);
+		return -1;
+	}
+	return nanos / DEMUX_LOOKUPS;
+}
+
+int runDemuxBenchmark(const uint8_t *deviceIp) {
+	addTcpApp(&demuxApp);
+	demuxConnected = 0;
+	for (uint16_t client = 0; client < TCP_MAX_CHANNELS; client++) {
+		// a few peers with many connections each
+		IpAddress ip = { 10, 0, 0, 1 + client % 4 };
+		demuxIps[client] = ip;
+		demuxPorts[client] = 40000 + client * 7;
+	}
+
+	printf("channels | hashed ns/lookup | linear ns/lookup\n");
+	uint16_t open = 0;
+	for (uint16_t count = 1; count <= TCP_MAX_CHANNELS; count *= 2) {
+		while (open < count) {
+			sendFromClient(deviceIp, open, 1 << TCP_FLAG_SYN, 5000, 0);
+			runUntilIdle();
+			// acknowledge the syn ack, so that it is not kept any more.
+			sendFromClient(deviceIp, open, 1 << TCP_FLAG_ACK, 5001, 0x101);
+			runUntilIdle();
+			open++;
+		}
+		if (demuxConnected != count) {
+			printf("demux: only %u of %u connections opened\n", demuxConnected,
+					count);
+			return 0;
+		}
+		double hashed = measureLookups(count, tcpFindChannel);
+		double linear = measureLookups(count, linearLookup);
+		if (hashed < 0 || linear < 0) {
+			return 0;
+		}
+		printf("%8u | %16.2f | %16.2f\n", count, hashed, linear);
+	}
+	return 1;
+}
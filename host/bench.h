@@ -0,0 +1,20 @@
+/*
+ * bench.h
+ *
+ * Micro benchmarks of single parts of the stack, run by the host program.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdint.h>
+
+/**
+ * Opens connections from many peers and measures how long it takes to find
+ * the channel of a segment, against the number of open channels.
+ * The stack needs to be initialized.
+ * Returns 0 on failure.
+ */
+int runDemuxBenchmark(const uint8_t *deviceIp);
+
+#endif /* BENCH_H_ */
@@ -0,0 +1,514 @@
+/*
+ * encemu.c
+ *
+ * Register level emulation of the enc28j60: SPI opcodes, register banks,
+ * the 8 KB buffer memory with the receive ring, the transmit engine, the
+ * dma copy/checksum unit and the receive filters.
+ *
+ * Timing is emulated by counting register reads, so the driver sees busy
+ * bits the same way it does on the real chip.
+ */
+
+#include "encemu.h"
+#include <string.h>
+
+#define REG_ERDPT 0x00
+#define REG_EWRPT 0x02
+#define REG_ETXST 0x04
+#define REG_ETXND 0x06
+#define REG_ERXST 0x08
+#define REG_ERXND 0x0a
+#define REG_ERXRDPT 0x0c
+#define REG_ERXWRPT 0x0e
+#define REG_EDMAST 0x10
+#define REG_EDMAND 0x12
+#define REG_EDMADST 0x14
+#define REG_EDMACSL 0x16
+#define REG_EDMACSH 0x17
+
+#define REG_EPMM0 0x08
+#define REG_EPMCSL 0x10
+#define REG_EPMCSH 0x11
+#define REG_EPMOL 0x14
+#define REG_ERXFCON 0x18
+#define REG_EPKTCNT 0x19
+
+#define REG_MISTAT 0x0a
+#define REG_EREVID 0x12
+
+#define REG_EIE 0x1b
+#define REG_EIR 0x1c
+#define REG_ESTAT 0x1d
+#define REG_ECON2 0x1e
+#define REG_ECON1 0x1f
+
+#define EIE_INTIE 7
+#define EIR_PKTIF 6
+#define EIR_DMAIF 5
+#define EIR_TXIF 3
+#define EIR_RXERIF 0
+
+#define ECON1_TXRST 7
+#define ECON1_DMAST 5
+#define ECON1_CSUMEN 4
+#define ECON1_TXRTS 3
+#define ECON1_RXEN 2
+
+#define ECON2_AUTOINC 7
+#define ECON2_PKTDEC 6
+
+#define ERXFCON_UCEN 7
+#define ERXFCON_ANDOR 6
+#define ERXFCON_PMEN 4
+#define ERXFCON_MCEN 1
+#define ERXFCON_BCEN 0
+
+#define OPCODE_RCR 0x00
+#define OPCODE_RBM 0x3a
+#define OPCODE_WCR 0x40
+#define OPCODE_WBM 0x7a
+#define OPCODE_BFS 0x80
+#define OPCODE_BFC 0xa0
+#define OPCODE_SRC 0xff
+
+#define SENT_FRAMES 64
+
+EncEmuStatistics encEmuStatistics;
+uint16_t encEmuTransmitDelay = 4;
+void (*encEmuInterrupt)(void);
+
+static uint8_t memory[ENCEMU_MEMORY_SIZE];
+// bank 0 also holds the common registers 0x1b..0x1f
+static uint8_t registers[4][32];
+
+static uint8_t selected;
+static uint8_t frameIndex;
+static uint8_t opcode;
+
+static uint16_t transmitRemaining;
+// ERXRDPTL is held here until ERXRDPTH is written, as in the enc.
+static uint8_t receiveReadLow;
+
+static uint8_t sentFrames[SENT_FRAMES][ENCEMU_MAX_FRAME];
+static uint16_t sentLengths[SENT_FRAMES];
+static uint8_t sentHead;
+static uint8_t sentCount;
+
+static uint8_t getBank(void) {
+	return registers[0][REG_ECON1] & 0x03;
+}
+
+static uint8_t *getRegister(uint8_t address) {
+	if (address >= REG_EIE) {
+		return &registers[0][address];
+	}
+	return &registers[getBank()][address];
+}
+
+static uint16_t get16(uint8_t bank, uint8_t address) {
+	return registers[bank][address] | (registers[bank][address + 1] << 8);
+}
+
+static void set16(uint8_t bank, uint8_t address, uint16_t value) {
+	registers[bank][address] = (uint8_t) value;
+	registers[bank][address + 1] = (uint8_t) (value >> 8);
+}
+
+/**
+ * MAC and MII registers send a dummy byte before the value.
+ */
+static uint8_t isMacRegister(uint8_t address) {
+	uint8_t bank = getBank();
+	return (bank == 2 && address < 0x1b)
+			|| (bank == 3 && (address <= 0x05 || address == REG_MISTAT));
+}
+
+/**
+ * Advances a buffer pointer, wrapping inside the receive buffer like the
+ * enc does.
+ */
+static uint16_t nextPointer(uint16_t pointer) {
+	if (pointer == get16(0, REG_ERXND)) {
+		return get16(0, REG_ERXST);
+	}
+	return (pointer + 1) & (ENCEMU_MEMORY_SIZE - 1);
+}
+
+static void runDma(void) {
+	uint16_t pointer = get16(0, REG_EDMAST);
+	uint16_t end = get16(0, REG_EDMAND);
+	encEmuStatistics.dmaRuns++;
+	if (registers[0][REG_ECON1] & (1 << ECON1_CSUMEN)) {
+		uint32_t sum = 0;
+		uint8_t odd = 0;
+		while (1) {
+			sum += odd ? memory[pointer] : (uint16_t) memory[pointer] << 8;
+			odd = !odd;
+			if (pointer == end) {
+				break;
+			}
+			pointer = nextPointer(pointer);
+		}
+		while (sum >> 16) {
+			sum = (sum & 0xffff) + (sum >> 16);
+		}
+		sum ^= 0xffff;
+		registers[0][REG_EDMACSH] = (uint8_t) (sum >> 8);
+		registers[0][REG_EDMACSL] = (uint8_t) sum;
+	} else {
+		uint16_t destination = get16(0, REG_EDMADST);
+		while (1) {
+			memory[destination] = memory[pointer];
+			if (pointer == end) {
+				break;
+			}
+			pointer = nextPointer(pointer);
+			destination = nextPointer(destination);
+		}
+	}
+	registers[0][REG_ECON1] &= ~(1 << ECON1_DMAST);
+	registers[0][REG_EIR] |= 1 << EIR_DMAIF;
+}
+
+static void finishTransmit(void) {
+	uint16_t start = get16(0, REG_ETXST);
+	uint16_t end = get16(0, REG_ETXND);
+	uint16_t length = (end - start) & (ENCEMU_MEMORY_SIZE - 1);
+	if (length > ENCEMU_MAX_FRAME) {
+		length = ENCEMU_MAX_FRAME;
+	}
+
+	uint8_t slot = (sentHead + sentCount) % SENT_FRAMES;
+	if (sentCount == SENT_FRAMES) {
+		// nobody took them, drop the oldest.
+		sentHead = (sentHead + 1) % SENT_FRAMES;
+	} else {
+		sentCount++;
+	}
+	for (uint16_t i = 0; i < length; i++) {
+		sentFrames[slot][i] = memory[(start + 1 + i) & (ENCEMU_MEMORY_SIZE - 1)];
+	}
+	sentLengths[slot] = length;
+	encEmuStatistics.sent++;
+
+	// status vector: byte count and "transmit done"
+	uint8_t status[7] = { (uint8_t) length, (uint8_t) (length >> 8), 0, 0x80,
+			0, 0, 0 };
+	for (uint8_t i = 0; i < sizeof(status); i++) {
+		memory[(end + 1 + i) & (ENCEMU_MEMORY_SIZE - 1)] = status[i];
+	}
+
+	registers[0][REG_ECON1] &= ~(1 << ECON1_TXRTS);
+	registers[0][REG_EIR] |= 1 << EIR_TXIF;
+	transmitRemaining = 0;
+}
+
+uint8_t encEmuInterruptPin(void) {
+	uint8_t flags = registers[0][REG_EIR] & ~(1 << EIR_PKTIF);
+	if (registers[1][REG_EPKTCNT] > 0) {
+		flags |= 1 << EIR_PKTIF;
+	}
+	uint8_t enabled = registers[0][REG_EIE];
+	return !((enabled & (1 << EIE_INTIE)) && (enabled & flags & 0x7f));
+}
+
+/**
+ * Calls encEmuInterrupt while the INT pin is low.
+ */
+static void updateInterruptPin(void) {
+	if (encEmuInterrupt && !encEmuInterruptPin()) {
+		encEmuInterrupt();
+	}
+}
+
+/**
+ * Time passes with every register read.
+ */
+static void tick(void) {
+	if (transmitRemaining > 0) {
+		transmitRemaining--;
+		if (transmitRemaining == 0) {
+			finishTransmit();
+		}
+	}
+}
+
+void encEmuTick(void) {
+	tick();
+	updateInterruptPin();
+}
+
+static void econ1Written(void) {
+	uint8_t econ1 = registers[0][REG_ECON1];
+	if (econ1 & (1 << ECON1_TXRST)) {
+		transmitRemaining = 0;
+		registers[0][REG_ECON1] &= ~(1 << ECON1_TXRTS);
+	}
+	if (econ1 & (1 << ECON1_DMAST)) {
+		runDma();
+	}
+	if ((econ1 & (1 << ECON1_TXRTS)) && transmitRemaining == 0) {
+		if (encEmuTransmitDelay == 0) {
+			finishTransmit();
+		} else {
+			transmitRemaining = encEmuTransmitDelay;
+		}
+	}
+}
+
+static void econ2Written(void) {
+	if (registers[0][REG_ECON2] & (1 << ECON2_PKTDEC)) {
+		registers[0][REG_ECON2] &= ~(1 << ECON2_PKTDEC);
+		if (registers[1][REG_EPKTCNT] > 0) {
+			registers[1][REG_EPKTCNT]--;
+		}
+	}
+}
+
+static void registerWritten(uint8_t address) {
+	if (address == REG_ECON1) {
+		econ1Written();
+	} else if (address == REG_ECON2) {
+		econ2Written();
+	} else if (getBank() == 0 && address == REG_ERXST + 1) {
+		// writing ERXST also moves the write pointer.
+		set16(0, REG_ERXWRPT, get16(0, REG_ERXST));
+	} else if (getBank() == 0 && address == REG_ERXRDPT + 1) {
+		registers[0][REG_ERXRDPT] = receiveReadLow;
+	}
+}
+
+static uint8_t readRegister(uint8_t address) {
+	tick();
+	if (address == REG_EIR) {
+		if (registers[1][REG_EPKTCNT] > 0) {
+			registers[0][REG_EIR] |= 1 << EIR_PKTIF;
+		} else {
+			registers[0][REG_EIR] &= ~(1 << EIR_PKTIF);
+		}
+	}
+	return *getRegister(address);
+}
+
+void encEmuReset(void) {
+	memset(registers, 0, sizeof(registers));
+	registers[0][REG_ESTAT] = 0x01; // CLKRDY
+	registers[0][REG_ECON2] = 1 << ECON2_AUTOINC;
+	set16(0, REG_ERXND, 0x1fff);
+	set16(0, REG_ERXRDPT, 0x05fa);
+	receiveReadLow = 0xfa;
+	registers[1][REG_ERXFCON] = (1 << ERXFCON_UCEN) | (1 << 5)
+			| (1 << ERXFCON_BCEN);
+	registers[3][REG_EREVID] = 0x06;
+	transmitRemaining = 0;
+}
+
+void encEmuSelect(void) {
+	selected = 1;
+	frameIndex = 0;
+}
+
+void encEmuDeselect(void) {
+	selected = 0;
+	updateInterruptPin();
+}
+
+uint8_t encEmuTransfer(uint8_t value) {
+	uint8_t result = 0;
+	if (!selected) {
+		return 0xff;
+	}
+	if (frameIndex == 0) {
+		opcode = value;
+		if (opcode == OPCODE_SRC) {
+			encEmuReset();
+		}
+	} else if (opcode == OPCODE_RBM) {
+		uint16_t pointer = get16(0, REG_ERDPT);
+		result = memory[pointer];
+		if (registers[0][REG_ECON2] & (1 << ECON2_AUTOINC)) {
+			set16(0, REG_ERDPT, nextPointer(pointer));
+		}
+	} else if (opcode == OPCODE_WBM) {
+		uint16_t pointer = get16(0, REG_EWRPT);
+		memory[pointer] = value;
+		if (registers[0][REG_ECON2] & (1 << ECON2_AUTOINC)) {
+			set16(0, REG_EWRPT, (pointer + 1) & (ENCEMU_MEMORY_SIZE - 1));
+		}
+	} else {
+		uint8_t address = opcode & 0x1f;
+		switch (opcode & 0xe0) {
+		case OPCODE_RCR:
+			if (!isMacRegister(address) || frameIndex == 2) {
+				result = readRegister(address);
+			}
+			break;
+		case OPCODE_WCR:
+			if (frameIndex == 1 && getBank() == 0 && address == REG_ERXRDPT) {
+				receiveReadLow = value;
+			} else if (frameIndex == 1) {
+				*getRegister(address) = value;
+				registerWritten(address);
+			}
+			break;
+		case OPCODE_BFS:
+			if (frameIndex == 1) {
+				*getRegister(address) |= value;
+				registerWritten(address);
+			}
+			break;
+		case OPCODE_BFC:
+			if (frameIndex == 1) {
+				*getRegister(address) &= ~value;
+			}
+			break;
+		}
+	}
+	if (frameIndex < 0xff) {
+		frameIndex++;
+	}
+	return result;
+}
+
+static uint8_t isBroadcast(const uint8_t *frame) {
+	for (uint8_t i = 0; i < 6; i++) {
+		if (frame[i] != 0xff) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static uint8_t isUnicastToMe(const uint8_t *frame) {
+	// MAADR1..6 are at 0x04, 0x05, 0x02, 0x03, 0x00, 0x01 in bank 3
+	static const uint8_t macRegisters[6] = { 0x04, 0x05, 0x02, 0x03, 0x00,
+			0x01 };
+	for (uint8_t i = 0; i < 6; i++) {
+		if (frame[i] != registers[3][macRegisters[i]]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static uint8_t matchesPattern(const uint8_t *frame, uint16_t length) {
+	uint16_t offset = get16(1, REG_EPMOL);
+	uint32_t sum = 0;
+	uint8_t odd = 0;
+	for (uint8_t i = 0; i < 64; i++) {
+		if (registers[1][REG_EPMM0 + i / 8] & (1 << (i % 8))) {
+			if (offset + i >= length) {
+				return 0;
+			}
+			uint8_t byte = frame[offset + i];
+			sum += odd ? byte : (uint16_t) byte << 8;
+			odd = !odd;
+		}
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	sum ^= 0xffff;
+	return sum == get16(1, REG_EPMCSL);
+}
+
+/**
+ * Applies ERXFCON. The hash table filter is not emulated and never matches.
+ */
+static uint8_t passesFilters(const uint8_t *frame, uint16_t length) {
+	uint8_t filters = registers[1][REG_ERXFCON];
+	uint8_t enabled = filters
+			& ((1 << ERXFCON_UCEN) | (1 << ERXFCON_PMEN) | (1 << 3) | (1 << 2)
+					| (1 << ERXFCON_MCEN) | (1 << ERXFCON_BCEN));
+	if (!enabled) {
+		return 1;
+	}
+	uint8_t matches = 0;
+	if (isUnicastToMe(frame)) {
+		matches |= 1 << ERXFCON_UCEN;
+	}
+	if (isBroadcast(frame)) {
+		matches |= 1 << ERXFCON_BCEN;
+	} else if (frame[0] & 1) {
+		matches |= 1 << ERXFCON_MCEN;
+	}
+	if ((filters & (1 << ERXFCON_PMEN)) && matchesPattern(frame, length)) {
+		matches |= 1 << ERXFCON_PMEN;
+	}
+	if (filters & (1 << ERXFCON_ANDOR)) {
+		return (matches & enabled) == enabled;
+	} else {
+		return (matches & enabled) != 0;
+	}
+}
+
+uint8_t encEmuReceive(const uint8_t *frame, uint16_t length) {
+	if (!(registers[0][REG_ECON1] & (1 << ECON1_RXEN))) {
+		encEmuStatistics.filtered++;
+		return 0;
+	}
+	if (!passesFilters(frame, length)) {
+		encEmuStatistics.filtered++;
+		return 0;
+	}
+
+	uint16_t start = get16(0, REG_ERXST);
+	uint16_t end = get16(0, REG_ERXND);
+	uint16_t size = end - start + 1;
+	uint16_t write = get16(0, REG_ERXWRPT);
+	uint16_t read = get16(0, REG_ERXRDPT);
+	uint16_t used = (uint16_t) (write - read + size) % size;
+	// frame, crc, status vector and padding.
+	uint16_t needed = length + 4 + 6 + 1;
+	if (used + needed >= size || registers[1][REG_EPKTCNT] == 0xff) {
+		registers[0][REG_EIR] |= 1 << EIR_RXERIF;
+		encEmuStatistics.overflows++;
+		updateInterruptPin();
+		return 0;
+	}
+
+	uint16_t byteCount = length + 4;
+	uint16_t next = write;
+	for (uint16_t i = 0; i < 6 + byteCount; i++) {
+		next = nextPointer(next);
+	}
+	if (next & 1) {
+		next = nextPointer(next);
+	}
+	uint8_t header[6] = { (uint8_t) next, (uint8_t) (next >> 8),
+			(uint8_t) byteCount, (uint8_t) (byteCount >> 8), 0x00, 0x80 };
+
+	uint16_t pointer = write;
+	for (uint16_t i = 0; i < 6 + byteCount; i++) {
+		uint8_t value;
+		if (i < 6) {
+			value = header[i];
+		} else if (i < 6 + length) {
+			value = frame[i - 6];
+		} else {
+			value = 0; // crc is not checked by the driver.
+		}
+		memory[pointer] = value;
+		pointer = nextPointer(pointer);
+	}
+	set16(0, REG_ERXWRPT, next);
+	registers[1][REG_EPKTCNT]++;
+	encEmuStatistics.received++;
+	updateInterruptPin();
+	return 1;
+}
+
+uint16_t encEmuTakeSent(uint8_t *frame) {
+	if (sentCount == 0) {
+		return 0;
+	}
+	uint16_t length = sentLengths[sentHead];
+	memcpy(frame, sentFrames[sentHead], length);
+	sentHead = (sentHead + 1) % SENT_FRAMES;
+	sentCount--;
+	return length;
+}
+
+uint8_t *encEmuMemory(void) {
+	return memory;
+}
@@ -0,0 +1,76 @@
+/*
+ * encemu.h
+ *
+ * Register level emulation of the enc28j60, used as SPI backend for the
+ * host build.
+ */
+
+#ifndef ENCEMU_H_
+#define ENCEMU_H_
+
+#include <stdint.h>
+
+#define ENCEMU_MEMORY_SIZE 0x2000
+#define ENCEMU_MAX_FRAME 1536
+
+typedef struct {
+	// frames passed to the receive buffer
+	uint32_t received;
+	// frames dropped because the receive buffer was full
+	uint32_t overflows;
+	// frames the receive filters did not let through
+	uint32_t filtered;
+	// frames sent by the enc
+	uint32_t sent;
+	// dma copy and checksum operations
+	uint32_t dmaRuns;
+} EncEmuStatistics;
+
+extern EncEmuStatistics encEmuStatistics;
+
+/**
+ * Number of register reads a transmission keeps TXRTS set.
+ * Emulates the time a frame needs on the wire.
+ */
+extern uint16_t encEmuTransmitDelay;
+
+/**
+ * Called whenever the INT pin is low after something happened in the enc
+ * (SPI frame ended, frame received, transmission done).
+ */
+extern void (*encEmuInterrupt)(void);
+
+void encEmuReset(void);
+
+void encEmuSelect(void);
+void encEmuDeselect(void);
+uint8_t encEmuTransfer(uint8_t value);
+
+/**
+ * Puts a frame (without crc) into the receive buffer, as if it was received
+ * from the wire. Returns 0 if it was dropped.
+ */
+uint8_t encEmuReceive(const uint8_t *frame, uint16_t length);
+
+/**
+ * Takes the oldest frame the enc has sent. Returns its length, 0 if there
+ * is none.
+ */
+uint16_t encEmuTakeSent(uint8_t *frame);
+
+/**
+ * Lets time pass outside of SPI frames, e.g. once per main loop.
+ */
+void encEmuTick(void);
+
+/**
+ * State of the INT pin, 0 means the enc wants attention.
+ */
+uint8_t encEmuInterruptPin(void);
+
+/**
+ * Direct access to the buffer memory, for checks.
+ */
+uint8_t *encEmuMemory(void);
+
+#endif /* ENCEMU_H_ */
@@ -0,0 +1,1391 @@
+/*
+ * main.c
+ *
+ * Runs the whole stack as a linux program, against the emulated enc and an
+ * emulated peer, and reports what the hot paths cost.
+ *
+ * usage: enc28j60-host [-r requests] [-s request size] [-b bulk bytes]
+ *                      [-d drop every n-th frame]
+ *                      [-n frames not for the device per echo request]
+ *                      [-p echo requests sent at once]
+ *                      [-t bytes per stream response] [-m mss of the peer]
+ *                      [-w http requests]
+ *        enc28j60-host -l (channel lookup benchmark)
+ *        enc28j60-host -c (randomized checksum test)
+ */
+
+#include "tcpip.h"
+#include "enc28j60.h"
+#include "http.h"
+#include "stats.h"
+#include "encemu.h"
+#include "peer.h"
+#include "bench.h"
+#include "selftest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ECHO_PORT 7
+#define ECHO_ALL_PORT 8007
+#define BULK_PORT 9000
+#define OVERFLOW_PORT 9001
+#define PLAIN_PORT 9002
+#define STREAM_PORT 8080
+#define HTTP_PORT 80
+#define UPLOAD_BYTES 700
+#define STREAM_CHUNK 100
+#define MAX_STREAM 16000
+#define MAX_SESSIONS 4
+#define BULK_SEGMENT 512
+// one main loop iteration is one millisecond for the timers.
+#define MAX_LOOPS 2000000
+#define MAX_PIPELINE 16
+// segments that hold every response head of the http server.
+#define HEAD_MSS 200
+
+typedef struct {
+	TCPChannel channel;
+	uint32_t bulkRemaining;
+	uint32_t bulkPosition;
+} Session;
+
+TCP_CHANNEL_POOL(echoPool, Session, MAX_SESSIONS);
+TCP_CHANNEL_POOL(echoAllPool, Session, MAX_SESSIONS);
+TCP_CHANNEL_POOL(bulkPool, Session, MAX_SESSIONS);
+TCP_CHANNEL_POOL(overflowPool, Session, MAX_SESSIONS);
+TCP_CHANNEL_POOL(streamPool, Session, MAX_SESSIONS);
+TCP_CHANNEL_POOL(plainPool, Session, MAX_SESSIONS);
+
+typedef struct {
+	HttpSession http;
+	uint32_t uploaded;
+	uint32_t uploadSum;
+	// what webParseBody read
+	int32_t numbers[6];
+	uint8_t results[6];
+	char delimiters[6];
+	// what webFormBody found
+	EncScan boundary;
+	uint8_t scanning;
+	uint16_t boundaries;
+	uint32_t partBytes;
+	uint32_t partSum;
+	// what is left of a response larger than the send window.
+	uint16_t dataRemaining;
+	uint16_t dataPosition;
+	uint8_t staticPart;
+} WebSession;
+
+TCP_CHANNEL_POOL(webPool, WebSession, MAX_SESSIONS);
+
+/**
+ * Sends every line back. A line the send window has no room for is left to
+ * the peer to send again.
+ */
+static void echoReceive(TCPChannel *channel) {
+	if (encGetRemaining() > tcpGetSendSpace(channel)) {
+		tcpRefuseReceived(channel);
+	} else if (encGetRemaining() > 0) {
+		sendTcpResponseHeader(channel, (1 << TCP_FLAG_ACK) | (1 << TCP_FLAG_PSH));
+		encCopyIncommingOutgoing('\n');
+		encWriteChar('\n');
+		sendTcpResponse(channel);
+	}
+}
+
+/**
+ * Sends every segment back as it is.
+ */
+static void echoAllReceive(TCPChannel *channel) {
+	if (encGetRemaining() > tcpGetSendSpace(channel)) {
+		tcpRefuseReceived(channel);
+	} else if (encGetRemaining() > 0) {
+		sendTcpResponseHeader(channel, (1 << TCP_FLAG_ACK) | (1 << TCP_FLAG_PSH));
+		encCopyIncommingOutgoingAll();
+		sendTcpResponse(channel);
+	}
+}
+
+static uint8_t bulkByte(uint32_t position) {
+	return 'a' + position % 26;
+}
+
+/**
+ * Sends as many bytes as requested, as fast as the send window allows.
+ */
+static void bulkReceive(TCPChannel *channel) {
+	Session *session = (Session*) channel;
+	if (encGetRemaining() > 0) {
+		char skipped;
+		session->bulkRemaining = (uint16_t) encReadInt(&skipped);
+		session->bulkRemaining *= 1000;
+	}
+	while (session->bulkRemaining > 0 && tcpGetFreeSendWindow(channel) > 0) {
+		// one segment per response, so that all are kept for retransmission.
+		uint16_t length = BULK_SEGMENT;
+		if (channel->mss < length) {
+			length = channel->mss;
+		}
+		if (session->bulkRemaining < length) {
+			length = session->bulkRemaining;
+		}
+		sendTcpResponseHeader(channel, (1 << TCP_FLAG_ACK) | (1 << TCP_FLAG_PSH));
+		for (uint16_t i = 0; i < length; i++) {
+			encWriteChar(bulkByte(session->bulkPosition++));
+		}
+		session->bulkRemaining -= length;
+		sendTcpResponse(channel);
+	}
+}
+
+/**
+ * Sends as many bytes as requested, what the send window has room for in
+ * one response that the stack splits in segments. 0 closes the connection.
+ */
+static void streamReceive(TCPChannel *channel) {
+	Session *session = (Session*) channel;
+	if (encGetRemaining() > 0) {
+		if (session->bulkRemaining > 0) {
+			// busy with the last request, the peer sends this one again.
+			tcpRefuseReceived(channel);
+			return;
+		}
+		char skipped;
+		session->bulkRemaining = (uint16_t) encReadInt(&skipped);
+		session->bulkPosition = 0;
+		if (session->bulkRemaining == 0) {
+			finTcpSession(channel);
+			return;
+		}
+	}
+	uint16_t remaining = tcpGetSendSpace(channel);
+	if (remaining > session->bulkRemaining) {
+		remaining = session->bulkRemaining;
+	}
+	if (remaining == 0) {
+		return;
+	}
+	session->bulkRemaining -= remaining;
+	uint8_t chunk[STREAM_CHUNK];
+	sendTcpResponseHeader(channel, (1 << TCP_FLAG_ACK) | (1 << TCP_FLAG_PSH));
+	while (remaining > 0) {
+		uint8_t length = remaining < STREAM_CHUNK ? remaining : STREAM_CHUNK;
+		for (uint8_t i = 0; i < length; i++) {
+			chunk[i] = bulkByte(session->bulkPosition++);
+		}
+		encWriteSequence(chunk, length);
+		remaining -= length;
+	}
+	sendTcpResponse(channel);
+}
+
+/**
+ * Sends every segment back, like the example in the README: it does not
+ * look at the send window.
+ */
+static void plainReceive(TCPChannel *channel) {
+	if (encGetRemaining() > 0) {
+		sendTcpResponseHeader(channel, (1 << TCP_FLAG_ACK) | (1 << TCP_FLAG_PSH));
+		encCopyIncommingOutgoingAll();
+		sendTcpResponse(channel);
+	}
+}
+
+// what sendTcpResponse() returned to overflowReceive.
+static uint8_t overflowSent;
+
+/**
+ * Writes a segment more than tcpGetSendSpace(), like an app that does not
+ * care about the send window. The stack resets the connection.
+ */
+static void overflowReceive(TCPChannel *channel) {
+	if (encGetRemaining() > 0) {
+		uint16_t length = tcpGetSendSpace(channel)
+				+ tcpGetSegmentSize(channel);
+		sendTcpResponseHeader(channel, (1 << TCP_FLAG_ACK) | (1 << TCP_FLAG_PSH));
+		for (uint16_t i = 0; i < length; i++) {
+			encWriteChar(bulkByte(i));
+		}
+		overflowSent = sendTcpResponse(channel);
+	}
+}
+
+// disconnects of stream channels that were still in the channel table.
+static uint32_t streamEarlyDisconnects;
+
+/**
+ * The session may be reused after this, so the stack must be done with it.
+ */
+static void streamDisconnect(TCPChannel *channel) {
+	if (tcpFindChannel(&channel->ip, channel->port, STREAM_PORT) == channel) {
+		streamEarlyDisconnects++;
+	}
+}
+
+static uint32_t webRequests;
+
+static const char textHtml[] PROGMEM = "text/html";
+static const char textPlain[] PROGMEM = "text/plain";
+static const char textStatic[] PROGMEM = "static";
+
+/**
+ * Starts a response, the handler writes length bytes of it once they fit
+ * in the send window.
+ */
+static uint8_t webFits(HttpSession *session, PGM_P contentType,
+		uint16_t length) {
+	httpStartResponse(session, 200, contentType);
+	return httpGetSendSpace(session) >= length;
+}
+
+/**
+ * A page that fits in one segment, it gets a Content-Length.
+ */
+static void webIndex(HttpSession *session) {
+	if (!webFits(session, textHtml, 48)) {
+		return;
+	}
+	encWriteFormat_P(PSTR("<html><body>request %lu</body></html>\n"),
+			++webRequests);
+	httpEndResponse(session);
+}
+
+/**
+ * Sends n=<bytes> bytes, chunked if they do not fit in one segment. Each
+ * call writes what the send window has room for.
+ */
+static void webData(HttpSession *session) {
+	WebSession *web = (WebSession*) session;
+	if (httpStartResponse(session, 200, textPlain)) {
+		web->dataRemaining = 0;
+		web->dataPosition = 0;
+		if (strncmp(session->query, "n=", 2) == 0) {
+			web->dataRemaining = atoi(session->query + 2);
+		}
+	}
+	uint16_t space = httpGetSendSpace(session);
+	uint8_t chunk[STREAM_CHUNK];
+	while (web->dataRemaining > 0 && space > 0) {
+		uint16_t length = web->dataRemaining < STREAM_CHUNK ?
+				web->dataRemaining : STREAM_CHUNK;
+		if (length > space) {
+			length = space;
+		}
+		for (uint8_t i = 0; i < length; i++) {
+			chunk[i] = bulkByte(web->dataPosition++);
+		}
+		encWriteSequence(chunk, length);
+		web->dataRemaining -= length;
+		space -= length;
+	}
+	if (web->dataRemaining == 0) {
+		httpEndResponse(session);
+	}
+}
+
+static void webUploadBody(HttpSession *session, uint16_t length) {
+	WebSession *web = (WebSession*) session;
+	uint8_t buffer[64];
+	while (length > 0) {
+		uint8_t read = encReadSequence(buffer,
+				length < sizeof(buffer) ? length : sizeof(buffer));
+		for (uint8_t i = 0; i < read; i++) {
+			web->uploadSum += buffer[i];
+		}
+		web->uploaded += read;
+		length -= read;
+	}
+}
+
+/**
+ * Tells how many bytes were posted and their sum.
+ */
+static void webUpload(HttpSession *session) {
+	WebSession *web = (WebSession*) session;
+	if (!webFits(session, textPlain, 24)) {
+		return;
+	}
+	encWriteFormat_P(PSTR("%lu %lu"), web->uploaded, web->uploadSum);
+	httpEndResponse(session);
+	web->uploaded = 0;
+	web->uploadSum = 0;
+}
+
+// the body of webStatic, every conversion of encWriteFormat_P().
+static const char staticBody[] = "static -1234 65535 -2000000000 4000000000 "
+		"beef DEADBEEF -128 255 -0.05 123456.789 |  -42|-42  |-0042| x ram "
+		"pro        7 %";
+
+// bytes each half of staticBody takes at most.
+#define STATIC_PART 72
+
+/**
+ * Writes staticBody in two halves, so that each fits in a small segment.
+ */
+static void webStatic(HttpSession *session) {
+	WebSession *web = (WebSession*) session;
+	if (httpStartResponse(session, 200, textPlain)) {
+		web->staticPart = 0;
+	}
+	if (httpGetSendSpace(session) < STATIC_PART) {
+		return;
+	}
+	if (web->staticPart == 0) {
+		encWriteFormat_P(PSTR("%S %d %u %ld %lu %x %lX "), textStatic, -1234,
+				65535u, (int32_t) -2000000000, (uint32_t) 4000000000u, 0xbeef,
+				(uint32_t) 0xdeadbeef);
+		web->staticPart = 1;
+		if (httpGetSendSpace(session) < STATIC_PART) {
+			return;
+		}
+	}
+	encWriteFormat_P(PSTR("%hhd %hhu %.2k %.3lk |%5d|%-5d|%05d| %c %s %.3S "
+			"%*u %%"), -128, 255, -5, (int32_t) 123456789, -42, -42, -42, 'x',
+			"ram", PSTR("progmem"), 8, 7);
+	httpEndResponse(session);
+}
+
+/**
+ * Reads the body sent by runHttp with the number parsers. It is the rest of
+ * the segment, the last number ends with the package.
+ */
+static void webParseBody(HttpSession *session, uint16_t length) {
+	(void) length;
+	WebSession *web = (WebSession*) session;
+	web->results[0] = encReadInt32(&web->numbers[0], &web->delimiters[0]);
+	web->results[1] = encReadUint32((uint32_t*) &web->numbers[1],
+			&web->delimiters[1]);
+	web->results[2] = encReadHex((uint32_t*) &web->numbers[2],
+			&web->delimiters[2]);
+	web->results[3] = encReadFixed(&web->numbers[3], 3, &web->delimiters[3]);
+	web->results[4] = encReadUint32((uint32_t*) &web->numbers[4],
+			&web->delimiters[4]);
+	web->results[5] = encReadFixed(&web->numbers[5], 1, &web->delimiters[5]);
+}
+
+static void webParse(HttpSession *session) {
+	WebSession *web = (WebSession*) session;
+	if (!webFits(session, textPlain, 72)) {
+		return;
+	}
+	encWriteFormat_P(PSTR("%ld %lu %lX %.3lk %lu %.1lk\n"), web->numbers[0],
+			(uint32_t) web->numbers[1], (uint32_t) web->numbers[2],
+			web->numbers[3], (uint32_t) web->numbers[4], web->numbers[5]);
+	for (uint8_t i = 0; i < 6; i++) {
+		encWriteFormat_P(PSTR("%u%02hhx"), web->results[i],
+				web->delimiters[i]);
+	}
+	httpEndResponse(session);
+}
+
+/**
+ * Splits a multipart body at its boundaries, the parts are captured in
+ * small pieces. A boundary may be split over two segments.
+ */
+static void webFormBody(HttpSession *session, uint16_t length) {
+	WebSession *web = (WebSession*) session;
+	if (!web->scanning) {
+		encScanStart_P(&web->boundary, PSTR("\r\n--frontier"));
+		web->scanning = 1;
+	}
+	uint8_t part[16];
+	uint8_t result;
+	do {
+		uint16_t captured = 0;
+		result = encScan(&web->boundary, part, sizeof(part), &captured);
+		for (uint16_t i = 0; i < captured; i++) {
+			web->partSum += part[i];
+		}
+		web->partBytes += captured;
+		if (result == ENC_SCAN_FOUND) {
+			web->boundaries++;
+		}
+	} while (result != ENC_SCAN_END);
+	if (length == session->contentLength) {
+		// the body ends, a partial boundary at its end belongs to the part.
+		uint8_t held = encScanEnd(&web->boundary, part);
+		for (uint8_t i = 0; i < held; i++) {
+			web->partSum += part[i];
+		}
+		web->partBytes += held;
+	}
+}
+
+static void webForm(HttpSession *session) {
+	WebSession *web = (WebSession*) session;
+	if (!webFits(session, textPlain, 24)) {
+		return;
+	}
+	encWriteFormat_P(PSTR("%u %lu %lu"), web->boundaries, web->partBytes,
+			web->partSum);
+	httpEndResponse(session);
+	web->scanning = 0;
+	web->boundaries = 0;
+	web->partBytes = 0;
+	web->partSum = 0;
+}
+
+static const char pathIndex[] PROGMEM = "/";
+static const char pathData[] PROGMEM = "/data";
+static const char pathUpload[] PROGMEM = "/upload";
+static const char pathStatic[] PROGMEM = "/static/*";
+static const char pathParse[] PROGMEM = "/parse";
+static const char pathForm[] PROGMEM = "/form";
+
+static const HttpRoute webRoutes[] PROGMEM = {
+		{ pathIndex, HTTP_GET, webIndex, 0 },
+		{ pathData, HTTP_GET, webData, 0 },
+		{ pathUpload, HTTP_POST | HTTP_PUT, webUpload, webUploadBody },
+		{ pathStatic, HTTP_GET, webStatic, 0 },
+		{ pathParse, HTTP_POST, webParse, webParseBody },
+		{ pathForm, HTTP_POST, webForm, webFormBody } };
+
+static HTTP_SERVER(webServer, HTTP_PORT, webRoutes, webPool);
+
+static TCPApp echoApp = { ECHO_PORT, 0, echoReceive, 0, &echoPool };
+static TCPApp echoAllApp = { ECHO_ALL_PORT, 0, echoAllReceive, 0,
+		&echoAllPool };
+static TCPApp bulkApp = { BULK_PORT, 0, bulkReceive, 0, &bulkPool };
+static TCPApp overflowApp = { OVERFLOW_PORT, 0, overflowReceive, 0,
+		&overflowPool };
+static TCPApp streamApp = { STREAM_PORT, 0, streamReceive, streamDisconnect,
+		&streamPool };
+static TCPApp plainApp = { PLAIN_PORT, 0, plainReceive, 0, &plainPool };
+
+static uint32_t loops;
+static uint16_t noisePerRequest;
+static uint16_t pipeline = 1;
+
+static void runStack(void) {
+	pollEnc();
+	peerProcess();
+	encEmuTick();
+	peerTimerTick();
+	loops++;
+	tcpTimerTick();
+	tcpTimeoutPoll();
+}
+
+typedef struct {
+	const char *name;
+	struct timespec start;
+#ifdef NET_STATISTICS
+	NetStatistics net;
+#endif
+	EncEmuStatistics emu;
+} Measurement;
+
+static void startMeasurement(Measurement *measurement, const char *name) {
+	measurement->name = name;
+#ifdef NET_STATISTICS
+	netStatisticsSnapshot(&measurement->net);
+#endif
+	measurement->emu = encEmuStatistics;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &measurement->start);
+}
+
+static void printMeasurement(Measurement *measurement) {
+	struct timespec end;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+	double micros = (end.tv_sec - measurement->start.tv_sec) * 1e6
+			+ (end.tv_nsec - measurement->start.tv_nsec) / 1e3;
+	uint32_t received = encEmuStatistics.received - measurement->emu.received;
+	uint32_t sent = encEmuStatistics.sent - measurement->emu.sent;
+	uint32_t frames = received + sent;
+	if (frames == 0) {
+		frames = 1;
+	}
+#ifndef NET_STATISTICS
+	printf("%-8s rx %6u tx %6u | cpu %6.2f us/frame\n", measurement->name,
+			received, sent, micros / frames);
+#else
+	NetStatistics now;
+	netStatisticsSnapshot(&now);
+	StatsSpi before, after;
+	netStatisticsSpiTotal(&measurement->net, &before);
+	netStatisticsSpiTotal(&now, &after);
+	uint32_t bytes = after.bytes - before.bytes;
+	uint32_t selects = after.selects - before.selects;
+	printf("%-8s rx %6u tx %6u | SPI bytes %8u (%6.1f/frame) "
+			"chip selects %7u (%5.1f/frame) | cpu %6.2f us/frame\n",
+			measurement->name, received, sent, bytes, (double) bytes / frames,
+			selects, (double) selects / frames, micros / frames);
+	static const char *spiAccountNames[STATS_SPI_ACCOUNTS] = { "register",
+			"rx", "tx header", "tx payload", "checksum" };
+	for (int i = 0; i < STATS_SPI_ACCOUNTS; i++) {
+		uint32_t accountBytes = now.spi[i].bytes - measurement->net.spi[i].bytes;
+		uint32_t accountSelects = now.spi[i].selects
+				- measurement->net.spi[i].selects;
+		printf("         %-10s SPI bytes %6.1f/frame chip selects %5.1f/frame\n",
+				spiAccountNames[i], (double) accountBytes / frames,
+				(double) accountSelects / frames);
+	}
+	printf("         bank switches %.1f/frame\n",
+			(double) (now.bankSwitches - measurement->net.bankSwitches) / frames);
+#endif
+}
+
+#ifdef NET_STATISTICS
+static void printTimer(const char *name, StatsTimer *timer) {
+	printf("         %-17s %8u calls %8.2f us avg %8.2f us max\n", name,
+			timer->calls,
+			timer->calls ? timer->cycles / 1e3 / timer->calls : 0.0,
+			timer->maxCycles / 1e3);
+}
+
+static void printStatistics(void) {
+	NetStatistics statistics;
+	netStatisticsSnapshot(&statistics);
+	printf("stack: eth %u arp %u ip %u tcp %u | dropped: filter %u no app %u "
+			"no channel %u | refused: no slot %u\n", statistics.ethFrames,
+			statistics.arpFrames, statistics.ipFrames, statistics.tcpFrames,
+			statistics.droppedByFilter, statistics.droppedNoApp,
+			statistics.droppedNoChannel, statistics.refusedNoSlot);
+	printTimer("pollEnc", &statistics.pollEnc);
+	printTimer("tcpHeaderReceived", &statistics.tcpHeaderReceived);
+	printTimer("encSend", &statistics.encSend);
+}
+#endif
+
+static int runUntilConnected(uint16_t port) {
+	peerConnect(port);
+	// a lost syn ack is sent again after TCP_RETRANSMIT_TIMEOUT
+	for (int i = 0; i < 4 * TCP_RETRANSMIT_TIMEOUT && !peerIsConnected(); i++) {
+		runStack();
+	}
+	return peerIsConnected();
+}
+
+static int closeConnection(void) {
+	for (int retry = 0; retry < 5 && !peerIsClosed(); retry++) {
+		// the stack answers a repeated fin, even if it forgot the channel.
+		peerClose();
+		for (int i = 0; i < 100 && !peerIsClosed(); i++) {
+			runStack();
+		}
+	}
+	return peerIsClosed();
+}
+
+#ifdef NET_STATISTICS
+/**
+ * Runs the main loop without traffic. Polling costs SPI traffic every loop,
+ * with ENC_INTERRUPT there is none.
+ */
+static void runIdle(uint32_t count) {
+	NetStatistics before, after;
+	netStatisticsSnapshot(&before);
+	for (uint32_t i = 0; i < count; i++) {
+		runStack();
+	}
+	netStatisticsSnapshot(&after);
+	StatsSpi beforeTotal, afterTotal;
+	netStatisticsSpiTotal(&before, &beforeTotal);
+	netStatisticsSpiTotal(&after, &afterTotal);
+	uint32_t bytes = afterTotal.bytes - beforeTotal.bytes;
+	printf("%-8s loops %6u | SPI bytes %8u (%6.1f/loop)\n", "idle", count,
+			bytes, (double) bytes / count);
+}
+#endif
+
+static int runEcho(const char *name, uint16_t port, uint32_t count,
+		uint16_t size) {
+	static uint8_t requests[MAX_PIPELINE * 1500];
+	static uint8_t responses[MAX_PIPELINE * 1500];
+
+	if (!runUntilConnected(port)) {
+		printf("%s: no connection\n", name);
+		return 0;
+	}
+	Measurement measurement;
+	startMeasurement(&measurement, name);
+	for (uint32_t r = 0; r < count; r += pipeline) {
+		uint32_t sent = count - r < pipeline ? count - r : pipeline;
+		for (uint32_t k = 0; k < sent; k++) {
+			uint8_t *request = requests + k * size;
+			for (uint16_t i = 0; i + 1 < size; i++) {
+				request[i] = 'A' + (i + r + k) % 26;
+			}
+			request[size - 1] = '\n';
+			for (uint16_t i = 0; i < noisePerRequest; i++) {
+				peerSendNoise();
+			}
+			peerSend(request, size);
+		}
+		uint32_t total = sent * size;
+		uint32_t received = 0;
+		for (uint32_t i = 0; i < MAX_LOOPS && received < total; i++) {
+			runStack();
+			received += peerTakeReceived(responses + received,
+					total - received > 0xffff ? 0xffff : total - received);
+		}
+		if (received != total || memcmp(requests, responses, total) != 0) {
+			printf("%s: wrong response to request %u\n", name, r);
+			return 0;
+		}
+	}
+	printMeasurement(&measurement);
+	return closeConnection();
+}
+
+static int runBulk(uint32_t kilobytes) {
+	static uint8_t buffer[4096];
+	char request[16];
+
+	if (!runUntilConnected(BULK_PORT)) {
+		printf("bulk: no connection\n");
+		return 0;
+	}
+	Measurement measurement;
+	startMeasurement(&measurement, "bulk");
+	snprintf(request, sizeof(request), "%u\n", kilobytes);
+	peerSend((uint8_t*) request, strlen(request));
+
+	uint32_t total = kilobytes * 1000;
+	uint32_t received = 0;
+	for (uint32_t i = 0; i < MAX_LOOPS && received < total; i++) {
+		runStack();
+		uint16_t length = peerTakeReceived(buffer, sizeof(buffer));
+		for (uint16_t j = 0; j < length; j++) {
+			if (buffer[j] != bulkByte(received + j)) {
+				printf("bulk: wrong byte at %u\n", received + j);
+				return 0;
+			}
+		}
+		received += length;
+	}
+	printMeasurement(&measurement);
+	if (received != total) {
+		printf("bulk: received %u of %u bytes\n", received, total);
+		return 0;
+	}
+	return closeConnection();
+}
+
+static int runStream(uint32_t count, uint16_t bytes) {
+	static uint8_t buffer[MAX_STREAM];
+	char request[16];
+
+	if (!runUntilConnected(STREAM_PORT)) {
+		printf("stream: no connection\n");
+		return 0;
+	}
+	Measurement measurement;
+	startMeasurement(&measurement, "stream");
+	snprintf(request, sizeof(request), "%u\n", bytes);
+	for (uint32_t r = 0; r < count; r++) {
+		peerSend((uint8_t*) request, strlen(request));
+		uint16_t received = 0;
+		for (uint32_t i = 0; i < MAX_LOOPS && received < bytes; i++) {
+			runStack();
+			received += peerTakeReceived(buffer + received, bytes - received);
+		}
+		for (uint16_t j = 0; j < bytes; j++) {
+			if (received != bytes || buffer[j] != bulkByte(j)) {
+				printf("stream: wrong response to request %u\n", r);
+				return 0;
+			}
+		}
+	}
+	printMeasurement(&measurement);
+
+	// the device closes this time.
+	peerSend((const uint8_t*) "0\n", 2);
+	for (uint32_t i = 0; i < 4 * TCP_FIN_WAIT_TIME && streamPool.used > 0; i++) {
+		runStack();
+	}
+	if (!peerIsClosed() || streamPool.used > 0) {
+		printf("stream: not closed by the device\n");
+		return 0;
+	}
+	if (streamEarlyDisconnects > 0) {
+		printf("stream: disconnected while the channel was in use\n");
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Finds pattern in data, or 0.
+ */
+static const uint8_t *findBytes(const uint8_t *data, uint32_t length,
+		const char *pattern) {
+	size_t patternLength = strlen(pattern);
+	for (uint32_t i = 0; i + patternLength <= length; i++) {
+		if (memcmp(data + i, pattern, patternLength) == 0) {
+			return data + i;
+		}
+	}
+	return 0;
+}
+
+typedef struct {
+	uint16_t status;
+	uint8_t chunked;
+	uint8_t close;
+	uint32_t bodyLength;
+	uint8_t body[MAX_STREAM];
+} HttpResponse;
+
+/**
+ * Gets the value of a header in the head of a response, or 0.
+ */
+static const char *findHeader(const char *head, const char *name) {
+	size_t length = strlen(name);
+	for (const char *line = strstr(head, "\r\n"); line != 0;
+			line = strstr(line + 2, "\r\n")) {
+		if (strncasecmp(line + 2, name, length) == 0) {
+			const char *value = line + 2 + length;
+			while (*value == ' ') {
+				value++;
+			}
+			return value;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Parses the first response in data. Returns the bytes it takes, 0 if it
+ * is not complete. Without length, the response ends with the connection.
+ */
+static uint32_t parseHttpResponse(const uint8_t *data, uint32_t length,
+		HttpResponse *response) {
+	static char head[1024];
+	const uint8_t *end = findBytes(data, length, "\r\n\r\n");
+	if (end == 0 || end - data >= (long) sizeof(head)) {
+		return 0;
+	}
+	uint32_t headLength = end - data + 4;
+	memcpy(head, data, headLength - 2);
+	head[headLength - 2] = 0;
+	response->status = atoi(head + 9);
+	const char *contentLength = findHeader(head, "Content-Length:");
+	const char *encoding = findHeader(head, "Transfer-Encoding:");
+	const char *connection = findHeader(head, "Connection:");
+	response->chunked = encoding != 0 && strncmp(encoding, "chunked", 7) == 0;
+	response->close = connection != 0 && strncmp(connection, "close", 5) == 0;
+	response->bodyLength = 0;
+	if (response->chunked) {
+		uint32_t position = headLength;
+		while (1) {
+			const uint8_t *line = findBytes(data + position, length - position,
+					"\r\n");
+			if (line == 0) {
+				return 0;
+			}
+			uint32_t size = strtoul((const char*) data + position, 0, 16);
+			position = line - data + 2;
+			if (position + size + 2 > length) {
+				return 0;
+			}
+			if (response->bodyLength + size > sizeof(response->body)) {
+				return 0;
+			}
+			memcpy(response->body + response->bodyLength, data + position,
+					size);
+			response->bodyLength += size;
+			position += size + 2;
+			if (size == 0) {
+				return position;
+			}
+		}
+	}
+	if (contentLength != 0) {
+		response->bodyLength = atoi(contentLength);
+	} else if (peerIsClosed()) {
+		response->bodyLength = length - headLength;
+	} else {
+		return 0;
+	}
+	if (headLength + response->bodyLength > length
+			|| response->bodyLength > sizeof(response->body)) {
+		return 0;
+	}
+	memcpy(response->body, data + headLength, response->bodyLength);
+	return headLength + response->bodyLength;
+}
+
+/**
+ * Runs the stack until count responses arrived, they are checked by check.
+ */
+static int takeHttpResponses(uint32_t count,
+		int (*check)(uint32_t index, HttpResponse *response)) {
+	static uint8_t received[MAX_STREAM + 1024];
+	static uint32_t receivedLength;
+	static HttpResponse response;
+	for (uint32_t index = 0; index < count; index++) {
+		uint32_t taken = 0;
+		for (uint32_t i = 0; i < MAX_LOOPS && taken == 0; i++) {
+			if (receivedLength == sizeof(received)) {
+				return 0;
+			}
+			receivedLength += peerTakeReceived(received + receivedLength,
+					sizeof(received) - receivedLength > 0xffff ?
+							0xffff : sizeof(received) - receivedLength);
+			taken = parseHttpResponse(received, receivedLength, &response);
+			if (taken == 0) {
+				runStack();
+			}
+		}
+		if (taken == 0 || !check(index, &response)) {
+			return 0;
+		}
+		memmove(received, received + taken, receivedLength - taken);
+		receivedLength -= taken;
+	}
+	return 1;
+}
+
+static uint16_t httpDataBytes;
+
+static int checkData(HttpResponse *response) {
+	if (response->status != 200 || response->bodyLength != httpDataBytes) {
+		return 0;
+	}
+	for (uint32_t j = 0; j < response->bodyLength; j++) {
+		if (response->body[j] != bulkByte(j)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Checks the responses to the requests of runHttp, by kind.
+ */
+static int checkHttpResponse(uint32_t kind, HttpResponse *response) {
+	char expected[32];
+	switch (kind) {
+	case 0:
+		return response->status == 200 && response->bodyLength > 0
+				&& memcmp(response->body, "<html>", 6) == 0;
+	case 1:
+		return checkData(response);
+	case 2:
+		snprintf(expected, sizeof(expected), "%u %u", UPLOAD_BYTES,
+				UPLOAD_BYTES * 'x');
+		return response->status == 200
+				&& response->bodyLength == strlen(expected)
+				&& memcmp(response->body, expected, strlen(expected)) == 0;
+	case 3:
+		return response->status == 404 && response->bodyLength == 0;
+	case 4:
+		return response->status == 200
+				&& response->bodyLength == strlen(staticBody)
+				&& memcmp(response->body, staticBody, strlen(staticBody)) == 0;
+	default:
+		return response->status == 405 && response->bodyLength == 0;
+	}
+}
+
+static uint32_t httpRequestIndex;
+
+static int checkHttpRequest(uint32_t index, HttpResponse *response) {
+	return checkHttpResponse(httpRequestIndex + index, response);
+}
+
+static int checkHttpData(uint32_t index, HttpResponse *response) {
+	(void) index;
+	return checkData(response);
+}
+
+static int checkHttpParse(uint32_t index, HttpResponse *response) {
+	(void) index;
+	static const char expected[] = "-2147483648 4294967295 BEEF -3.141 "
+			"4294967295 12.5\n02c03b02000a220000";
+	return response->status == 200
+			&& response->bodyLength == strlen(expected)
+			&& memcmp(response->body, expected, strlen(expected)) == 0;
+}
+
+static const char formBoundary[] = "\r\n--frontier";
+static const char formBody[] = "preamble\r\n--frontier\r\nhello\r\n\r\n-"
+		"-frontie\r\n--frontier\r\nworld, \r\n--f a longer part\r\n--"
+		"frontier--\r\n";
+
+/**
+ * The device has to find the boundaries and count what is between them.
+ */
+static int checkHttpForm(uint32_t index, HttpResponse *response) {
+	(void) index;
+	uint32_t sum = 0;
+	for (const char *c = formBody; *c != 0; c++) {
+		sum += (uint8_t) *c;
+	}
+	for (const char *c = formBoundary; *c != 0; c++) {
+		sum -= 3 * (uint8_t) *c;
+	}
+	char expected[32];
+	snprintf(expected, sizeof(expected), "3 %u %u",
+			(unsigned) (strlen(formBody) - 3 * strlen(formBoundary)), sum);
+	return response->status == 200
+			&& response->bodyLength == strlen(expected)
+			&& memcmp(response->body, expected, strlen(expected)) == 0;
+}
+
+static int checkHttpIndex(uint32_t index, HttpResponse *response) {
+	(void) index;
+	return checkHttpResponse(0, response) && response->close;
+}
+
+static void sendText(const char *text) {
+	peerSend((const uint8_t*) text, strlen(text));
+}
+
+/**
+ * Waits until the device sent the rest of its response and closed the
+ * connection.
+ */
+static int waitForDeviceClose(void) {
+	for (uint32_t i = 0; i < MAX_LOOPS
+			&& (!peerIsClosed() || webPool.used > 0); i++) {
+		runStack();
+	}
+	return peerIsClosed() && webPool.used == 0;
+}
+
+/**
+ * Sends count requests to the http server over one connection: a small
+ * page, a chunked download, an upload, a 404 pipelined with a wildcard
+ * route and a 405. Then it checks that HTTP/1.0 and Connection: close end
+ * the connection.
+ */
+static int runHttp(uint32_t count, uint16_t dataBytes) {
+	static char upload[UPLOAD_BYTES + 128];
+	char request[128];
+
+	httpDataBytes = dataBytes;
+	if (!runUntilConnected(HTTP_PORT)) {
+		printf("http: no connection\n");
+		return 0;
+	}
+	Measurement measurement;
+	startMeasurement(&measurement, "http");
+	for (uint32_t r = 0; r < count; r++) {
+		uint32_t kind = r % 5;
+		uint32_t responses = 1;
+		switch (kind) {
+		case 0:
+			sendText("GET / HTTP/1.1\r\nHost: device\r\n\r\n");
+			break;
+		case 1:
+			snprintf(request, sizeof(request), "GET /data?n=%u HTTP/1.1\r\n"
+					"Host: device\r\nAccept: */*\r\n\r\n", dataBytes);
+			sendText(request);
+			break;
+		case 2: {
+			int length = snprintf(upload, sizeof(upload), "POST /upload "
+					"HTTP/1.1\r\nHost: device\r\nContent-Type: text/plain\r\n"
+					"content-length: %u\r\n\r\n", UPLOAD_BYTES);
+			memset(upload + length, 'x', UPLOAD_BYTES);
+			// the body comes in two segments.
+			peerSend((uint8_t*) upload, length + UPLOAD_BYTES / 2);
+			peerSend((uint8_t*) upload + length + UPLOAD_BYTES / 2,
+					UPLOAD_BYTES - UPLOAD_BYTES / 2);
+			break;
+		}
+		case 3:
+			sendText("GET /missing HTTP/1.1\r\n\r\n");
+			if (TCP_SEND_WINDOW > 1) {
+				// pipelined, both responses fit in the send window.
+				sendText("GET /static/logo.png HTTP/1.1\r\n\r\n");
+				responses = 2;
+			}
+			break;
+		default:
+			sendText("POST / HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc");
+			kind = 5;
+			break;
+		}
+		httpRequestIndex = kind;
+		if (!takeHttpResponses(responses, checkHttpRequest)) {
+			printf("http: wrong response to request %u\n", r);
+			return 0;
+		}
+		if (kind == 3 && responses == 1) {
+			sendText("GET /static/logo.png HTTP/1.1\r\n\r\n");
+			httpRequestIndex = 4;
+			if (!takeHttpResponses(1, checkHttpRequest)) {
+				printf("http: wrong response to request %u\n", r);
+				return 0;
+			}
+		}
+	}
+	struct timespec end;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+	double seconds = (end.tv_sec - measurement.start.tv_sec)
+			+ (end.tv_nsec - measurement.start.tv_nsec) / 1e9;
+	uint32_t frames = encEmuStatistics.received + encEmuStatistics.sent
+			- measurement.emu.received - measurement.emu.sent;
+	printMeasurement(&measurement);
+	printf("         %u requests, %.0f requests/s host cpu, "
+			"%.1f frames/request\n", count, seconds > 0 ? count / seconds : 0.0,
+			(double) frames / count);
+#ifdef NET_STATISTICS
+	NetStatistics now;
+	netStatisticsSnapshot(&now);
+	StatsSpi before, after;
+	netStatisticsSpiTotal(&measurement.net, &before);
+	netStatisticsSpiTotal(&now, &after);
+	printf("         %.1f SPI bytes/request\n",
+			(double) (after.bytes - before.bytes) / count);
+#endif
+
+	// every number parser, the last number ends with the package.
+	static const char parseBody[] = "-2147483648,4294967295;0xBeEf "
+			"-3.14159\n99999999999 +12.5";
+	snprintf(request, sizeof(request), "POST /parse HTTP/1.1\r\n"
+			"Content-Length: %u\r\n\r\n%s", (unsigned) strlen(parseBody),
+			parseBody);
+	sendText(request);
+	if (!takeHttpResponses(1, checkHttpParse)) {
+		printf("http: wrong numbers parsed\n");
+		return 0;
+	}
+
+	// the body comes in two segments, split in the second boundary.
+	int length = snprintf(request, sizeof(request), "POST /form HTTP/1.1\r\n"
+			"Content-Length: %u\r\n\r\n", (unsigned) strlen(formBody));
+	const char *split = strstr(formBody, "\r\nworld") - 5;
+	peerSend((const uint8_t*) request, length);
+	peerSend((const uint8_t*) formBody, split - formBody);
+	sendText(split);
+	if (!takeHttpResponses(1, checkHttpForm)) {
+		printf("http: wrong multipart boundaries\n");
+		return 0;
+	}
+
+	// HTTP/1.0 has no chunks, the device closes after the response.
+	snprintf(request, sizeof(request), "GET /data?n=%u HTTP/1.0\r\n\r\n",
+			dataBytes);
+	sendText(request);
+	if (!waitForDeviceClose() || !takeHttpResponses(1, checkHttpData)) {
+		printf("http: HTTP/1.0 response not closed\n");
+		return 0;
+	}
+	if (!runUntilConnected(HTTP_PORT)) {
+		printf("http: no connection\n");
+		return 0;
+	}
+	sendText("GET / HTTP/1.1\r\nConnection: close\r\n\r\n");
+	if (!takeHttpResponses(1, checkHttpIndex) || !waitForDeviceClose()) {
+		printf("http: Connection: close not closed\n");
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Leaves a connection idle until the device closes it.
+ */
+static int runTimeout(void) {
+	if (!runUntilConnected(ECHO_PORT)) {
+		printf("timeout: no connection\n");
+		return 0;
+	}
+	uint32_t start = loops;
+	uint32_t framesBefore = peerStatistics.framesReceived;
+	while (loops - start < TCP_TIMEOUT + 4 * TCP_FIN_WAIT_TIME
+			&& (!peerIsClosed() || echoPool.used > 0)) {
+		runStack();
+	}
+	printf("%-8s closed after %u ms idle, %u frames from the device\n",
+			"timeout", loops - start,
+			peerStatistics.framesReceived - framesBefore);
+	if (!peerIsClosed() || echoPool.used > 0) {
+		printf("timeout: not closed by the device\n");
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Asks the overflow app for a response larger than the send window. The
+ * device has to reset the connection instead of leaving it open with a
+ * cut response.
+ */
+static int runOverflow(void) {
+	static uint8_t buffer[MAX_STREAM];
+	if (!runUntilConnected(OVERFLOW_PORT)) {
+		printf("overflow: no connection\n");
+		return 0;
+	}
+	uint32_t droppedBefore = peerStatistics.framesDropped;
+	overflowSent = 1;
+	sendText("go\n");
+	for (uint32_t i = 0; i < MAX_LOOPS
+			&& (overflowPool.used > 0 || !peerIsClosed()); i++) {
+		runStack();
+		if (overflowPool.used == 0
+				&& peerStatistics.framesDropped != droppedBefore) {
+			// the reset may have been dropped, it is not sent again.
+			break;
+		}
+	}
+	uint16_t received = peerTakeReceived(buffer, sizeof(buffer));
+	printf("%-8s reset after %u bytes\n", "overflow", received);
+	for (uint16_t i = 0; i < received; i++) {
+		if (buffer[i] != bulkByte(i)) {
+			printf("overflow: wrong byte at %u\n", i);
+			return 0;
+		}
+	}
+	if (overflowSent || overflowPool.used > 0
+			|| (!peerIsClosed() && peerStatistics.framesDropped == droppedBefore)) {
+		printf("overflow: cut response not reset\n");
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Opens all connections of the peer to the plain app at once and sends a
+ * request on each of them in the same loop. There are more connections than
+ * TX slots to keep the answers, so the device has to leave some syns and
+ * requests to the peer to send again, without resetting a connection.
+ */
+static int runParallel(uint32_t count) {
+	static uint8_t responses[PEER_CONNECTIONS][16];
+	char requests[PEER_CONNECTIONS][16];
+	uint16_t received[PEER_CONNECTIONS];
+
+	for (uint8_t c = 0; c < PEER_CONNECTIONS; c++) {
+		peerSelect(c);
+		peerConnect(PLAIN_PORT);
+	}
+	uint8_t connected = 0;
+	for (uint32_t i = 0; i < MAX_LOOPS && connected < PEER_CONNECTIONS; i++) {
+		runStack();
+		connected = 0;
+		for (uint8_t c = 0; c < PEER_CONNECTIONS; c++) {
+			peerSelect(c);
+			connected += peerIsConnected();
+		}
+	}
+	if (connected < PEER_CONNECTIONS) {
+		printf("parallel: %u of %u connected\n", connected, PEER_CONNECTIONS);
+		peerSelect(0);
+		return 0;
+	}
+	uint32_t retransmittedBefore = peerStatistics.retransmitted;
+	Measurement measurement;
+	startMeasurement(&measurement, "parallel");
+	for (uint32_t r = 0; r < count; r++) {
+		for (uint8_t c = 0; c < PEER_CONNECTIONS; c++) {
+			snprintf(requests[c], sizeof(requests[c]), "%u on %u\n", r, c);
+			received[c] = 0;
+			peerSelect(c);
+			peerSend((uint8_t*) requests[c], strlen(requests[c]));
+		}
+		uint8_t done = 0;
+		for (uint32_t i = 0; i < MAX_LOOPS && done < PEER_CONNECTIONS; i++) {
+			runStack();
+			done = 0;
+			for (uint8_t c = 0; c < PEER_CONNECTIONS; c++) {
+				uint16_t length = strlen(requests[c]);
+				peerSelect(c);
+				if (peerIsClosed()) {
+					printf("parallel: connection %u reset\n", c);
+					peerSelect(0);
+					return 0;
+				}
+				received[c] += peerTakeReceived(responses[c] + received[c],
+						length - received[c]);
+				done += received[c] == length;
+			}
+		}
+		for (uint8_t c = 0; c < PEER_CONNECTIONS; c++) {
+			if (received[c] != strlen(requests[c])
+					|| memcmp(requests[c], responses[c], received[c]) != 0) {
+				printf("parallel: wrong response to request %u on %u\n", r, c);
+				peerSelect(0);
+				return 0;
+			}
+		}
+	}
+	printMeasurement(&measurement);
+	printf("%-8s %u connections, room for %u kept segments, "
+			"%u segments sent again by the peer\n", "parallel",
+			PEER_CONNECTIONS, ENC_TX_SLOTS - 1,
+			peerStatistics.retransmitted - retransmittedBefore);
+	int ok = 1;
+	for (uint8_t c = 0; c < PEER_CONNECTIONS; c++) {
+		peerSelect(c);
+		ok = closeConnection() && ok;
+	}
+	peerSelect(0);
+	return ok;
+}
+
+int main(int argc, char **argv) {
+	uint32_t requests = 1000;
+	uint16_t size = 64;
+	uint32_t bulk = 200;
+	uint16_t dropEvery = 0;
+	// default: a few times what the send window holds.
+	uint16_t streamBytes = 0;
+	uint16_t peerMss = 1460;
+	uint32_t httpRequests = 1000;
+	int demuxBenchmark = 0;
+	int checksumTest = 0;
+	int option;
+	while ((option = getopt(argc, argv, "r:s:b:d:n:p:t:m:w:lc")) != -1) {
+		switch (option) {
+		case 'r':
+			requests = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'b':
+			bulk = atoi(optarg);
+			break;
+		case 'd':
+			dropEvery = atoi(optarg);
+			break;
+		case 'n':
+			noisePerRequest = atoi(optarg);
+			break;
+		case 'p':
+			pipeline = atoi(optarg);
+			break;
+		case 't':
+			streamBytes = atoi(optarg);
+			break;
+		case 'm':
+			peerMss = atoi(optarg);
+			break;
+		case 'w':
+			httpRequests = atoi(optarg);
+			break;
+		case 'l':
+			demuxBenchmark = 1;
+			break;
+		case 'c':
+			checksumTest = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r requests] [-s request size] "
+					"[-b bulk kilobytes] [-d drop every n-th frame]\n"
+					"       [-n frames not for the device per echo request]\n"
+					"       [-p echo requests sent at once]\n"
+					"       [-t bytes per stream response] [-m mss of the peer]\n"
+					"       [-w http requests]\n"
+					"       %s -l\n"
+					"       %s -c\n", argv[0], argv[0], argv[0]);
+			return 2;
+		}
+	}
+	if (size < 2 || size > 1400) {
+		fprintf(stderr, "request size needs to be in 2..1400\n");
+		return 2;
+	}
+	if (pipeline < 1 || pipeline > MAX_PIPELINE) {
+		fprintf(stderr, "pipeline needs to be in 1..%u\n", MAX_PIPELINE);
+		return 2;
+	}
+	// what the stack puts in one segment.
+	uint16_t segmentSize = peerMss == 0 ? TCP_DEFAULT_MSS : peerMss;
+	if (segmentSize > ENC_MAX_PACKAGE_LENGTH - 54) {
+		segmentSize = ENC_MAX_PACKAGE_LENGTH - 54;
+	}
+	if (streamBytes == 0) {
+		// a few times the send window, the rest is sent as acks come in.
+		streamBytes = MAX_STREAM / 4 / TCP_SEND_WINDOW < segmentSize ?
+				MAX_STREAM : 4 * TCP_SEND_WINDOW * segmentSize;
+	}
+	if (streamBytes > MAX_STREAM) {
+		fprintf(stderr, "stream bytes need to be in 1..%u\n", MAX_STREAM);
+		return 2;
+	}
+	if (TCP_SEND_WINDOW == 1 && segmentSize < HEAD_MSS) {
+		// the rest of a split head would find no room in the send window.
+		fprintf(stderr, "with a send window of one segment, the mss needs "
+				"to be at least %u\n", HEAD_MSS);
+		return 2;
+	}
+	if (size > TCP_SEND_WINDOW * segmentSize) {
+		// the echo is sent in one go, or not at all.
+		fprintf(stderr, "an echo request can be at most %u bytes\n",
+				TCP_SEND_WINDOW * segmentSize);
+		return 2;
+	}
+
+	static const uint8_t deviceIp[4] = { 192, 168, 1, 180 };
+	encEmuReset();
+	initTcpIp();
+	initEnc();
+	if (checksumTest) {
+		return runChecksumTest() ? 0 : 1;
+	}
+	addTcpApp(&echoApp);
+	addTcpApp(&echoAllApp);
+	addTcpApp(&bulkApp);
+	addTcpApp(&streamApp);
+	if (demuxBenchmark) {
+		return runDemuxBenchmark(deviceIp) ? 0 : 1;
+	}
+	addTcpApp(&webServer.app);
+	addTcpApp(&overflowApp);
+	addTcpApp(&plainApp);
+	peerInit(deviceIp, dropEvery);
+	peerSetMss(peerMss);
+
+	peerSendArpRequest();
+	for (int i = 0; i < 10 && !peerHasArpReply(); i++) {
+		runStack();
+	}
+	if (!peerHasArpReply()) {
+		printf("arp: no reply\n");
+		return 1;
+	}
+
+	printf("memory: rx 0x%04x-0x%04x (%u bytes), tx %u x %u bytes at 0x%04x, "
+			"templates %u x %u bytes at 0x%04x\n", ENC_RX_START, ENC_RX_END,
+			ENC_RX_SIZE, ENC_TX_SLOTS, ENC_TX_SLOT_SIZE, ENC_TX_START,
+			ENC_TEMPLATES, ENC_TEMPLATE_SIZE, ENC_TEMPLATE_START);
+#ifdef NET_STATISTICS
+	runIdle(1000);
+#endif
+	int ok = runEcho("echo", ECHO_PORT, requests, size)
+			&& runEcho("echo-all", ECHO_ALL_PORT, requests, size)
+			&& runBulk(bulk)
+			&& runStream(requests / 10 + 1, streamBytes)
+			&& runHttp(httpRequests, streamBytes > 512 ? streamBytes - 256 :
+					streamBytes / 2)
+			&& runOverflow()
+			&& runParallel(requests / 10 + 1)
+			&& runTimeout();
+	printf("peer: %u frames, %u dropped, %u out of order, %u checksum errors, "
+			"%u oversized, %u sent again | mss of the device %u\n",
+			peerStatistics.framesReceived, peerStatistics.framesDropped,
+			peerStatistics.outOfOrder, peerStatistics.checksumErrors,
+			peerStatistics.oversized, peerStatistics.retransmitted,
+			peerStatistics.deviceMss);
+	printf("enc: %u delivered, %u overflows, %u filtered in hardware, "
+			"%u dma runs\n", encEmuStatistics.received,
+			encEmuStatistics.overflows, encEmuStatistics.filtered,
+			encEmuStatistics.dmaRuns);
+#ifdef NET_STATISTICS
+	printf("tx: %u sent, %u stalls, %u queued at most\n", netStatistics.txSent,
+			netStatistics.txStalls, netStatistics.txMaxQueueDepth);
+	printf("rx: %u received, %u overflows, %u pending at most\n",
+			netStatistics.rxReceived, netStatistics.rxOverflows,
+			netStatistics.rxMaxPending);
+	printStatistics();
+#endif
+	printf("sessions: echo %u used %u most, bulk %u used %u most, "
+			"stream %u used %u most, http %u used %u most\n", echoPool.used,
+			echoPool.highWater, bulkPool.used, bulkPool.highWater,
+			streamPool.used, streamPool.highWater, webPool.used,
+			webPool.highWater);
+	if (peerStatistics.checksumErrors > 0 || peerStatistics.oversized > 0) {
+		ok = 0;
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,448 @@
+/*
+ * peer.c
+ *
+ * A minimal TCP/IP peer for the host build.
+ */
+
+#include "peer.h"
+#include "encemu.h"
+#include <string.h>
+
+#define FLAG_FIN 0x01
+#define FLAG_SYN 0x02
+#define FLAG_RST 0x04
+#define FLAG_PSH 0x08
+#define FLAG_ACK 0x10
+
+// port of the first connection, the others follow.
+#define PEER_PORT 40000
+// segments that can wait for an ack of the device, per connection.
+#define PEER_MAX_UNACKED 32
+
+PeerStatistics peerStatistics;
+
+static const uint8_t peerMac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+static const uint8_t peerIp[4] = { 192, 168, 1, 2 };
+static uint8_t deviceMac[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+static uint8_t deviceIp[4];
+static uint8_t arpReplied;
+
+static uint16_t dropEvery;
+static uint16_t mss = 1460;
+static uint32_t frameCounter;
+
+typedef struct {
+	uint32_t seq;
+	uint8_t flags;
+	uint16_t length;
+	uint8_t data[ENCEMU_MAX_FRAME];
+} PeerSegment;
+
+typedef struct {
+	uint16_t port;
+	uint16_t devicePort;
+	uint32_t sendNext;
+	uint32_t receiveNext;
+	uint8_t connected;
+	uint8_t closed;
+	uint8_t finSent;
+
+	uint8_t received[PEER_MAX_RECEIVED];
+	uint32_t receivedLength;
+
+	// sent segments with data, syn or fin that the device did not
+	// acknowledge, oldest first.
+	PeerSegment unacked[PEER_MAX_UNACKED];
+	uint8_t unackedCount;
+	// milliseconds since the oldest of them was sent.
+	uint16_t retransmitTimer;
+} PeerConnection;
+
+static PeerConnection connections[PEER_CONNECTIONS];
+// the connection the calls from outside are for, see peerSelect().
+static PeerConnection *selected = &connections[0];
+
+static uint32_t sum(const uint8_t *data, uint16_t length, uint32_t start) {
+	for (uint16_t i = 0; i < length; i++) {
+		start += (i & 1) ? data[i] : (uint16_t) data[i] << 8;
+	}
+	return start;
+}
+
+static uint16_t fold(uint32_t value) {
+	while (value >> 16) {
+		value = (value & 0xffff) + (value >> 16);
+	}
+	return (uint16_t) value;
+}
+
+static uint32_t pseudoHeaderSum(const uint8_t *source,
+		const uint8_t *destination, uint16_t tcpLength) {
+	uint32_t result = sum(source, 4, 0);
+	result = sum(destination, 4, result);
+	return result + 6 + tcpLength;
+}
+
+static void put16(uint8_t *to, uint16_t value) {
+	to[0] = (uint8_t) (value >> 8);
+	to[1] = (uint8_t) value;
+}
+
+static void put32(uint8_t *to, uint32_t value) {
+	put16(to, (uint16_t) (value >> 16));
+	put16(to + 2, (uint16_t) value);
+}
+
+static uint16_t get16(const uint8_t *from) {
+	return ((uint16_t) from[0] << 8) | from[1];
+}
+
+static uint32_t get32(const uint8_t *from) {
+	return ((uint32_t) get16(from) << 16) | get16(from + 2);
+}
+
+void peerInit(const uint8_t *ip, uint16_t drop) {
+	memcpy(deviceIp, ip, 4);
+	memset(&peerStatistics, 0, sizeof(peerStatistics));
+	dropEvery = drop;
+	frameCounter = 0;
+	arpReplied = 0;
+	for (uint8_t i = 0; i < PEER_CONNECTIONS; i++) {
+		PeerConnection *connection = &connections[i];
+		connection->port = PEER_PORT + i;
+		connection->connected = 0;
+		connection->closed = 0;
+		connection->receivedLength = 0;
+		connection->unackedCount = 0;
+	}
+	selected = &connections[0];
+}
+
+void peerSelect(uint8_t index) {
+	selected = &connections[index];
+}
+
+static void sendArpRequest(const uint8_t *targetIp) {
+	uint8_t frame[42];
+	memset(frame, 0xff, 6);
+	memcpy(frame + 6, peerMac, 6);
+	put16(frame + 12, 0x0806);
+	put16(frame + 14, 1);
+	put16(frame + 16, 0x0800);
+	frame[18] = 6;
+	frame[19] = 4;
+	put16(frame + 20, 1);
+	memcpy(frame + 22, peerMac, 6);
+	memcpy(frame + 28, peerIp, 4);
+	memset(frame + 32, 0, 6);
+	memcpy(frame + 38, targetIp, 4);
+	encEmuReceive(frame, sizeof(frame));
+}
+
+void peerSendArpRequest(void) {
+	sendArpRequest(deviceIp);
+}
+
+void peerSendNoise(void) {
+	static const uint8_t otherIp[4] = { 192, 168, 1, 77 };
+	static const uint8_t otherMac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x99 };
+	sendArpRequest(otherIp);
+
+	// an ip frame to all and one to someone else
+	uint8_t frame[60];
+	memset(frame, 0, sizeof(frame));
+	memset(frame, 0xff, 6);
+	memcpy(frame + 6, peerMac, 6);
+	put16(frame + 12, 0x0800);
+	frame[14] = 0x45;
+	put16(frame + 16, 46);
+	frame[23] = 17;
+	memcpy(frame + 26, peerIp, 4);
+	memset(frame + 30, 0xff, 4);
+	encEmuReceive(frame, sizeof(frame));
+
+	memcpy(frame, otherMac, 6);
+	memcpy(frame + 30, otherIp, 4);
+	encEmuReceive(frame, sizeof(frame));
+}
+
+uint8_t peerHasArpReply(void) {
+	return arpReplied;
+}
+
+void peerSetMss(uint16_t value) {
+	mss = value;
+}
+
+static void sendFrame(PeerConnection *connection, uint32_t seq,
+		uint8_t flags, const uint8_t *data, uint16_t length) {
+	uint8_t frame[ENCEMU_MAX_FRAME];
+	uint8_t optionLength = (flags & FLAG_SYN) && mss ? 4 : 0;
+	uint16_t tcpLength = 20 + optionLength + length;
+	memcpy(frame, deviceMac, 6);
+	memcpy(frame + 6, peerMac, 6);
+	put16(frame + 12, 0x0800);
+
+	uint8_t *ip = frame + 14;
+	memset(ip, 0, 20);
+	ip[0] = 0x45;
+	put16(ip + 2, 20 + tcpLength);
+	ip[8] = 64;
+	ip[9] = 6;
+	memcpy(ip + 12, peerIp, 4);
+	memcpy(ip + 16, deviceIp, 4);
+	put16(ip + 10, fold(sum(ip, 20, 0)) ^ 0xffff);
+
+	uint8_t *tcp = ip + 20;
+	memset(tcp, 0, 20);
+	put16(tcp, connection->port);
+	put16(tcp + 2, connection->devicePort);
+	put32(tcp + 4, seq);
+	put32(tcp + 8, (flags & FLAG_ACK) ? connection->receiveNext : 0);
+	tcp[12] = (5 + optionLength / 4) << 4;
+	tcp[13] = flags;
+	put16(tcp + 14, 0xffff);
+	if (optionLength) {
+		tcp[20] = 2;
+		tcp[21] = 4;
+		put16(tcp + 22, mss);
+	}
+	if (length > 0) {
+		memcpy(tcp + 20 + optionLength, data, length);
+	}
+	uint32_t checksum = pseudoHeaderSum(peerIp, deviceIp, tcpLength);
+	put16(tcp + 16, fold(sum(tcp, tcpLength, checksum)) ^ 0xffff);
+
+	encEmuReceive(frame, 14 + 20 + tcpLength);
+}
+
+/**
+ * Sends a segment at sendNext. If it takes sequence numbers, it is kept
+ * until the device acknowledges it.
+ */
+static void sendSegment(PeerConnection *connection, uint8_t flags,
+		const uint8_t *data, uint16_t length) {
+	sendFrame(connection, connection->sendNext, flags, data, length);
+	if ((length > 0 || (flags & (FLAG_SYN | FLAG_FIN)))
+			&& connection->unackedCount < PEER_MAX_UNACKED) {
+		PeerSegment *segment =
+				&connection->unacked[connection->unackedCount++];
+		segment->seq = connection->sendNext;
+		segment->flags = flags;
+		segment->length = length;
+		if (length > 0) {
+			memcpy(segment->data, data, length);
+		}
+		if (connection->unackedCount == 1) {
+			connection->retransmitTimer = 0;
+		}
+	}
+	connection->sendNext += length;
+	if (flags & (FLAG_SYN | FLAG_FIN)) {
+		connection->sendNext++;
+	}
+}
+
+static uint32_t segmentEnd(const PeerSegment *segment) {
+	return segment->seq + segment->length
+			+ ((segment->flags & (FLAG_SYN | FLAG_FIN)) ? 1 : 0);
+}
+
+/**
+ * Forgets the segments the device acknowledged.
+ */
+static void acknowledged(PeerConnection *connection, uint32_t ack) {
+	PeerSegment *unacked = connection->unacked;
+	uint8_t acked = 0;
+	while (acked < connection->unackedCount
+			&& (int32_t) (ack - segmentEnd(&unacked[acked])) >= 0) {
+		acked++;
+	}
+	if (acked > 0) {
+		connection->unackedCount -= acked;
+		memmove(unacked, unacked + acked,
+				connection->unackedCount * sizeof(unacked[0]));
+		connection->retransmitTimer = 0;
+	}
+}
+
+/**
+ * Sends all segments the device did not acknowledge again, in order.
+ */
+static void retransmit(PeerConnection *connection) {
+	for (uint8_t i = 0; i < connection->unackedCount; i++) {
+		PeerSegment *segment = &connection->unacked[i];
+		sendFrame(connection, segment->seq, segment->flags, segment->data,
+				segment->length);
+		peerStatistics.retransmitted++;
+	}
+	connection->retransmitTimer = 0;
+}
+
+void peerTimerTick(void) {
+	for (uint8_t i = 0; i < PEER_CONNECTIONS; i++) {
+		PeerConnection *connection = &connections[i];
+		if (connection->unackedCount > 0
+				&& ++connection->retransmitTimer >= PEER_RETRANSMIT_TIME) {
+			retransmit(connection);
+		}
+	}
+}
+
+void peerConnect(uint16_t port) {
+	selected->devicePort = port;
+	selected->sendNext = 1000;
+	selected->connected = 0;
+	selected->closed = 0;
+	selected->finSent = 0;
+	selected->unackedCount = 0;
+	sendSegment(selected, FLAG_SYN, 0, 0);
+}
+
+uint8_t peerIsConnected(void) {
+	return selected->connected;
+}
+
+void peerSend(const uint8_t *data, uint16_t length) {
+	sendSegment(selected, FLAG_ACK | FLAG_PSH, data, length);
+}
+
+void peerClose(void) {
+	if (selected->finSent) {
+		// repeat the fin, without waiting for the retransmission.
+		retransmit(selected);
+		return;
+	}
+	selected->finSent = 1;
+	sendSegment(selected, FLAG_ACK | FLAG_FIN, 0, 0);
+}
+
+uint8_t peerIsClosed(void) {
+	return selected->closed;
+}
+
+/**
+ * Finds the connection a segment of the device is for, or 0.
+ */
+static PeerConnection *findConnection(uint16_t devicePort, uint16_t port) {
+	for (uint8_t i = 0; i < PEER_CONNECTIONS; i++) {
+		PeerConnection *connection = &connections[i];
+		if (connection->port == port && connection->devicePort == devicePort) {
+			return connection;
+		}
+	}
+	return 0;
+}
+
+static void tcpReceived(const uint8_t *ip, const uint8_t *tcp,
+		uint16_t tcpLength) {
+	uint32_t checksum = pseudoHeaderSum(ip + 12, ip + 16, tcpLength);
+	if (fold(sum(tcp, tcpLength, checksum)) != 0xffff) {
+		peerStatistics.checksumErrors++;
+		return;
+	}
+	PeerConnection *connection = findConnection(get16(tcp), get16(tcp + 2));
+	if (connection == 0) {
+		return;
+	}
+	uint8_t flags = tcp[13];
+	uint16_t headerLength = (tcp[12] >> 4) * 4;
+	uint16_t dataLength = tcpLength - headerLength;
+	uint32_t seq = get32(tcp + 4);
+
+	if (flags & FLAG_RST) {
+		connection->closed = 1;
+		connection->unackedCount = 0;
+		return;
+	}
+	if (flags & FLAG_ACK) {
+		acknowledged(connection, get32(tcp + 8));
+	}
+	if ((flags & FLAG_SYN) && (flags & FLAG_ACK)) {
+		peerStatistics.deviceMss = 0;
+		if (headerLength >= 24 && tcp[20] == 2 && tcp[21] == 4) {
+			peerStatistics.deviceMss = get16(tcp + 22);
+		}
+		connection->receiveNext = seq + 1;
+		connection->connected = 1;
+		sendSegment(connection, FLAG_ACK, 0, 0);
+		return;
+	}
+	if (dataLength > (mss ? mss : 536)) {
+		peerStatistics.oversized++;
+	}
+	if (dataLength == 0 && !(flags & FLAG_FIN)) {
+		// pure ack or keep-alive.
+		return;
+	}
+	if (seq != connection->receiveNext) {
+		peerStatistics.outOfOrder++;
+	} else {
+		uint32_t space = PEER_MAX_RECEIVED - connection->receivedLength;
+		uint16_t take = dataLength < space ? dataLength : (uint16_t) space;
+		memcpy(connection->received + connection->receivedLength,
+				tcp + headerLength, take);
+		connection->receivedLength += take;
+		peerStatistics.bytesReceived += dataLength;
+		connection->receiveNext += dataLength;
+		if (flags & FLAG_FIN) {
+			connection->receiveNext++;
+			connection->closed = 1;
+			if (!connection->finSent) {
+				// the device closed first, close, too.
+				connection->finSent = 1;
+				sendSegment(connection, FLAG_ACK | FLAG_FIN, 0, 0);
+				return;
+			}
+		}
+	}
+	sendSegment(connection, FLAG_ACK, 0, 0);
+}
+
+static void frameReceived(const uint8_t *frame, uint16_t length) {
+	if (length < 14) {
+		return;
+	}
+	uint16_t type = get16(frame + 12);
+	if (type == 0x0806 && length >= 42 && get16(frame + 20) == 2
+			&& memcmp(frame + 28, deviceIp, 4) == 0) {
+		memcpy(deviceMac, frame + 22, 6);
+		arpReplied = 1;
+	} else if (type == 0x0800 && length >= 34) {
+		const uint8_t *ip = frame + 14;
+		uint16_t ipLength = get16(ip + 2);
+		uint16_t headerLength = (ip[0] & 0x0f) * 4;
+		if (fold(sum(ip, headerLength, 0)) != 0xffff) {
+			peerStatistics.checksumErrors++;
+			return;
+		}
+		if (ip[9] == 6 && ipLength <= length - 14) {
+			memcpy(deviceMac, frame + 6, 6);
+			tcpReceived(ip, ip + headerLength, ipLength - headerLength);
+		}
+	}
+}
+
+void peerProcess(void) {
+	uint8_t frame[ENCEMU_MAX_FRAME];
+	uint16_t length;
+	while ((length = encEmuTakeSent(frame)) > 0) {
+		frameCounter++;
+		if (dropEvery && frameCounter % dropEvery == 0) {
+			peerStatistics.framesDropped++;
+			continue;
+		}
+		peerStatistics.framesReceived++;
+		frameReceived(frame, length);
+	}
+}
+
+uint16_t peerTakeReceived(uint8_t *buffer, uint16_t maxLength) {
+	uint32_t receivedLength = selected->receivedLength;
+	uint16_t length = receivedLength < maxLength ? receivedLength : maxLength;
+	memcpy(buffer, selected->received, length);
+	memmove(selected->received, selected->received + length,
+			receivedLength - length);
+	selected->receivedLength -= length;
+	return length;
+}
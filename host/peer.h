@@ -0,0 +1,90 @@
+/*
+ * peer.h
+ *
+ * A minimal TCP/IP peer that talks to the stack through the emulated enc.
+ * It opens connections, sends requests, acknowledges everything it receives
+ * in order and can drop frames to emulate a lossy link. What the device
+ * does not acknowledge is sent again after PEER_RETRANSMIT_TIME.
+ *
+ * It has PEER_CONNECTIONS connections, each from its own port. The calls
+ * for one connection go to the one chosen with peerSelect(), the first
+ * one unless another is chosen.
+ */
+
+#ifndef PEER_H_
+#define PEER_H_
+
+#include <stdint.h>
+
+#define PEER_MAX_RECEIVED 0x10000
+#define PEER_CONNECTIONS 4
+// milliseconds, longer than the delayed ack of the device.
+#define PEER_RETRANSMIT_TIME 300
+
+typedef struct {
+	uint32_t framesReceived;
+	uint32_t framesDropped;
+	// segments that did not start at the expected sequence number
+	uint32_t outOfOrder;
+	uint32_t checksumErrors;
+	uint32_t bytesReceived;
+	// segments with more data than the mss of the peer
+	uint32_t oversized;
+	// segments the peer sent again
+	uint32_t retransmitted;
+	// mss in the syn ack of the device, 0 if there was none
+	uint16_t deviceMss;
+} PeerStatistics;
+
+extern PeerStatistics peerStatistics;
+
+/**
+ * @param deviceIp The ip the stack uses.
+ * @param dropEvery Drop every n-th frame sent by the stack, 0 for none.
+ */
+void peerInit(const uint8_t *deviceIp, uint16_t dropEvery);
+/**
+ * Sets the maximum segment size the peer announces in its syn, 0 sends
+ * none. The default is 1460.
+ */
+void peerSetMss(uint16_t mss);
+
+/**
+ * Sends an arp request for the device ip.
+ */
+void peerSendArpRequest(void);
+uint8_t peerHasArpReply(void);
+/**
+ * Sends frames that are not for the device: an arp request for another ip, an
+ * ip broadcast and an ip frame to another mac.
+ */
+void peerSendNoise(void);
+
+/**
+ * Chooses the connection for peerConnect(), peerSend(), peerClose(),
+ * peerTakeReceived() and the state queries, index is in
+ * 0..PEER_CONNECTIONS - 1.
+ */
+void peerSelect(uint8_t index);
+
+void peerConnect(uint16_t port);
+uint8_t peerIsConnected(void);
+void peerSend(const uint8_t *data, uint16_t length);
+void peerClose(void);
+uint8_t peerIsClosed(void);
+
+/**
+ * Handles all frames the stack sent.
+ */
+void peerProcess(void);
+/**
+ * Call every millisecond, runs the retransmission timer.
+ */
+void peerTimerTick(void);
+
+/**
+ * Gets the data received in order since the last call, and forgets it.
+ */
+uint16_t peerTakeReceived(uint8_t *buffer, uint16_t maxLength);
+
+#endif /* PEER_H_ */
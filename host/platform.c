@@ -0,0 +1,71 @@
+/*
+ * platform.c
+ *
+ * Connects the stack to the emulated enc on the host.
+ */
+
+#include "spiport.h"
+#include "encemu.h"
+#include "stats.h"
+#include "enc28j60.h"
+#include <avr/eeprom.h>
+#include <string.h>
+#include <time.h>
+
+void spiPortInit(void) {
+	encEmuDeselect();
+}
+
+void spiPortSelect(void) {
+	encEmuSelect();
+}
+
+void spiPortDeselect(void) {
+	encEmuDeselect();
+}
+
+uint8_t spiPortTransfer(uint8_t value) {
+	return encEmuTransfer(value);
+}
+
+#ifdef ENC_INTERRUPT
+static uint8_t interruptEnabled;
+
+static void interruptPinLow(void) {
+	if (interruptEnabled) {
+		encInterrupt();
+	}
+}
+
+void spiPortEnableInterrupt(void) {
+	encEmuInterrupt = interruptPinLow;
+	interruptEnabled = 1;
+	// a low level fires at once.
+	if (!encEmuInterruptPin()) {
+		encInterrupt();
+	}
+}
+
+void spiPortDisableInterrupt(void) {
+	interruptEnabled = 0;
+}
+#endif
+
+void eeprom_read_block(void *destination, const void *source, size_t length) {
+	memcpy(destination, source, length);
+}
+
+void eeprom_write_block(const void *source, void *destination, size_t length) {
+	memcpy(destination, source, length);
+}
+
+#ifdef NET_STATISTICS
+/**
+ * Cycles are nanoseconds of cpu time on the host.
+ */
+StatsCycles statsHostCycles(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+	return (StatsCycles) (now.tv_sec * 1000000000ull + now.tv_nsec);
+}
+#endif
@@ -0,0 +1,139 @@
+/*
+ * selftest.c
+ *
+ * Randomized checks of single parts of the stack.
+ */
+
+#include "selftest.h"
+#include "enc28j60.h"
+#include "encemu.h"
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECKSUM_PACKAGES 3000
+// offset of the checksum in the tcp header
+#define CHECKSUM_OFFSET 16
+// room left in a package for the longest write
+#define CHECKSUM_MAX_WRITE 64
+
+static uint16_t naiveChecksum(const uint8_t *data, uint16_t length,
+		uint16_t pseudoHeader) {
+	uint32_t sum = (uint32_t) pseudoHeader + length;
+	for (uint16_t i = 0; i < length; i++) {
+		sum += (i & 1) ? data[i] : (uint32_t) data[i] << 8;
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return (uint16_t) sum ^ 0xffff;
+}
+
+/**
+ * Writes one random package, the same bytes go to expected. Returns its
+ * length.
+ */
+static uint16_t writeRandomPackage(uint8_t *expected, uint16_t start,
+		uint16_t pseudoHeader) {
+	uint16_t position = 0;
+	uint16_t limit = ENC_MAX_PACKAGE_LENGTH - CHECKSUM_MAX_WRITE;
+	uint16_t length = start + CHECKSUM_OFFSET + 2
+			+ rand() % (limit - start - CHECKSUM_OFFSET - 2);
+
+	encStartPackage();
+	while (position < start) {
+		expected[position] = rand();
+		encWriteChar(expected[position++]);
+	}
+	encStartChecksum(start);
+	while (position < length) {
+		uint8_t data[CHECKSUM_MAX_WRITE];
+		uint8_t size = 1 + rand() % (CHECKSUM_MAX_WRITE - 1);
+		for (uint8_t i = 0; i < size; i++) {
+			data[i] = rand();
+		}
+		switch (rand() % 6) {
+		case 0:
+			encWriteChar(data[0]);
+			size = 1;
+			break;
+		case 1:
+			encWriteSequence(data, size);
+			break;
+		case 2: {
+			uint32_t value = (uint32_t) rand() << 8 ^ rand();
+			size = snprintf((char*) data, sizeof(data), "%u|%x", value, value);
+			encWriteFormat_P(PSTR("%lu|%lx"), value, value);
+			break;
+		}
+		case 3:
+			// back into what was written, often to an odd offset.
+			size = rand() % CHECKSUM_MAX_WRITE;
+			position = position - start > size ? position - size : start;
+			encSetWritePointer(position);
+			size = 0;
+			break;
+#if ENC_TEMPLATES > 0
+		case 4:
+			if (size > ENC_TEMPLATE_SIZE) {
+				size = ENC_TEMPLATE_SIZE;
+			}
+			encWriteTemplate(0, data, size);
+			encCopyTemplate(0, size);
+			break;
+#endif
+		default: {
+			uint16_t parameters[1] = { (uint16_t) rand() };
+			size = snprintf((char*) data, sizeof(data), "<%u>", parameters[0]);
+			encWriteStringParameters_P(PSTR("<%>"), parameters, 1);
+			break;
+		}
+		}
+		memcpy(expected + position, data, size);
+		position += size;
+	}
+	// the checksum field is summed as 0.
+	encSetWritePointer(start + CHECKSUM_OFFSET);
+	encWriteChar(0);
+	encWriteChar(0);
+	expected[start + CHECKSUM_OFFSET] = 0;
+	expected[start + CHECKSUM_OFFSET + 1] = 0;
+	// the package may end short of the bytes written before a rewind.
+	encSetWritePointer(position);
+	encComputeTcpChecksum(pseudoHeader, start);
+	return position;
+}
+
+int runChecksumTest(void) {
+	static uint8_t expected[ENC_MAX_PACKAGE_LENGTH];
+	static uint8_t frame[ENCEMU_MAX_FRAME];
+	srand(2);
+	for (uint16_t n = 0; n < CHECKSUM_PACKAGES; n++) {
+		uint16_t start = rand() % 60;
+		uint16_t pseudoHeader = rand();
+		uint16_t length = writeRandomPackage(expected, start, pseudoHeader);
+		encSend();
+		uint16_t sent = encEmuTakeSent(frame);
+
+		uint16_t checksum = ((uint16_t) frame[start + CHECKSUM_OFFSET] << 8)
+				| frame[start + CHECKSUM_OFFSET + 1];
+		uint16_t reference = naiveChecksum(expected + start, length - start,
+				pseudoHeader);
+		frame[start + CHECKSUM_OFFSET] = 0;
+		frame[start + CHECKSUM_OFFSET + 1] = 0;
+		if (sent < length || memcmp(frame, expected, length) != 0) {
+			printf("checksum: package %u was not written as expected\n", n);
+			return 0;
+		}
+		if (checksum != reference) {
+			printf("checksum: package %u of %u bytes has checksum %04x "
+					"instead of %04x\n", n, length - start, checksum,
+					reference);
+			return 0;
+		}
+	}
+	printf("checksum: %u random packages match the reference sum\n",
+			CHECKSUM_PACKAGES);
+	return 1;
+}
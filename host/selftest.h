@@ -0,0 +1,20 @@
+/*
+ * selftest.h
+ *
+ * Randomized checks of single parts of the stack against naive reference
+ * implementations, run by the host program with -c.
+ */
+
+#ifndef SELFTEST_H_
+#define SELFTEST_H_
+
+/**
+ * Writes random packages with every write function, rewinds of the write
+ * pointer and odd lengths, and compares the tcp checksum the enc code
+ * computes with a plain ones complement sum over the sent frame. The enc
+ * needs to be initialized, the stack must not run.
+ * Returns 0 on failure.
+ */
+int runChecksumTest(void);
+
+#endif /* SELFTEST_H_ */
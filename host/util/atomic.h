@@ -0,0 +1,17 @@
+/*
+ * atomic.h
+ *
+ * Host replacement for util/atomic.h: the host program has no interrupts,
+ * so an atomic block is an ordinary block.
+ */
+
+#ifndef HOST_ATOMIC_H_
+#define HOST_ATOMIC_H_
+
+#include <stdint.h>
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type) \
+	for (uint8_t atomicBlockOnce = 1; atomicBlockOnce; atomicBlockOnce = 0)
+
+#endif /* HOST_ATOMIC_H_ */
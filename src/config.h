@@ -18,5 +18,118 @@
 
 #define MY_MAC {MY_MAC_1, MY_MAC_2, MY_MAC_3, MY_MAC_4, MY_MAC_5, MY_MAC_6}
 
+/**
+ * How the checksum of outgoing TCP packages is computed:
+ * ENC_CHECKSUM_READBACK reads the package back over SPI,
+ * ENC_CHECKSUM_DMA lets the checksum engine of the enc sum it up in chip memory,
+ * ENC_CHECKSUM_STREAM sums up the bytes while they are written.
+ */
+#define ENC_CHECKSUM_READBACK 0
+#define ENC_CHECKSUM_DMA 1
+#define ENC_CHECKSUM_STREAM 2
+#ifndef ENC_CHECKSUM_MODE
+#define ENC_CHECKSUM_MODE ENC_CHECKSUM_STREAM
+#endif
+
+/**
+ * The enc only receives frames to our mac and arp requests for our ip.
+ * Define this to receive all broadcast frames, too.
+ */
+//#define ENC_RECEIVE_BROADCAST
+
+/**
+ * Most received packages pollEnc() handles in one call.
+ */
+#ifndef ENC_RX_BUDGET
+#define ENC_RX_BUDGET 4
+#endif
+
+/**
+ * Define this if the INT pin of the enc is connected (INT0 on the avr).
+ * pollEnc() then only talks to the enc after the interrupt fired, idle loops
+ * cost no SPI traffic. Needs sei().
+ */
+//#define ENC_INTERRUPT
+
+/**
+ * Size of the RAM buffer that collects small writes to the enc, so that they
+ * are sent in one SPI burst. 0 sends every write in its own SPI frame.
+ */
+#ifndef ENC_WRITE_BUFFER_SIZE
+#define ENC_WRITE_BUFFER_SIZE 16
+#endif
+
+/**
+ * encCopyIncommingOutgoingAll() lets the dma of the enc copy at least this
+ * many bytes, smaller amounts are read and written over SPI. In
+ * ENC_CHECKSUM_STREAM mode, the copied bytes are summed up by the checksum
+ * engine (see the note on ENC_CHECKSUM_DMA in enc28j60.c). Set it higher
+ * than a package to never use the dma for copying.
+ */
+#ifndef ENC_DMA_COPY_MIN
+#define ENC_DMA_COPY_MIN 32
+#endif
+
+/**
+ * How the 8 KB buffer memory of the enc is split (see encmemory.h). The
+ * receive buffer always gets what the TX slots and templates leave:
+ * ENC_MEMORY_BALANCED: 3 TX slots, 3 KB to receive.
+ * ENC_MEMORY_RX_HEAVY: 2 TX slots, 4.5 KB to receive bursts of frames.
+ * ENC_MEMORY_TX_HEAVY: 4 TX slots, 1.5 KB to receive (one full frame).
+ * ENC_TX_SLOTS, ENC_TX_SLOT_SIZE and ENC_TEMPLATES override the profile.
+ */
+#define ENC_MEMORY_BALANCED 0
+#define ENC_MEMORY_RX_HEAVY 1
+#define ENC_MEMORY_TX_HEAVY 2
+#ifndef ENC_MEMORY_PROFILE
+#define ENC_MEMORY_PROFILE ENC_MEMORY_BALANCED
+#endif
+
+/**
+ * The send buffer of the enc is split in ENC_TX_SLOTS slots of
+ * ENC_TX_SLOT_SIZE bytes. Each slot holds one queued package, so up to
+ * ENC_TX_SLOTS packages can be sent back to back. A slot needs 8 bytes more
+ * than the package it holds.
+ */
+#ifndef ENC_TX_SLOTS
+#if ENC_MEMORY_PROFILE == ENC_MEMORY_RX_HEAVY
+#define ENC_TX_SLOTS 2
+#elif ENC_MEMORY_PROFILE == ENC_MEMORY_TX_HEAVY
+#define ENC_TX_SLOTS 4
+#else
+#define ENC_TX_SLOTS 3
+#endif
+#endif
+#ifndef ENC_TX_SLOT_SIZE
+#define ENC_TX_SLOT_SIZE 0x600
+#endif
+
+/**
+ * The ethernet and ip header of the first ENC_TEMPLATES channels is kept in
+ * the enc memory at its end, ENC_TEMPLATE_SIZE bytes each. Their
+ * segments copy it with the dma instead of sending it over SPI.
+ * 0 turns this off.
+ */
+#ifndef ENC_TEMPLATES
+#define ENC_TEMPLATES 10
+#endif
+#ifndef ENC_TEMPLATE_SIZE
+#define ENC_TEMPLATE_SIZE 34
+#endif
+
+/**
+ * Longest pattern encScanStart() takes. An EncScan keeps the pattern and
+ * its KMP table, 2 bytes of RAM per pattern byte.
+ */
+#ifndef ENC_SCAN_MAX_PATTERN
+#define ENC_SCAN_MAX_PATTERN 32
+#endif
+
+/**
+ * Counts SPI traffic, frames per layer and cycles of the hot paths in
+ * netStatistics, see stats.h.
+ */
+//#define NET_STATISTICS
+
 
 #endif
@@ -6,10 +6,17 @@
  */
 
 #include <stdint.h>
-#include <avr/io.h>
+#include <stdarg.h>
+#include <string.h>
 #include <avr/pgmspace.h>
 #include "enc28j60.h"
 #include "config.h"
+#include "spiport.h"
+#include "stats.h"
+
+#if defined(ENC_INTERRUPT) && !defined(ENC_HOST)
+#include <avr/interrupt.h>
+#endif
 
 //#define DEBUG_ENC
 
@@ -22,19 +29,8 @@
 #define debugHex(n)
 #endif
 
-#define RECEIVE_START 0x00
-#define RECEIVE_END 0x0800
-#define ENC_SEND_START 0x0801
-#define ENC_SEND_END 0x0b00
 #define MAX_FRAMELENGTH 1518
 
-#define SPI_SS_PIN 4
-#define SPI_MOSI_PIN 5
-#define SPI_MISO_PIN 6
-#define SPI_SCK_PIN 7
-#define SPI_PORT PORTB
-#define SPI_DDR DDRB
-
 #define ENC_COMMAND_READ 0x00
 #define ENC_COMMAND_WRITE 0x40
 #define ENC_COMMAND_SETBITS 0x80
@@ -65,9 +61,30 @@
 #define ENC_ERXRDPTH 0x0d
 #define ENC_ERXWRPTL 0x0e
 #define ENC_ERXWRPTH 0x0f
+#define ENC_EDMASTL 0x10
+#define ENC_EDMASTH 0x11
+#define ENC_EDMANDL 0x12
+#define ENC_EDMANDH 0x13
+#define ENC_EDMADSTL 0x14
+#define ENC_EDMADSTH 0x15
+#define ENC_EDMACSL 0x16
+#define ENC_EDMACSH 0x17
 #define ENC_ESTAT 0x1d
 #define ENC_CLKRDY 0
 
+#define ENC_EPMM0 (0x40 | 0x08)
+#define ENC_EPMCSL (0x40 | 0x10)
+#define ENC_EPMCSH (0x40 | 0x11)
+#define ENC_EPMOL (0x40 | 0x14)
+#define ENC_EPMOH (0x40 | 0x15)
+#define ENC_ERXFCON (0x40 | 0x18)
+#define ENC_EPKTCNT (0x40 | 0x19)
+#define ENC_UCEN 7
+#define ENC_ANDOR 6
+#define ENC_CRCEN 5
+#define ENC_PMEN 4
+#define ENC_BCEN 0
+
 #define ENC_MACON1 (0x80 | 0x00)
 #define ENC_TXPAUS 3
 #define ENC_RXPAUS 2
@@ -115,10 +132,14 @@
 #define ENC_INTIE 7
 #define ENC_PKTIE 6
 #define ENC_TXIE 3
+#define ENC_TXERIE 1
+#define ENC_RXERIE 0
 
 #define ENC_EIR 0x1c
 #define ENC_PKTIF 6
 #define ENC_TXIF 3
+#define ENC_TXERIF 1
+#define ENC_RXERIF 0
 
 #define ENC_ESTAT 0x1d
 
@@ -127,49 +148,48 @@
 #define ENC_AUTOINC 7
 
 #define ENC_ECON1 0x1f
+#define ENC_TXRST 7
+#define ENC_DMAST 5
+#define ENC_CSUMEN 4
 #define ENC_TXRTS 3
 #define ENC_RXEN 2
 
 //enable rx;
 uint8_t enc_rxen_bit;
 
-static void spiInit() {
-	SPI_DDR = (1 << SPI_MOSI_PIN) | (1 << SPI_SCK_PIN) | (1 << SPI_SS_PIN);
-	SPCR = (1 << SPE) | (1 << MSTR);
-	SPSR = (1 << SPI2X);
-	SPI_PORT |= (1 << SPI_SS_PIN);
-}
-
-static void waitSpiFinished() {
-	while (!(SPSR & (1 << SPIF))) {
-	}
-}
+/**
+ * Starts a SPI frame. With NET_STATISTICS, the frame is counted on the
+ * account that was selected with STATS_SPI_ACCOUNT() before.
+ */
 static void startSpiFrame() {
-	SPI_PORT &= ~(1 << SPI_SS_PIN);
+	STATS_SPI_SELECT();
+	spiPortSelect();
 }
 static void sendOnSpi(uint8_t value) {
-	SPDR = value;
-	waitSpiFinished();
+	STATS_SPI_BYTE();
+	spiPortTransfer(value);
 }
 /**
  * Receives a byte without sending something.
  */
 static uint8_t receiveOnSpi() {
-	SPDR = 0;
-	waitSpiFinished();
-	uint8_t data = SPDR;
-	return data;
+	STATS_SPI_BYTE();
+	return spiPortTransfer(0);
 }
 static void endSpiFrame() {
-	SPI_PORT |= (1 << SPI_SS_PIN);
+	spiPortDeselect();
 }
 
 /* ===================== unbanked enc commands ====================== */
 
+static void resetRegisterCache();
+
 static void sendEncReset() {
+	STATS_SPI_ACCOUNT(STATS_SPI_REGISTER);
 	startSpiFrame();
 	sendOnSpi(ENC_COMMAND_RESET);
 	endSpiFrame();
+	resetRegisterCache();
 }
 
 /**
@@ -178,6 +198,7 @@ static void sendEncReset() {
  */
 static void writeEncRegisterUnbanked(uint8_t registerAddress, uint8_t value) {
 	uint8_t command = ENC_COMMAND_WRITE | registerAddress;
+	STATS_SPI_ACCOUNT(STATS_SPI_REGISTER);
 	startSpiFrame();
 	sendOnSpi(command);
 	sendOnSpi(value);
@@ -189,6 +210,7 @@ static void writeEncRegisterUnbanked(uint8_t registerAddress, uint8_t value) {
  */
 static void setBitsInEncRegisterUnbanked(uint8_t registerAddress, uint8_t value) {
 	uint8_t command = ENC_COMMAND_SETBITS | registerAddress;
+	STATS_SPI_ACCOUNT(STATS_SPI_REGISTER);
 	startSpiFrame();
 	sendOnSpi(command);
 	sendOnSpi(value);
@@ -202,6 +224,7 @@ static void setBitsInEncRegisterUnbanked(uint8_t registerAddress, uint8_t value)
 static void clearBitsInEncRegisterUnbanked(uint8_t registerAddress,
 		uint8_t value) {
 	uint8_t command = ENC_COMMAND_CLEARBITS | registerAddress;
+	STATS_SPI_ACCOUNT(STATS_SPI_REGISTER);
 	startSpiFrame();
 	sendOnSpi(command);
 	sendOnSpi(value);
@@ -210,6 +233,7 @@ static void clearBitsInEncRegisterUnbanked(uint8_t registerAddress,
 
 static uint8_t readEncRegisterUnbanked(uint8_t registerAddress) {
 	uint8_t command = ENC_COMMAND_READ | registerAddress;
+	STATS_SPI_ACCOUNT(STATS_SPI_REGISTER);
 	startSpiFrame();
 	sendOnSpi(command);
 	uint8_t value = receiveOnSpi();
@@ -218,21 +242,73 @@ static uint8_t readEncRegisterUnbanked(uint8_t registerAddress) {
 }
 
 /* ===================== banked enc commands ====================== */
-static void setEncBank(uint8_t address) {
-	static uint8_t oldBankmask = 0x01; // invalid
+// registers from this address on are in every bank.
+#define ENC_COMMON_REGISTERS 0x1b
+#define ENC_BANK_UNKNOWN 0x01
 
+// bank bits (0xc0 of a register address) ECON1 is set to.
+static uint8_t encBank = ENC_BANK_UNKNOWN;
+
+static uint8_t isCommonRegister(uint8_t address) {
+	return (address & 0x1f) >= ENC_COMMON_REGISTERS;
+}
+
+/**
+ * Switches ECON1 to the bank of the address. Only the bank bits that
+ * change are set or cleared.
+ */
+static void setEncBank(uint8_t address) {
+	if (isCommonRegister(address)) {
+		return;
+	}
 	uint8_t bankmasked = address & 0xc0;
-	if (bankmasked != oldBankmask) {
-		oldBankmask = bankmasked;
+	if (bankmasked != encBank) {
+		STATS_COUNT(bankSwitches);
 		uint8_t value = bankmasked >> 6;
-		clearBitsInEncRegisterUnbanked(ENC_ECON1, 0x03);
-		if (value != 0x00) {
-			setBitsInEncRegisterUnbanked(ENC_ECON1, value);
+		uint8_t old = encBank == ENC_BANK_UNKNOWN ? 0x03 : encBank >> 6;
+		if (old & ~value) {
+			clearBitsInEncRegisterUnbanked(ENC_ECON1, old & ~value);
+		}
+		if (value & ~old) {
+			setBitsInEncRegisterUnbanked(ENC_ECON1, value & ~old);
 		}
+		encBank = bankmasked;
+	}
+}
+
+/**
+ * The pointers the enc never changes by itself (ETXST, ETXND and the dma
+ * pointers) are cached, writing the value a register already has costs no
+ * SPI traffic. Per package, that is mostly the high bytes. ERXRDPT is not:
+ * the enc only takes ERXRDPTL when ERXRDPTH is written.
+ */
+#define REGISTER_CACHE_START ENC_ETXSTL
+#define REGISTER_CACHE_END ENC_EDMADSTH
+static uint8_t registerCache[REGISTER_CACHE_END - REGISTER_CACHE_START + 1];
+
+static uint8_t isCachedRegister(uint8_t address) {
+	return address >= REGISTER_CACHE_START && address <= REGISTER_CACHE_END
+			&& (address <= ENC_ETXNDH || address >= ENC_EDMASTL);
+}
+
+/**
+ * Sets the cache to the values after a reset.
+ */
+static void resetRegisterCache() {
+	for (uint8_t i = 0; i < sizeof(registerCache); i++) {
+		registerCache[i] = 0;
 	}
+	encBank = 0x00;
 }
 
 static void writeEncRegister(uint8_t registerAddress, uint8_t value) {
+	if (isCachedRegister(registerAddress)) {
+		uint8_t *cached = &registerCache[registerAddress - REGISTER_CACHE_START];
+		if (*cached == value) {
+			return;
+		}
+		*cached = value;
+	}
 	setEncBank(registerAddress);
 	writeEncRegisterUnbanked(0x1f & registerAddress, value);
 }
@@ -262,6 +338,32 @@ static void waitEncPhyNotBusy() {
 	} while (stat & (1 << ENC_BUSY));
 }
 
+typedef struct {
+	uint8_t address;
+	uint8_t value;
+} EncRegisterWrite;
+
+/**
+ * Writes a PROGMEM table of registers with as few bank switches as
+ * possible: the registers in every bank and the ones of the current bank
+ * first, then the other banks one by one. Writes to the same bank keep
+ * their order.
+ */
+static void writeEncRegisterTable_P(const EncRegisterWrite *table,
+		uint8_t count) {
+	uint8_t bank = encBank == ENC_BANK_UNKNOWN ? 0x00 : encBank;
+	for (uint8_t pass = 0; pass < 4; pass++) {
+		for (uint8_t i = 0; i < count; i++) {
+			uint8_t address = pgm_read_byte(&table[i].address);
+			if (isCommonRegister(address) ?
+					pass == 0 : (address & 0xc0) == bank) {
+				writeEncRegister(address, pgm_read_byte(&table[i].value));
+			}
+		}
+		bank = (bank + 0x40) & 0xc0;
+	}
+}
+
 static void writeEncPhyRegister(uint8_t address, uint16_t value) {
 	writeEncRegister(ENC_MIREGADR, address);
 	writeEncRegister(ENC_MIWRL, (uint8_t) (value));
@@ -280,17 +382,34 @@ static uint16_t readEncPhyRegister(uint8_t address, uint16_t value) {
 	return ((uint16_t) high << 8) | low;
 }*/
 
-void setupReceiveBuffer() {
-	writeEncRegister(ENC_ERXSTL, (uint8_t) RECEIVE_START);
-	writeEncRegister(ENC_ERXSTH, (uint8_t) (RECEIVE_START >> 8));
-	writeEncRegister(ENC_ERXNDL, (uint8_t) RECEIVE_END);
-	writeEncRegister(ENC_ERXNDH, (uint8_t) (RECEIVE_END >> 8));
-
-	writeEncRegister(ENC_ERXRDPTL, (uint8_t) RECEIVE_START);
-	writeEncRegister(ENC_ERXRDPTH, (uint8_t) (RECEIVE_START >> 8));
-	writeEncRegister(ENC_ERDPTL, (uint8_t) RECEIVE_START);
-	writeEncRegister(ENC_ERDPTH, (uint8_t) (RECEIVE_START >> 8));
-}
+/**
+ * Receive buffer and mac setup, written by initEnc().
+ */
+static const EncRegisterWrite initRegisters[] PROGMEM = {
+	{ ENC_ERXSTL, (uint8_t) ENC_RX_START },
+	{ ENC_ERXSTH, (uint8_t) (ENC_RX_START >> 8) },
+	{ ENC_ERXNDL, (uint8_t) ENC_RX_END },
+	{ ENC_ERXNDH, (uint8_t) (ENC_RX_END >> 8) },
+	{ ENC_ERXRDPTL, (uint8_t) ENC_RX_START },
+	{ ENC_ERXRDPTH, (uint8_t) (ENC_RX_START >> 8) },
+	{ ENC_ERDPTL, (uint8_t) ENC_RX_START },
+	{ ENC_ERDPTH, (uint8_t) (ENC_RX_START >> 8) },
+	{ ENC_ECON2, (1 << ENC_AUTOINC) },
+
+	{ ENC_MACON1, (1 << ENC_TXPAUS) | (1 << ENC_RXPAUS) | (1 << ENC_MARXEN) },
+	{ ENC_MACON3, (1 << ENC_PADCFG0) | (1 << ENC_TXCRCEN) | (1 << ENC_FULDPX) },
+	{ ENC_MAMXFLL, (uint8_t) MAX_FRAMELENGTH },
+	{ ENC_MAMXFLH, (uint8_t) (MAX_FRAMELENGTH >> 8) },
+	{ ENC_MABBIPG, 0x15 },
+	{ ENC_MAIPGL, 0x12 },
+
+	{ ENC_MAADR1, MY_MAC_1 },
+	{ ENC_MAADR2, MY_MAC_2 },
+	{ ENC_MAADR3, MY_MAC_3 },
+	{ ENC_MAADR4, MY_MAC_4 },
+	{ ENC_MAADR5, MY_MAC_5 },
+	{ ENC_MAADR6, MY_MAC_6 },
+};
 
 void waitForOsc() {
 	while (1) {
@@ -301,39 +420,71 @@ void waitForOsc() {
 	}
 }
 
-void setupMac() {
-	writeEncRegister(ENC_MACON1,
-			(1 << ENC_TXPAUS) | (1 << ENC_RXPAUS) | (1 << ENC_MARXEN));
+// The pattern match filter lets arp requests for our ip pass. It sums up
+// the ethertype, the arp opcode and the target ip.
+#define ARP_PATTERN_OFFSET 12
+static const uint8_t arpPatternMask[8] PROGMEM = { 0x03, 0x03, 0x00, 0x3c,
+		0x00, 0x00, 0x00, 0x00 };
 
-	writeEncRegister(ENC_MACON3,
-			(1 << ENC_PADCFG0) | (1 << ENC_TXCRCEN) | (1 << ENC_FULDPX));
-	writeEncRegister(ENC_MAMXFLL, (uint8_t) MAX_FRAMELENGTH);
-	writeEncRegister(ENC_MAMXFLH, (uint8_t) (MAX_FRAMELENGTH >> 8));
+static IpAddress arpFilterIp;
+static uint8_t arpFilterSet = 0;
+static uint8_t encInitialized = 0;
 
-	writeEncRegister(ENC_MABBIPG, 0x15);
-	writeEncRegister(ENC_MAIPGL, 0x12);
-
-	writeEncRegister(ENC_MAADR1, MY_MAC_1);
-	writeEncRegister(ENC_MAADR2, MY_MAC_2);
-	writeEncRegister(ENC_MAADR3, MY_MAC_3);
-	writeEncRegister(ENC_MAADR4, MY_MAC_4);
-	writeEncRegister(ENC_MAADR5, MY_MAC_5);
-	writeEncRegister(ENC_MAADR6, MY_MAC_6);
+static void setupReceiveFilter() {
+	uint8_t filters = (1 << ENC_UCEN) | (1 << ENC_CRCEN);
+#ifdef ENC_RECEIVE_BROADCAST
+	filters |= 1 << ENC_BCEN;
+#endif
+	// the pattern is changed while it is off.
+	writeEncRegister(ENC_ERXFCON, filters);
+	if (arpFilterSet) {
+		uint32_t sum = 0x0806 + 0x0001;
+		sum += ((uint16_t) arpFilterIp.addr1 << 8) | arpFilterIp.addr2;
+		sum += ((uint16_t) arpFilterIp.addr3 << 8) | arpFilterIp.addr4;
+		sum = (sum >> 16) + (sum & 0xffff);
+		uint16_t checksum = ((uint16_t) (sum >> 16) + (uint16_t) sum) ^ 0xffff;
+
+		for (uint8_t i = 0; i < 8; i++) {
+			writeEncRegister(ENC_EPMM0 + i, pgm_read_byte(&arpPatternMask[i]));
+		}
+		writeEncRegister(ENC_EPMOL, ARP_PATTERN_OFFSET);
+		writeEncRegister(ENC_EPMOH, 0);
+		writeEncRegister(ENC_EPMCSL, (uint8_t) checksum);
+		writeEncRegister(ENC_EPMCSH, (uint8_t) (checksum >> 8));
+		writeEncRegister(ENC_ERXFCON, filters | (1 << ENC_PMEN));
+	}
+}
 
-	writeEncPhyRegister(ENC_PHCON1, (1 << ENC_PDPXMD));
+/**
+ * Sets the ip the enc lets arp requests for pass. May be called before
+ * initEnc().
+ */
+void encSetArpFilter(IpAddress *ip) {
+	arpFilterIp = *ip;
+	arpFilterSet = 1;
+	if (encInitialized) {
+		setupReceiveFilter();
+	}
 }
+
 /**
  * Does the whole init sequence.
  */
 void initEnc(void) {
-	spiInit();
+	spiPortInit();
 	sendEncReset();
-	setupReceiveBuffer();
 	waitForOsc();
-	setupMac();
-	writeEncRegister(ENC_ECON2, (1 << ENC_AUTOINC));
+	writeEncRegisterTable_P(initRegisters,
+			sizeof(initRegisters) / sizeof(EncRegisterWrite));
+	writeEncPhyRegister(ENC_PHCON1, (1 << ENC_PDPXMD));
+	setupReceiveFilter();
+	encInitialized = 1;
 	setBitsInEncRegister(ENC_ECON1, 1 << ENC_RXEN);
-
+#ifdef ENC_INTERRUPT
+	writeEncRegister(ENC_EIE, (1 << ENC_INTIE) | (1 << ENC_PKTIE)
+			| (1 << ENC_TXIE) | (1 << ENC_TXERIE) | (1 << ENC_RXERIE));
+	spiPortEnableInterrupt();
+#endif
 }
 
 typedef struct {
@@ -349,6 +500,50 @@ uint16_t receivedPackageLength;
 //how many bytes have not already been read.
 uint16_t receivedPackageRemaining;
 
+// ERDPT, if it was not moved on by a RBM frame since it was set or read.
+static uint16_t readPointer;
+static uint8_t readPointerKnown = 0;
+
+/**
+ * Starts a RBM frame on the account that was selected before.
+ */
+static void startReadBufferFrame() {
+	readPointerKnown = 0;
+	startSpiFrame();
+	sendOnSpi(ENC_COMMAND_RBM);
+}
+
+/**
+ * Starts a RBM frame to read the received package.
+ */
+static void startReadFrame() {
+	STATS_SPI_ACCOUNT(STATS_SPI_RX);
+	startReadBufferFrame();
+}
+
+static uint16_t saveReadPointer() {
+	if (!readPointerKnown) {
+		readPointer = readEncRegister(ENC_ERDPTL);
+		readPointer |= (uint16_t) readEncRegister(ENC_ERDPTH) << 8;
+		readPointerKnown = 1;
+	}
+	return readPointer;
+}
+
+/**
+ * Sets ERDPT, only the bytes that change are written.
+ */
+static void setReadPointer(uint16_t pointer) {
+	if (!readPointerKnown || (uint8_t) readPointer != (uint8_t) pointer) {
+		writeEncRegister(ENC_ERDPTL, (uint8_t) pointer);
+	}
+	if (!readPointerKnown || (readPointer ^ pointer) >> 8) {
+		writeEncRegister(ENC_ERDPTH, (uint8_t) (pointer >> 8));
+	}
+	readPointer = pointer;
+	readPointerKnown = 1;
+}
+
 /**
  * Reads length bytes to the buffer, no matter what happens.
  */
@@ -357,8 +552,7 @@ void encReadSequenceUnsafe(uint8_t *buffer, uint8_t length) {
 
 	debugString("SPI: Reading: ");debugHex(length);debugString(" bytes:");
 
-	startSpiFrame();
-	sendOnSpi(ENC_COMMAND_RBM);
+	startReadFrame();
 	for (i = 0; i < length; i++) {
 		buffer[i] = receiveOnSpi();
 		debugString(" ");debugHex(buffer[i]);
@@ -366,7 +560,11 @@ void encReadSequenceUnsafe(uint8_t *buffer, uint8_t length) {
 	endSpiFrame();
 }
 
-static void receivePackage() {
+/**
+ * Handles the package at the read pointer and moves the read pointer to the
+ * next one. Returns the start of the next package.
+ */
+static uint16_t receivePackage() {
 	static ReceivedPackageHeader networkheader;
 	encReadSequenceUnsafe((uint8_t*) &networkheader,
 			sizeof(ReceivedPackageHeader));
@@ -377,22 +575,87 @@ static void receivePackage() {
 
 	//call the handler
 	ENC_RECEIVE_PACKAGE();
+	STATS_COUNT(rxReceived);
+	// what the handler did not read is skipped.
+	receivedPackageRemaining = 0;
 
-	writeEncRegister(ENC_ERDPTL, networkheader.nextaddrl);
-	writeEncRegister(ENC_ERDPTH, networkheader.nextaddrh);
-	writeEncRegister(ENC_ERXRDPTL, networkheader.nextaddrl);
-	writeEncRegister(ENC_ERXRDPTH, networkheader.nextaddrh);
+	uint16_t next = networkheader.nextaddrl | (networkheader.nextaddrh << 8);
+	setReadPointer(next);
 
 	//decrement receive pointer (may clear interrupt flag)
 	setBitsInEncRegisterUnbanked(ENC_ECON2, 1 << ENC_PKTDEC);
+	return next;
+}
+
+/**
+ * Gives the receive buffer up to next back to the enc.
+ */
+static void freeReceiveBuffer(uint16_t next) {
+	// errata: ERXRDPT needs to be odd.
+	uint16_t free = next == ENC_RX_START ? ENC_RX_END : next - 1;
+	writeEncRegister(ENC_ERXRDPTL, (uint8_t) free);
+	writeEncRegister(ENC_ERXRDPTH, (uint8_t) (free >> 8));
+}
+
+static void pollTransmit(uint8_t eirvalue);
+
+#ifdef ENC_INTERRUPT
+static volatile uint8_t interruptPending = 0;
+
+/**
+ * Called while the INT pin is low. Only notes that there is work, pollEnc()
+ * does it and lets the interrupt fire again.
+ */
+void encInterrupt(void) {
+	spiPortDisableInterrupt();
+	interruptPending = 1;
+}
+
+#ifndef ENC_HOST
+ISR(SPI_INT_VECTOR) {
+	encInterrupt();
 }
+#endif
+#endif
 
+/**
+ * Sends queued packages and handles up to ENC_RX_BUDGET received ones.
+ * The receive buffer is given back once for all of them.
+ * With ENC_INTERRUPT, it returns at once if the enc did not interrupt.
+ */
 void pollEnc() {
+#ifdef ENC_INTERRUPT
+	if (!interruptPending) {
+		return;
+	}
+	interruptPending = 0;
+#endif
+	STATS_TIMER_START(pollEnc);
 	uint8_t eirvalue = readEncRegisterUnbanked(ENC_EIR);
+	pollTransmit(eirvalue);
+	if (eirvalue & (1 << ENC_RXERIF)) {
+		STATS_COUNT(rxOverflows);
+		clearBitsInEncRegisterUnbanked(ENC_EIR, 1 << ENC_RXERIF);
+	}
 	if (eirvalue & (1 << ENC_PKTIF)) {
-		//packet received
-		receivePackage();
+		uint8_t pending = readEncRegister(ENC_EPKTCNT);
+		STATS_MAX(rxMaxPending, pending);
+		if (pending > ENC_RX_BUDGET) {
+			pending = ENC_RX_BUDGET;
+		}
+		if (pending > 0) {
+			uint16_t next = 0;
+			for (uint8_t i = 0; i < pending; i++) {
+				next = receivePackage();
+			}
+			freeReceiveBuffer(next);
+		}
 	}
+	STATS_TIMER_STOP(pollEnc);
+#ifdef ENC_INTERRUPT
+	// fires again at once if packages are left over.
+	spiPortEnableInterrupt();
+#endif
 }
 
 static uint8_t makeReceiveLengthSafe(uint8_t length) {
@@ -413,8 +676,7 @@ uint8_t encReadSequence(uint8_t *buffer, uint8_t length) {
 uint8_t encSkip(uint8_t n) {
 	uint8_t reallength = makeReceiveLengthSafe(n);
 	uint8_t i = 0;
-	startSpiFrame();
-	sendOnSpi(ENC_COMMAND_RBM);
+	startReadFrame();
 	for (i = 0; i < reallength; i++) {
 		receiveOnSpi();
 	}
@@ -429,8 +691,7 @@ uint8_t encSkip(uint8_t n) {
 uint8_t encReadChar() {
 	if (receivedPackageRemaining > 0) {
 		receivedPackageRemaining--;
-		startSpiFrame();
-		sendOnSpi(ENC_COMMAND_RBM);
+		startReadFrame();
 		uint8_t value = receiveOnSpi();
 		endSpiFrame();
 		return value;
@@ -454,8 +715,7 @@ uint8_t encReadUntil(uint8_t *buffer, uint8_t maxn, char character) {
 
 	uint8_t i = 0;
 
-	startSpiFrame();
-	sendOnSpi(ENC_COMMAND_RBM);
+	startReadFrame();
 	for (i = 0; i < maxread; i++) {
 		uint8_t read = receiveOnSpi();
 		receivedPackageRemaining--;
@@ -473,8 +733,7 @@ uint8_t encReadUntil(uint8_t *buffer, uint8_t maxn, char character) {
 uint8_t encReadUntilSpace(uint8_t *buffer, uint8_t maxn) {
 	uint8_t i;
 
-	startSpiFrame();
-	sendOnSpi(ENC_COMMAND_RBM);
+	startReadFrame();
 
 	for (i = 0; i < maxn && receivedPackageRemaining > 0; i++) {
 		uint8_t read = receiveOnSpi();
@@ -492,8 +751,7 @@ uint8_t encReadUntilSpace(uint8_t *buffer, uint8_t maxn) {
 
 uint8_t encSkipUntil(char character) {
 	uint8_t skipped = 0;
-	startSpiFrame();
-	sendOnSpi(ENC_COMMAND_RBM);
+	startReadFrame();
 	while (receivedPackageRemaining > 0) {
 		char received = receiveOnSpi();
 		receivedPackageRemaining--;
@@ -509,41 +767,269 @@ uint8_t encSkipUntil(char character) {
 }
 
 /**
- * Reads a int from the stream. Skips the car after the int!
- * Returns 0 if the stram has no more bytes, skipped is then set to \0.
- * Return 0 if no int was read.
+ * Reads the received package in one RBM burst and hands every byte to
+ * consume, until it returns 0 (that byte is read, too) or the package ends.
+ * consume must not talk to the enc. Returns the number of bytes read.
  */
-int16_t encReadInt(char *skipped) {
-	uint8_t current;
-	int16_t number = 0;
-	uint8_t isNegative = 0;
-	*skipped = 0;
-
+uint16_t encReadEach(uint8_t (*consume)(uint8_t value)) {
+	uint16_t read = 0;
 	if (receivedPackageRemaining > 0) {
-		startSpiFrame();
-		sendOnSpi(ENC_COMMAND_RBM);
+		startReadFrame();
 		while (receivedPackageRemaining > 0) {
-			current = receiveOnSpi();
+			uint8_t value = receiveOnSpi();
 			receivedPackageRemaining--;
-
-			if (current == '-') {
-				isNegative = 1; // should only work on first char.
-			} else if (current >= '0' && current <= '9') {
-				number = number * 10 + (current - '0');
-			} else {
-				*skipped = current;
+			read++;
+			if (!consume(value)) {
 				break;
 			}
 		}
 		endSpiFrame();
+	}
+	return read;
+}
+
+static void scanPrepare(EncScan *scan) {
+	scan->matched = 0;
+	if (scan->length > 0) {
+		scan->fallback[0] = 0;
+	}
+	uint8_t prefix = 0;
+	for (uint8_t i = 1; i < scan->length; i++) {
+		while (prefix > 0 && scan->pattern[i] != scan->pattern[prefix]) {
+			prefix = scan->fallback[prefix - 1];
+		}
+		if (scan->pattern[i] == scan->pattern[prefix]) {
+			prefix++;
+		}
+		scan->fallback[i] = prefix;
+	}
+}
+
+void encScanStart(EncScan *scan, const void *pattern, uint8_t length) {
+	scan->length = length < ENC_SCAN_MAX_PATTERN ? length : ENC_SCAN_MAX_PATTERN;
+	memcpy(scan->pattern, pattern, scan->length);
+	scanPrepare(scan);
+}
+
+void encScanStart_P(EncScan *scan, PGM_P pattern) {
+	uint16_t length = strlen_P(pattern);
+	scan->length = length < ENC_SCAN_MAX_PATTERN ? length : ENC_SCAN_MAX_PATTERN;
+	memcpy_P(scan->pattern, pattern, scan->length);
+	scanPrepare(scan);
+}
+
+uint8_t encScan(EncScan *scan, uint8_t *buffer, uint16_t size,
+		uint16_t *length) {
+	uint8_t result = ENC_SCAN_END;
+	if (scan->length == 0) {
+		return ENC_SCAN_FOUND;
+	}
+	if (receivedPackageRemaining == 0) {
+		return ENC_SCAN_END;
+	}
+	startReadFrame();
+	while (receivedPackageRemaining > 0) {
+		// a mismatch gives back at most the matched bytes and this one.
+		if (buffer != 0 && size - *length <= scan->matched) {
+			result = ENC_SCAN_FULL;
+			break;
+		}
+		uint8_t value = receiveOnSpi();
+		receivedPackageRemaining--;
+
+		uint8_t matched = scan->matched;
+		while (matched > 0 && value != scan->pattern[matched]) {
+			// the bytes the pattern falls back over are not part of a match.
+			uint8_t prefix = scan->fallback[matched - 1];
+			if (buffer != 0) {
+				memcpy(buffer + *length, scan->pattern, matched - prefix);
+				*length += matched - prefix;
+			}
+			matched = prefix;
+		}
+		if (value == scan->pattern[matched]) {
+			matched++;
+		} else if (buffer != 0) {
+			buffer[(*length)++] = value;
+		}
+		if (matched == scan->length) {
+			scan->matched = 0;
+			result = ENC_SCAN_FOUND;
+			break;
+		}
+		scan->matched = matched;
+	}
+	endSpiFrame();
+	return result;
+}
+
+uint8_t encScanEnd(EncScan *scan, uint8_t *buffer) {
+	uint8_t held = scan->matched;
+	if (buffer != 0) {
+		memcpy(buffer, scan->pattern, held);
+	}
+	scan->matched = 0;
+	return held;
+}
+
+#define NUMBER_SIGNED 1
+#define NUMBER_HEX 2
+#define NUMBER_POINT 4
 
-		if (isNegative) {
-			number *= -1;
+/**
+ * Adds a digit to value, returns 0 if the result is above limit. The
+ * checks before the shifts keep the mcu from dividing.
+ */
+static uint8_t appendDigit(uint32_t *value, uint8_t digit, uint8_t flags,
+		uint32_t limit) {
+	uint32_t shifted;
+	if (flags & NUMBER_HEX) {
+		if (*value > 0x0fffffff) {
+			return 0;
 		}
-		return number;
+		shifted = *value << 4;
 	} else {
+		if (*value > 0x19999999) {
+			return 0;
+		}
+		shifted = (*value << 3) + (*value << 1);
+	}
+	if (shifted + digit < shifted || shifted + digit > limit) {
 		return 0;
 	}
+	*value = shifted + digit;
+	return 1;
+}
+
+static uint8_t digitValue(uint8_t current, uint8_t flags) {
+	if (current >= '0' && current <= '9') {
+		return current - '0';
+	}
+	if (flags & NUMBER_HEX) {
+		current |= 0x20;
+		if (current >= 'a' && current <= 'f') {
+			return current - 'a' + 10;
+		}
+	}
+	return 0xff;
+}
+
+/**
+ * Reads a number in one RBM frame up to and including the first byte that
+ * does not belong to it. A signed number may start with '-' or '+', a hex
+ * number with "0x", a fixed-point number has scale decimals after the
+ * '.', more are dropped and missing ones are zeros. An overflowing value
+ * is read to its end and saturated at its limit, a negative one is
+ * returned as its magnitude.
+ */
+static uint8_t readNumber(uint32_t *value, uint8_t *isNegative, uint8_t flags,
+		uint8_t scale, uint32_t limit, char *delimiter) {
+	uint8_t result = ENC_NUMBER_NONE;
+	uint8_t digits = 0;
+	// decimals read, 0xff before the point
+	uint8_t decimals = 0xff;
+	uint8_t isFirst = 1;
+	*value = 0;
+	*isNegative = 0;
+	*delimiter = 0;
+
+	if (receivedPackageRemaining > 0) {
+		startReadFrame();
+		while (receivedPackageRemaining > 0) {
+			uint8_t current = receiveOnSpi();
+			receivedPackageRemaining--;
+			uint8_t digit = digitValue(current, flags);
+
+			if (digit != 0xff) {
+				digits++;
+				if (decimals != 0xff) {
+					if (decimals == scale) {
+						continue;
+					}
+					decimals++;
+				}
+				if (result != ENC_NUMBER_OVERFLOW) {
+					result = ENC_NUMBER_OK;
+					if (!appendDigit(value, digit, flags, limit)) {
+						result = ENC_NUMBER_OVERFLOW;
+					}
+				}
+			} else if (isFirst && (flags & NUMBER_SIGNED)
+					&& (current == '-' || current == '+')) {
+				if (current == '-') {
+					*isNegative = 1;
+					// the magnitude of the smallest value is one more.
+					limit++;
+				}
+			} else if (digits == 1 && *value == 0 && (flags & NUMBER_HEX)
+					&& (current | 0x20) == 'x') {
+				digits = 0;
+				result = ENC_NUMBER_NONE;
+			} else if (current == '.' && (flags & NUMBER_POINT)
+					&& decimals == 0xff) {
+				decimals = 0;
+			} else {
+				*delimiter = current;
+				break;
+			}
+			isFirst = 0;
+		}
+		endSpiFrame();
+	}
+
+	if (result == ENC_NUMBER_OK && (flags & NUMBER_POINT)) {
+		for (decimals = decimals == 0xff ? 0 : decimals; decimals < scale;
+				decimals++) {
+			if (!appendDigit(value, 0, flags, limit)) {
+				result = ENC_NUMBER_OVERFLOW;
+				break;
+			}
+		}
+	}
+	if (result == ENC_NUMBER_OVERFLOW) {
+		*value = limit;
+	}
+	return result;
+}
+
+static uint8_t readSigned(int32_t *value, uint8_t flags, uint8_t scale,
+		uint32_t limit, char *delimiter) {
+	uint32_t magnitude;
+	uint8_t isNegative;
+	uint8_t result = readNumber(&magnitude, &isNegative, flags | NUMBER_SIGNED,
+			scale, limit, delimiter);
+	*value = isNegative ? -magnitude : magnitude;
+	return result;
+}
+
+uint8_t encReadInt32(int32_t *value, char *delimiter) {
+	return readSigned(value, 0, 0, INT32_MAX, delimiter);
+}
+
+uint8_t encReadUint32(uint32_t *value, char *delimiter) {
+	uint8_t isNegative;
+	return readNumber(value, &isNegative, 0, 0, UINT32_MAX, delimiter);
+}
+
+uint8_t encReadHex(uint32_t *value, char *delimiter) {
+	uint8_t isNegative;
+	return readNumber(value, &isNegative, NUMBER_HEX, 0, UINT32_MAX,
+			delimiter);
+}
+
+uint8_t encReadFixed(int32_t *value, uint8_t scale, char *delimiter) {
+	return readSigned(value, NUMBER_POINT, scale, INT32_MAX, delimiter);
+}
+
+/**
+ * Reads a int from the stream. Skips the car after the int!
+ * Returns 0 if the stram has no more bytes, skipped is then set to \0.
+ * Return 0 if no int was read, a value out of range is saturated.
+ */
+int16_t encReadInt(char *skipped) {
+	int32_t number;
+	readSigned(&number, 0, 0, INT16_MAX, skipped);
+	return number;
 }
 
 uint16_t encGetRemaining() {
@@ -555,115 +1041,845 @@ void encDecreaseRemainingTo(uint16_t remaining) {
 	}
 }
 
-uint16_t encSendStart = ENC_SEND_START + 1;
+/**
+ * Lets the dma of the enc work on the memory from start to end (inclusive).
+ * Without ENC_CSUMEN in econ1bits, it copies the bytes to destination.
+ */
+static void runDma(uint16_t start, uint16_t end, uint16_t destination,
+		uint8_t econ1bits) {
+	writeEncRegister(ENC_EDMASTL, (uint8_t) start);
+	writeEncRegister(ENC_EDMASTH, (uint8_t) (start >> 8));
+	writeEncRegister(ENC_EDMANDL, (uint8_t) end);
+	writeEncRegister(ENC_EDMANDH, (uint8_t) (end >> 8));
+	writeEncRegister(ENC_EDMADSTL, (uint8_t) destination);
+	writeEncRegister(ENC_EDMADSTH, (uint8_t) (destination >> 8));
+
+	setBitsInEncRegisterUnbanked(ENC_ECON1, econ1bits | (1 << ENC_DMAST));
+	while (readEncRegisterUnbanked(ENC_ECON1) & (1 << ENC_DMAST)) {
+	}
+	if (econ1bits) {
+		clearBitsInEncRegisterUnbanked(ENC_ECON1, econ1bits);
+	}
+}
+
+#if ENC_CHECKSUM_MODE != ENC_CHECKSUM_READBACK
+/**
+ * Lets the dma checksum engine sum up the enc memory from start to end
+ * (inclusive). An odd byte at the end is padded with 0.
+ * Returns the plain ones complement sum, not the inverted checksum.
+ *
+ * Note: the errata of some silicon revisions states that packages may be
+ * dropped while the dma computes a checksum. Use ENC_CHECKSUM_READBACK if
+ * that hurts more than the SPI time.
+ */
+static uint16_t encDmaChecksum(uint16_t start, uint16_t end) {
+	runDma(start, end, 0, 1 << ENC_CSUMEN);
+
+	uint16_t checksum = (uint16_t) readEncRegister(ENC_EDMACSH) << 8;
+	checksum |= readEncRegister(ENC_EDMACSL);
+	return checksum ^ 0xffff;
+}
+#endif
+
+uint16_t encSendStart = ENC_TX_START + 1;
 uint16_t encSendLength = 0xffff;
 
-void encStartPackage() {
-	uint16_t statusbyte = encSendStart - 1;
-	writeEncRegister(ENC_ETXSTL, (uint8_t) statusbyte);
-	writeEncRegister(ENC_ETXSTH, (uint8_t) (statusbyte >> 8));
-	writeEncRegister(ENC_EWRPTL, (uint8_t) statusbyte);
-	writeEncRegister(ENC_EWRPTH, (uint8_t) (statusbyte >> 8));
+#define SEND_LIMIT_NONE 0xffff
+// length of the package at which sendLimitReached is called.
+static uint16_t sendLimit = SEND_LIMIT_NONE;
+static void (*sendLimitReached)(void);
+
+#define TX_SLOT_FREE 0
+#define TX_SLOT_FILLING 1
+#define TX_SLOT_QUEUED 2
+#define TX_SLOT_SENDING 3
+// sent, but kept for retransmission until released.
+#define TX_SLOT_RETAINED 4
+
+typedef struct {
+	uint8_t state;
+	// if the slot should be retained after sending
+	uint8_t retain;
+	// address of the last byte of the package.
+	uint16_t end;
+} TxSlot;
+
+static TxSlot txSlots[ENC_TX_SLOTS];
+// the slot that was opened last by encStartPackage()
+static uint8_t currentTxSlot = 0;
+static uint8_t sendingTxSlot = ENC_TX_SLOT_NONE;
+static uint8_t retainedTxSlots = 0;
+
+// ring of queued slots, in the order they are sent.
+static uint8_t txQueue[ENC_TX_SLOTS];
+static uint8_t txQueueHead = 0;
+static uint8_t txQueueLength = 0;
+
+static void queueTxSlot(uint8_t slot) {
+	uint8_t tail = txQueueHead + txQueueLength;
+	if (tail >= ENC_TX_SLOTS) {
+		tail -= ENC_TX_SLOTS;
+	}
+	txQueue[tail] = slot;
+	txQueueLength++;
+	txSlots[slot].state = TX_SLOT_QUEUED;
+	STATS_MAX(txMaxQueueDepth, txQueueLength);
+}
+
+uint8_t encGetTxQueueDepth() {
+	return txQueueLength + (sendingTxSlot != ENC_TX_SLOT_NONE);
+}
+
+static uint16_t getTxSlotStart(uint8_t slot) {
+	return ENC_TX_START + slot * ENC_TX_SLOT_SIZE;
+}
+
+static void startTransmission(uint8_t slot) {
+	uint16_t start = getTxSlotStart(slot);
+	uint16_t end = txSlots[slot].end;
+	writeEncRegister(ENC_ETXSTL, (uint8_t) start);
+	writeEncRegister(ENC_ETXSTH, (uint8_t) (start >> 8));
+	writeEncRegister(ENC_ETXNDL, (uint8_t) end);
+	writeEncRegister(ENC_ETXNDH, (uint8_t) (end >> 8));
+
+	debugString("ENC: sending from ");debugHex(start >> 8);debugHex(start);debugString(" to ");debugHex(end >> 8);debugHex(end);debugString("\n");
+
+	clearBitsInEncRegisterUnbanked(ENC_EIR, (1 << ENC_TXIF) | (1 << ENC_TXERIF));
+	setBitsInEncRegisterUnbanked(ENC_ECON1, 1 << ENC_TXRTS);
+	txSlots[slot].state = TX_SLOT_SENDING;
+	sendingTxSlot = slot;
+	STATS_COUNT(txSent);
+}
+
+/**
+ * Frees the slot that was sent, if the enc reports it as done in EIR, and
+ * starts sending the next queued slot.
+ */
+static void pollTransmit(uint8_t eirvalue) {
+	if (sendingTxSlot != ENC_TX_SLOT_NONE
+			&& (eirvalue & ((1 << ENC_TXIF) | (1 << ENC_TXERIF)))) {
+		if (eirvalue & (1 << ENC_TXERIF)) {
+			// the transmit logic may be stuck after an error.
+			setBitsInEncRegisterUnbanked(ENC_ECON1, 1 << ENC_TXRST);
+			clearBitsInEncRegisterUnbanked(ENC_ECON1, 1 << ENC_TXRST);
+		}
+		debugString("ENC: send finished\n");
+#ifdef ENC_INTERRUPT
+		// or the INT pin stays low.
+		clearBitsInEncRegisterUnbanked(ENC_EIR,
+				(1 << ENC_TXIF) | (1 << ENC_TXERIF));
+#endif
+		txSlots[sendingTxSlot].state =
+				txSlots[sendingTxSlot].retain ? TX_SLOT_RETAINED : TX_SLOT_FREE;
+		sendingTxSlot = ENC_TX_SLOT_NONE;
+	}
+	if (sendingTxSlot == ENC_TX_SLOT_NONE && txQueueLength > 0) {
+		uint8_t slot = txQueue[txQueueHead];
+		txQueueHead++;
+		if (txQueueHead >= ENC_TX_SLOTS) {
+			txQueueHead = 0;
+		}
+		txQueueLength--;
+		startTransmission(slot);
+	}
+}
+
+/**
+ * Waits until the enc does not need the slot any more.
+ */
+static void waitForTxSlot(uint8_t slot) {
+	while (txSlots[slot].state == TX_SLOT_QUEUED
+			|| txSlots[slot].state == TX_SLOT_SENDING) {
+		pollTransmit(readEncRegisterUnbanked(ENC_EIR));
+	}
+}
+
+/**
+ * Finds a slot to write to, waits for one if all are in use.
+ * The search starts behind the current slot, so slots are used round robin.
+ */
+static uint8_t getFreeTxSlot() {
+	uint8_t stalled = 0;
+	while (1) {
+		uint8_t slot = currentTxSlot;
+		for (uint8_t i = 0; i < ENC_TX_SLOTS; i++) {
+			if (txSlots[slot].state == TX_SLOT_FILLING) {
+				// was opened but never sent
+				return slot;
+			}
+			slot++;
+			if (slot >= ENC_TX_SLOTS) {
+				slot = 0;
+			}
+			if (txSlots[slot].state == TX_SLOT_FREE) {
+				return slot;
+			}
+		}
+		if (!stalled) {
+			stalled = 1;
+			STATS_COUNT(txStalls);
+		}
+		pollTransmit(readEncRegisterUnbanked(ENC_EIR));
+	}
+}
+
+#if ENC_WRITE_BUFFER_SIZE > 0
+// bytes that are written but not sent to the enc. They belong in front of
+// the current write mark.
+static uint8_t writeBuffer[ENC_WRITE_BUFFER_SIZE];
+static uint8_t writeBufferUsed = 0;
+#endif
+
+/**
+ * Starts a WBM frame and sends the buffered bytes in it.
+ */
+static void openWriteFrame() {
+	STATS_SPI_ACCOUNT(statsTxAccount);
+	startSpiFrame();
+	sendOnSpi(ENC_COMMAND_WBM);
+#if ENC_WRITE_BUFFER_SIZE > 0
+	for (uint8_t i = 0; i < writeBufferUsed; i++) {
+		sendOnSpi(writeBuffer[i]);
+	}
+	writeBufferUsed = 0;
+#endif
+}
+
+/**
+ * Sends all buffered bytes to the enc. Needs to be called before the
+ * write pointer is changed or the send buffer is used by the enc.
+ */
+static void flushWriteBuffer() {
+#if ENC_WRITE_BUFFER_SIZE > 0
+	if (writeBufferUsed > 0) {
+		openWriteFrame();
+		endSpiFrame();
+	}
+#endif
+}
+
+/**
+ * Writes a byte at the current write pointer, without any bookkeeping.
+ */
+static void writeByte(uint8_t value) {
+#if ENC_WRITE_BUFFER_SIZE > 0
+	if (writeBufferUsed == ENC_WRITE_BUFFER_SIZE) {
+		flushWriteBuffer();
+	}
+	writeBuffer[writeBufferUsed++] = value;
+#else
+	openWriteFrame();
+	sendOnSpi(value);
+	endSpiFrame();
+#endif
+}
+
+/**
+ * Sets EWRPT. While a package is open, EWRPT is at the write mark, so only
+ * the bytes that change are written.
+ */
+static void setWritePointerRegister(uint16_t pointer) {
+	flushWriteBuffer();
+	uint16_t current = encSendLength == 0xffff ?
+			~pointer : encSendStart + encSendLength;
+	if ((uint8_t) current != (uint8_t) pointer) {
+		writeEncRegister(ENC_EWRPTL, (uint8_t) pointer);
+	}
+	if ((current ^ pointer) >> 8) {
+		writeEncRegister(ENC_EWRPTH, (uint8_t) (pointer >> 8));
+	}
+}
+
+#if ENC_CHECKSUM_MODE == ENC_CHECKSUM_STREAM
+// Write mark of the first checksummed byte, 0xffff if not summing.
+static uint16_t checksumStart = 0xffff;
+// Write mark behind the last byte that is in the sum.
+static uint16_t checksumWritten;
+// Ones complement sum of all bytes between checksumStart and checksumWritten
+static uint32_t checksumSum;
+
+/**
+ * Gets the 16 bit word a byte at the given write mark adds to the sum.
+ */
+static uint16_t checksumWord(uint16_t mark, uint8_t value) {
+	if ((mark - checksumStart) & 1) {
+		return value;
+	} else {
+		return (uint16_t) value << 8;
+	}
+}
+
+/**
+ * Prepares to write length bytes at the current write pointer: Bytes that
+ * are already in the sum are read back and removed from it.
+ */
+static void checksumPrepareWrite(uint16_t length) {
+	if (checksumStart == 0xffff) {
+		return;
+	}
+	uint16_t from = encSendLength;
+	if (from < checksumStart) {
+		from = checksumStart;
+	}
+	uint16_t to = encSendLength + length;
+	if (to > checksumWritten) {
+		to = checksumWritten;
+	}
+	if (from < to) {
+		uint16_t oldReadPointer = saveReadPointer();
+		setReadPointer(encSendStart + from);
+		STATS_SPI_ACCOUNT(STATS_SPI_CHECKSUM);
+		startReadBufferFrame();
+		for (uint16_t mark = from; mark < to; mark++) {
+			// adding the inverted value subtracts it in ones complement.
+			checksumSum += checksumWord(mark, receiveOnSpi()) ^ 0xffff;
+		}
+		endSpiFrame();
+		setReadPointer(oldReadPointer);
+	}
+}
+
+/**
+ * Adds a byte that is written at the current write pointer.
+ */
+static void checksumWrite(uint8_t value) {
+	if (checksumStart != 0xffff && encSendLength >= checksumStart) {
+		checksumSum += checksumWord(encSendLength, value);
+		if (encSendLength >= checksumWritten) {
+			checksumWritten = encSendLength + 1;
+		}
+	}
+}
+
+static uint8_t checksumIsOverwriting() {
+	return checksumStart != 0xffff && encSendLength < checksumWritten;
+}
+
+/**
+ * Adds length bytes at mark that were written by the dma.
+ */
+static void checksumCopied(uint16_t mark, uint16_t length) {
+	if (checksumStart == 0xffff || mark + length <= checksumStart) {
+		return;
+	}
+	if (mark < checksumStart) {
+		length -= checksumStart - mark;
+		mark = checksumStart;
+	}
+	uint16_t sum = encDmaChecksum(encSendStart + mark,
+			encSendStart + mark + length - 1);
+	if ((mark - checksumStart) & 1) {
+		// the engine sums up from an odd position, so high and low byte swap.
+		sum = (sum << 8) | (sum >> 8);
+	}
+	checksumSum += sum;
+	if (mark + length > checksumWritten) {
+		checksumWritten = mark + length;
+	}
+}
+#else
+#define checksumPrepareWrite(length)
+#define checksumWrite(value)
+#define checksumIsOverwriting() 0
+#define checksumCopied(mark, length)
+#endif
+
+/**
+ * In ENC_CHECKSUM_STREAM mode, this starts summing up all bytes written from
+ * mark on. Bytes that are overwritten later (by moving the write pointer
+ * back) are read back and replaced in the sum. The write pointer must not
+ * be moved past bytes that were never written.
+ *
+ * A restarted package keeps its sum, so only the rewritten bytes are read.
+ */
+void encStartChecksum(uint16_t mark) {
+#if ENC_CHECKSUM_MODE == ENC_CHECKSUM_STREAM
+	if (checksumStart != mark) {
+		checksumStart = mark;
+		checksumWritten = mark;
+		checksumSum = 0;
+	}
+#else
+	(void) mark;
+#endif
+}
+
+static void openPackage(uint8_t slot) {
+	currentTxSlot = slot;
+	txSlots[slot].state = TX_SLOT_FILLING;
+	uint16_t statusbyte = getTxSlotStart(slot);
+	setWritePointerRegister(statusbyte);
+	encSendStart = statusbyte + 1;
 
 	//write package control bit
+	sendLimit = SEND_LIMIT_NONE;
 	encSendLength = 0;
 	encWriteChar(0x00);
 	encSendLength = 0;
 }
 
+void encSetSendLimit(uint16_t length, void (*full)(void)) {
+	sendLimit = length;
+	sendLimitReached = full;
+}
+
+/**
+ * Lets the owner of the limit send the full package and open the next one.
+ */
+static void packageFull() {
+	sendLimit = SEND_LIMIT_NONE;
+	sendLimitReached();
+}
+
+void encStartPackage() {
+#if ENC_CHECKSUM_MODE == ENC_CHECKSUM_STREAM
+	checksumStart = 0xffff;
+#endif
+	openPackage(getFreeTxSlot());
+}
+
 /**
  * Same as encStartPackage, but it is guaranteed that the old data is not deleted.
  */
 void encRestartPackage() {
-	encStartPackage();
+	uint8_t slot = currentTxSlot;
+	if (txSlots[slot].retain) {
+		// the retained package must stay as it is, work on a copy.
+		uint8_t copy = getFreeTxSlot();
+		runDma(getTxSlotStart(slot), txSlots[slot].end, getTxSlotStart(copy), 0);
+		slot = copy;
+	} else {
+		waitForTxSlot(slot);
+	}
+	openPackage(slot);
 }
 
-void encSend() {
-	if (encSendLength != 0xffff) {
-		uint16_t endOfPackage = encSendLength + encSendStart - 1;
-		writeEncRegister(ENC_ETXNDL, (uint8_t) endOfPackage);
-		writeEncRegister(ENC_ETXNDH, (uint8_t) (endOfPackage >> 8));
+uint8_t encSendRetained() {
+	uint8_t slot = currentTxSlot;
+	if (encSendLength == 0xffff || retainedTxSlots + 1 >= ENC_TX_SLOTS) {
+		// keep a slot free for other packages.
+		slot = ENC_TX_SLOT_NONE;
+	} else {
+		txSlots[slot].retain = 1;
+		retainedTxSlots++;
+	}
+	encSendAsync();
+	return slot;
+}
 
-		debugString("ENC: sending from ");debugHex(readEncRegister(ENC_ETXSTH));debugHex(readEncRegister(ENC_ETXSTL));debugString(" to ");debugHex(readEncRegister(ENC_ETXNDH));debugHex(readEncRegister(ENC_ETXNDL));debugString("\n");
+void encResendRetained(uint8_t slot) {
+	if (txSlots[slot].state == TX_SLOT_RETAINED) {
+		queueTxSlot(slot);
+		pollTransmit(sendingTxSlot == ENC_TX_SLOT_NONE ? 0 :
+				readEncRegisterUnbanked(ENC_EIR));
+	}
+}
 
-		clearBitsInEncRegisterUnbanked(ENC_EIR, (1 << ENC_TXIF));
-		// interrupt...
-		//setBitsInEncRegisterUnbanked(ENC_EIE, (1<<ENC_TXIE) | (1<<ENC_INTIE));
-		setBitsInEncRegisterUnbanked(ENC_ECON1, 1 << ENC_TXRTS);
+void encReleaseRetained(uint8_t slot) {
+	if (txSlots[slot].retain) {
+		txSlots[slot].retain = 0;
+		retainedTxSlots--;
+		if (txSlots[slot].state == TX_SLOT_RETAINED) {
+			txSlots[slot].state = TX_SLOT_FREE;
+		}
+	}
+}
 
-		while (1) {
-			uint8_t value = readEncRegisterUnbanked(ENC_ECON1);
-			if (!(value & (1 << ENC_TXRTS))) {
-				break;
-			}
-		}debugString("ENC: send finished\n");
+uint8_t encGetFreeRetainSlots() {
+	if (retainedTxSlots + 1 >= ENC_TX_SLOTS) {
+		return 0;
+	}
+	return ENC_TX_SLOTS - 1 - retainedTxSlots;
+}
+
+void encSendAsync() {
+	STATS_TIMER_START(encSend);
+	if (encSendLength != 0xffff) {
+		flushWriteBuffer();
+		txSlots[currentTxSlot].end = encSendLength + encSendStart - 1;
+		queueTxSlot(currentTxSlot);
+		pollTransmit(sendingTxSlot == ENC_TX_SLOT_NONE ? 0 :
+				readEncRegisterUnbanked(ENC_EIR));
 	} else {
 		debugString("ENC: called encSend() while no package is opened.\n");
 	}
 	encSendLength = 0xffff;
+	sendLimit = SEND_LIMIT_NONE;
+	STATS_TIMER_STOP(encSend);
+}
+
+void encDiscardPackage() {
+	// the slot stays TX_SLOT_FILLING, getFreeTxSlot() hands it out again.
+	encSendLength = 0xffff;
+	sendLimit = SEND_LIMIT_NONE;
+#if ENC_WRITE_BUFFER_SIZE > 0
+	writeBufferUsed = 0;
+#endif
+}
+
+void encSend() {
+	encSendAsync();
+	waitForTxSlot(currentTxSlot);
 }
 
 void encWriteChar(uint8_t value) {
 	if (encSendLength != 0xffff) {
+		if (encSendLength >= sendLimit) {
+			packageFull();
+			if (encSendLength == 0xffff) {
+				// the full package could not be sent, the rest is dropped.
+				return;
+			}
+		}
 		debugString("SPI: sending ");debugHex(value);debugString("\n");
 
-		startSpiFrame();
-		sendOnSpi(ENC_COMMAND_WBM);
-		sendOnSpi(value);
-		endSpiFrame();
-
+		checksumPrepareWrite(1);
+		checksumWrite(value);
+		writeByte(value);
 		encSendLength++;
 	} else {
 		debugString("ENC: called encWriteChar() while no package is opened.\n");
 	}
 }
 
-void encWriteSequence(void *datastart, uint8_t length) {
+static void writeSequence(uint8_t *data, uint8_t length) {
 	if (encSendLength != 0xffff) {
 		debugString("SPI: sending ");debugHex(length);debugString(" bytes:");
 
-		uint8_t *data = (uint8_t*) datastart;
-		startSpiFrame();
-		sendOnSpi(ENC_COMMAND_WBM);
+		checksumPrepareWrite(length);
 		uint8_t i;
+#if ENC_WRITE_BUFFER_SIZE > 0
+		if (writeBufferUsed + length <= ENC_WRITE_BUFFER_SIZE) {
+			for (i = 0; i < length; i++) {
+				debugString(" ");debugHex(data[i]);
+				writeBuffer[writeBufferUsed++] = data[i];
+				checksumWrite(data[i]);
+				encSendLength++;
+			}
+			debugString("\n");
+			return;
+		}
+#endif
+		openWriteFrame();
 		for (i = 0; i < length; i++) {
 			debugString(" ");debugHex(data[i]);
 			sendOnSpi(data[i]);
+			checksumWrite(data[i]);
+			encSendLength++;
 		}
 		endSpiFrame();
 		debugString("\n");
-		encSendLength += length;
 	} else {
 		debugString(
 				"ENC: called encWriteSequence() while no package is opened.\n");
 	}
 }
 
+void encWriteSequence(void *datastart, uint8_t length) {
+	uint8_t *data = (uint8_t*) datastart;
+	while (encSendLength != 0xffff && encSendLength + length > sendLimit) {
+		// fill the package up and continue in the next one.
+		uint8_t part = sendLimit - encSendLength;
+		if (part > 0) {
+			writeSequence(data, part);
+			data += part;
+			length -= part;
+		}
+		packageFull();
+	}
+	writeSequence(data, length);
+}
+
+// 1 while a formatting function keeps a WBM frame open.
+static uint8_t formatFrameOpen = 0;
+
+static void formatEnd() {
+	if (formatFrameOpen) {
+		endSpiFrame();
+		formatFrameOpen = 0;
+	}
+}
+
+/**
+ * Writes a byte of formatted output. The bytes go to the write buffer while
+ * it has room, then a WBM frame is opened that takes the rest of the output.
+ * A full package or an old byte that has to be read for the checksum closes
+ * the frame, encWriteChar() handles those.
+ */
+static void formatByte(uint8_t value) {
+	if (encSendLength >= sendLimit || checksumIsOverwriting()) {
+		formatEnd();
+		encWriteChar(value);
+		return;
+	}
+#if ENC_WRITE_BUFFER_SIZE > 0
+	if (!formatFrameOpen && writeBufferUsed < ENC_WRITE_BUFFER_SIZE) {
+		writeBuffer[writeBufferUsed++] = value;
+	} else
+#endif
+	{
+		if (!formatFrameOpen) {
+			openWriteFrame();
+			formatFrameOpen = 1;
+		}
+		sendOnSpi(value);
+	}
+	checksumWrite(value);
+	encSendLength++;
+}
+
+static void formatRepeat(char value, uint8_t count) {
+	for (; count > 0; count--) {
+		formatByte(value);
+	}
+}
+
+static const uint32_t powersOfTen[] PROGMEM = { 1000000000, 100000000,
+		10000000, 1000000, 100000, 10000, 1000, 100, 10 };
+// index of 10000 in powersOfTen
+#define POWER_10000 5
+
+/**
+ * Writes the decimal digits of value to to and returns their number. There
+ * is no division on the mcu, every digit is found by subtracting its power
+ * of ten. Below 10000 the subtractions are done in 16 bits.
+ */
+static uint8_t formatUnsigned(char *to, uint32_t value) {
+	uint8_t length = 0;
+	uint8_t i = POWER_10000;
+	if (value > 0xffff) {
+		for (i = 0; i <= POWER_10000; i++) {
+			uint32_t power = pgm_read_dword(&powersOfTen[i]);
+			char digit = '0';
+			while (value >= power) {
+				value -= power;
+				digit++;
+			}
+			if (length > 0 || digit != '0') {
+				to[length++] = digit;
+			}
+		}
+	}
+	uint16_t rest = value;
+	for (; i < sizeof(powersOfTen) / sizeof(powersOfTen[0]); i++) {
+		uint16_t power = pgm_read_dword(&powersOfTen[i]);
+		char digit = '0';
+		while (rest >= power) {
+			rest -= power;
+			digit++;
+		}
+		if (length > 0 || digit != '0') {
+			to[length++] = digit;
+		}
+	}
+	to[length++] = '0' + rest;
+	return length;
+}
+
+static uint8_t formatHex(char *to, uint32_t value, char letterA) {
+	uint8_t length = 0;
+	for (int8_t shift = value > 0xffff ? 28 : 12; shift >= 0; shift -= 4) {
+		uint8_t nibble = (value >> shift) & 0xf;
+		if (length > 0 || nibble != 0 || shift == 0) {
+			to[length++] = nibble < 10 ? '0' + nibble : letterA + nibble - 10;
+		}
+	}
+	return length;
+}
+
+/**
+ * Puts a decimal point in front of the last precision digits.
+ */
+static uint8_t formatPoint(char *digits, uint8_t length, uint8_t precision) {
+	if (precision == 0) {
+		return length;
+	}
+	if (length <= precision) {
+		uint8_t zeros = precision + 1 - length;
+		memmove(digits + zeros, digits, length);
+		memset(digits, '0', zeros);
+		length += zeros;
+	}
+	memmove(digits + length - precision + 1, digits + length - precision,
+			precision);
+	digits[length - precision] = '.';
+	return length + 1;
+}
+
+#define FORMAT_LEFT 1
+#define FORMAT_ZERO 2
+#define FORMAT_PROGMEM 4
+// a fixed-point value has at most 9 decimals.
+#define FORMAT_MAX_PRECISION 9
+
+void encWriteFormat_P(PGM_P format, ...) {
+	if (encSendLength == 0xffff) {
+		debugString("ENC: called encWriteFormat_P() while no package is opened.\n");
+		return;
+	}
+	va_list arguments;
+	va_start(arguments, format);
+	char current;
+	while ((current = pgm_read_byte(format++)) != 0) {
+		if (current != '%') {
+			formatByte(current);
+			continue;
+		}
+		uint8_t flags = 0;
+		for (;;) {
+			current = pgm_read_byte(format++);
+			if (current == '-') {
+				flags |= FORMAT_LEFT;
+			} else if (current == '0') {
+				flags |= FORMAT_ZERO;
+			} else {
+				break;
+			}
+		}
+		uint8_t width = 0;
+		if (current == '*') {
+			width = va_arg(arguments, int);
+			current = pgm_read_byte(format++);
+		}
+		for (; current >= '0' && current <= '9';
+				current = pgm_read_byte(format++)) {
+			width = width * 10 + current - '0';
+		}
+		uint8_t precision = 0xff;
+		if (current == '.') {
+			precision = 0;
+			for (current = pgm_read_byte(format++);
+					current >= '0' && current <= '9';
+					current = pgm_read_byte(format++)) {
+				precision = precision * 10 + current - '0';
+			}
+		}
+		uint8_t size = 2;
+		if (current == 'h') {
+			current = pgm_read_byte(format++);
+			if (current == 'h') {
+				size = 1;
+				current = pgm_read_byte(format++);
+			}
+		} else if (current == 'l') {
+			size = 4;
+			current = pgm_read_byte(format++);
+		}
+
+		char digits[12];
+		const char *text = digits;
+		uint16_t length;
+		char sign = 0;
+		uint32_t value;
+		switch (current) {
+		case 'd':
+		case 'i':
+		case 'k': {
+			int32_t number;
+			if (size == 4) {
+				number = va_arg(arguments, int32_t);
+			} else if (size == 2) {
+				number = (int16_t) va_arg(arguments, int);
+			} else {
+				number = (int8_t) va_arg(arguments, int);
+			}
+			value = number;
+			if (number < 0) {
+				sign = '-';
+				value = -value;
+			}
+			length = formatUnsigned(digits, value);
+			if (current == 'k' && precision != 0xff) {
+				length = formatPoint(digits, length,
+						precision < FORMAT_MAX_PRECISION ?
+								precision : FORMAT_MAX_PRECISION);
+			}
+			break;
+		}
+		case 'u':
+		case 'x':
+		case 'X':
+			if (size == 4) {
+				value = va_arg(arguments, uint32_t);
+			} else if (size == 2) {
+				value = (uint16_t) va_arg(arguments, unsigned int);
+			} else {
+				value = (uint8_t) va_arg(arguments, unsigned int);
+			}
+			if (current == 'u') {
+				length = formatUnsigned(digits, value);
+			} else {
+				length = formatHex(digits, value, current - 'X' + 'A');
+			}
+			break;
+		case 'c':
+			digits[0] = va_arg(arguments, int);
+			length = 1;
+			break;
+		case 'S':
+			flags |= FORMAT_PROGMEM;
+			text = va_arg(arguments, PGM_P);
+			length = strlen_P(text);
+			break;
+		case 's':
+			text = va_arg(arguments, const char*);
+			length = strlen(text);
+			break;
+		case 0:
+			// a '%' at the end.
+			format--;
+			continue;
+		default:
+			digits[0] = current;
+			length = 1;
+			break;
+		}
+		if ((current == 's' || current == 'S') && precision != 0xff
+				&& length > precision) {
+			length = precision;
+		}
+
+		uint16_t used = length + (sign != 0);
+		uint8_t padding = width > used ? width - used : 0;
+		if (!(flags & (FORMAT_LEFT | FORMAT_ZERO))) {
+			formatRepeat(' ', padding);
+		}
+		if (sign != 0) {
+			formatByte(sign);
+		}
+		if ((flags & (FORMAT_LEFT | FORMAT_ZERO)) == FORMAT_ZERO) {
+			formatRepeat('0', padding);
+		}
+		for (uint16_t i = 0; i < length; i++) {
+			formatByte(flags & FORMAT_PROGMEM ? pgm_read_byte(text + i) : text[i]);
+		}
+		if (flags & FORMAT_LEFT) {
+			formatRepeat(' ', padding);
+		}
+	}
+	formatEnd();
+	va_end(arguments);
+}
+
 void encWriteStringParameters_P(PGM_P message, uint16_t parameters[],
 		uint8_t parametercount) {
 	if (encSendLength != 0xffff) {
 		uint8_t currentParamIndex = 0;
-		PGM_P pgmpos = message;
 		char current;
 
-		startSpiFrame();
-		sendOnSpi(ENC_COMMAND_WBM);
-		while ((current = pgm_read_byte(pgmpos)) != 0) {
+		while ((current = pgm_read_byte(message++)) != 0) {
 			if (current == '%' && currentParamIndex < parametercount) {
-				endSpiFrame();
-
-				encWriteInt(parameters[currentParamIndex]);
-				currentParamIndex++;
-
-				startSpiFrame();
-				sendOnSpi(ENC_COMMAND_WBM);
+				char digits[5];
+				uint8_t length = formatUnsigned(digits,
+						parameters[currentParamIndex++]);
+				for (uint8_t i = 0; i < length; i++) {
+					formatByte(digits[i]);
+				}
 			} else {
-				sendOnSpi(current);
-				encSendLength++;
+				formatByte(current);
 			}
-			pgmpos++;
 		}
-		endSpiFrame();
+		formatEnd();
 	} else {
 		debugString(
 				"ENC: called encWriteStringParameters_P() while no package is opened.\n");
@@ -671,30 +1887,17 @@ void encWriteStringParameters_P(PGM_P message, uint16_t parameters[],
 }
 
 void encWriteInt(uint16_t number) {
-	uint16_t rest = number;
-	uint8_t started = 0;
-	for (uint16_t base = 10000; base >= 1; base /= 10) {
-		uint16_t current = rest / base;
-		if (started || current > 0) {
-			started = 1;
-			encWriteChar('0' + (char) current);
-			rest -= base * current;
-		}
-	}
-	if (!started) {
-		encWriteChar('0');
-	}
+	char digits[5];
+	encWriteSequence(digits, formatUnsigned(digits, number));
 }
 
 void encWriteInt32(uint32_t number) {
-	uint8_t buffer[10];
-	uint8_t i = 9;
-	do {
-		buffer[i] = '0' + (uint8_t) (number % 10);
-		number /= 10;
-		i--;
-	} while (number);
-	encWriteSequence(&buffer[i+1], 9 - i);
+	char digits[10];
+	encWriteSequence(digits, formatUnsigned(digits, number));
+}
+
+uint8_t encFormatInt32(char *to, uint32_t number) {
+	return formatUnsigned(to, number);
 }
 
 /**
@@ -705,9 +1908,11 @@ uint16_t encGetWriteMark() {
 }
 
 void encSetWritePointer(uint16_t mark) {
-	uint16_t position = mark + encSendStart;
-	writeEncRegister(ENC_EWRPTL, (uint8_t) position);
-	writeEncRegister(ENC_EWRPTH, (uint8_t) (position >> 8));
+	if (encSendLength == 0xffff) {
+		// the package was discarded, it stays closed.
+		return;
+	}
+	setWritePointerRegister(mark + encSendStart);
 	encSendLength = mark;
 }
 
@@ -716,20 +1921,117 @@ void encSetWritePointerOffseted(uint16_t mark, uint16_t offset) {
 	encSetWritePointer(realOffset);
 }
 
+// bytes that are copied through RAM at once.
+#define COPY_CHUNK 32
+
 /**
- * Copies the rest of the incoming data to the outgoing buffer.
- * TODO: current implementation is slow.
+ * Copies the incoming data to the outgoing buffer, until the given char or
+ * the end of the package. The char is skipped, but not copied.
  */
 void encCopyIncommingOutgoing(char until) {
-	while (encGetRemaining() > 0) {
-		uint8_t next = encReadChar();
-		if (next == until) {
+	uint8_t buffer[COPY_CHUNK];
+	while (receivedPackageRemaining > 0) {
+		uint16_t remaining = receivedPackageRemaining;
+		uint8_t read = encReadUntil(buffer, COPY_CHUNK, until);
+		encWriteSequence(buffer, read);
+		if (remaining - receivedPackageRemaining > read) {
+			// the char was read
 			return;
 		}
-		encWriteChar(next);
 	}
 }
 
+/**
+ * Copies length bytes of the received package with the dma.
+ */
+static void copyIncommingWithDma(uint16_t length) {
+	uint16_t mark = encSendLength;
+	checksumPrepareWrite(length);
+	flushWriteBuffer();
+
+	uint16_t start = saveReadPointer();
+	uint16_t next = start + length;
+	if (next > ENC_RX_END) {
+		// the dma wraps around at the end of the receive buffer, too.
+		next -= ENC_RX_END - ENC_RX_START + 1;
+	}
+	uint16_t end = next == ENC_RX_START ? ENC_RX_END : next - 1;
+	runDma(start, end, encSendStart + mark, 0);
+	setReadPointer(next);
+	receivedPackageRemaining -= length;
+
+	// the dma did not move the write pointer.
+	setWritePointerRegister(encSendStart + mark + length);
+	encSendLength += length;
+	checksumCopied(mark, length);
+}
+
+/**
+ * Copies the rest of the incoming data to the outgoing buffer. From
+ * ENC_DMA_COPY_MIN bytes on, the dma of the enc copies it without any SPI
+ * transfer of the data.
+ */
+void encCopyIncommingOutgoingAll() {
+	while (encSendLength != 0xffff && receivedPackageRemaining > 0
+			&& receivedPackageRemaining >= ENC_DMA_COPY_MIN) {
+		if (encSendLength >= sendLimit) {
+			packageFull();
+			continue;
+		}
+		uint16_t length = receivedPackageRemaining;
+		if (length > sendLimit - encSendLength) {
+			length = sendLimit - encSendLength;
+		}
+		copyIncommingWithDma(length);
+	}
+
+	uint8_t buffer[COPY_CHUNK];
+	while (receivedPackageRemaining > 0) {
+		uint8_t read = encReadSequence(buffer, COPY_CHUNK);
+		encWriteSequence(buffer, read);
+	}
+}
+
+#if ENC_TEMPLATES > 0
+static uint16_t getTemplateStart(uint8_t index) {
+	return ENC_TEMPLATE_START + index * ENC_TEMPLATE_SIZE;
+}
+
+void encWriteTemplate(uint8_t index, void *data, uint8_t length) {
+	uint8_t *bytes = (uint8_t*) data;
+	uint16_t start = getTemplateStart(index);
+	flushWriteBuffer();
+	writeEncRegister(ENC_EWRPTL, (uint8_t) start);
+	writeEncRegister(ENC_EWRPTH, (uint8_t) (start >> 8));
+	openWriteFrame();
+	for (uint8_t i = 0; i < length; i++) {
+		sendOnSpi(bytes[i]);
+	}
+	endSpiFrame();
+	if (encSendLength != 0xffff) {
+		// back to the package that is being written.
+		uint16_t pointer = encSendStart + encSendLength;
+		writeEncRegister(ENC_EWRPTL, (uint8_t) pointer);
+		writeEncRegister(ENC_EWRPTH, (uint8_t) (pointer >> 8));
+	}
+}
+
+void encCopyTemplate(uint8_t index, uint8_t length) {
+	if (encSendLength == 0xffff) {
+		debugString("ENC: called encCopyTemplate() while no package is opened.\n");
+		return;
+	}
+	uint16_t mark = encSendLength;
+	uint16_t start = getTemplateStart(index);
+	checksumPrepareWrite(length);
+	flushWriteBuffer();
+	runDma(start, start + length - 1, encSendStart + mark, 0);
+	setWritePointerRegister(encSendStart + mark + length);
+	encSendLength += length;
+	checksumCopied(mark, length);
+}
+#endif
+
 uint16_t encGetSendLength() {
 	return encSendLength;
 }
@@ -747,40 +2049,60 @@ void encComputeTcpChecksum(uint16_t pseudoHeaderChecksum,
 	debugString("Pre-checksum: ");debugHex(pseudoHeaderChecksum >> 8);debugHex(pseudoHeaderChecksum);debugString("\n");
 
 	uint32_t checksum = pseudoHeaderChecksum;
-	uint8_t oldReadpointerl = readEncRegister(ENC_ERDPTL);
-	uint8_t oldReadpointerh = readEncRegister(ENC_ERDPTH);
-	uint16_t readStart = encSendStart + tcpheaderStart;
-	writeEncRegister(ENC_ERDPTH, (uint8_t) (readStart >> 8));
-	writeEncRegister(ENC_ERDPTL, (uint8_t) readStart);
-
 	uint16_t packageEnd = encSendLength;
+	flushWriteBuffer();
 	//length
 	checksum += packageEnd - tcpheaderStart;
 
-	startSpiFrame();
-	sendOnSpi(ENC_COMMAND_RBM);
+#if ENC_CHECKSUM_MODE == ENC_CHECKSUM_STREAM
+	if (packageEnd < checksumWritten) {
+		// the package was shortened by moving the write pointer back.
+		checksumPrepareWrite(checksumWritten - packageEnd);
+		checksumWritten = packageEnd;
+	}
+	checksum += (uint16_t) (checksumSum >> 16) + (uint16_t) checksumSum;
+#elif ENC_CHECKSUM_MODE == ENC_CHECKSUM_DMA
+	checksum += encDmaChecksum(encSendStart + tcpheaderStart,
+			encSendStart + packageEnd - 1);
+#else
+	uint16_t oldReadPointer = saveReadPointer();
+	setReadPointer(encSendStart + tcpheaderStart);
+
+	STATS_SPI_ACCOUNT(STATS_SPI_CHECKSUM);
+	startReadBufferFrame();
 	for (int i = tcpheaderStart; i < packageEnd - 1; i += 2) {
 		uint16_t byte = (uint16_t) receiveOnSpi() << 8;
 		byte |= receiveOnSpi();
 		checksum += byte;
 	}
 
-	if (encSendLength & 0x1) {
+	if ((packageEnd - tcpheaderStart) & 0x1) {
 		//odd => add padding
 		uint16_t byte = (uint16_t) receiveOnSpi() << 8;
 		checksum += byte;
 	}
 	endSpiFrame();
 
+	setReadPointer(oldReadPointer);
+#endif
+
 	encSetWritePointerOffseted(tcpheaderStart, TCP_CHECKSUM_OFFSET);
 
+	checksum = (checksum >> 16) + (checksum & 0xffff);
 	uint16_t realChecksum = ((uint16_t) (checksum >> 16) + (uint16_t) checksum)
 			^ 0xffff;
+#if ENC_CHECKSUM_MODE == ENC_CHECKSUM_STREAM
+	// the field was summed as 0, keep the sum valid for encRestartPackage()
+	uint16_t start = checksumStart;
+	checksumStart = 0xffff;
+	encWriteChar((uint8_t) (realChecksum >> 8));
+	encWriteChar((uint8_t) realChecksum);
+	checksumStart = start;
+	checksumSum += realChecksum;
+#else
 	encWriteChar((uint8_t) (realChecksum >> 8));
 	encWriteChar((uint8_t) realChecksum);
+#endif
 
 	encSetWritePointer(packageEnd);
-	writeEncRegister(ENC_ERDPTL, oldReadpointerl);
-	writeEncRegister(ENC_ERDPTH, oldReadpointerh);
 }
-
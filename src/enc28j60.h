@@ -9,10 +9,13 @@
 #define ENC28J60_H_
 
 #include "tcpip.h"
+#include "config.h"
+#include "encmemory.h"
 #include <stdint.h>
 #include <avr/pgmspace.h>
 
 void initEnc(void);
+void encSetArpFilter(IpAddress *ip);
 
 /**
  * Function to call when a package is received
@@ -21,6 +24,21 @@ void initEnc(void);
 
 void pollEnc(void);
 
+#ifdef ENC_INTERRUPT
+/**
+ * Interrupt handler for the INT pin of the enc, the avr build installs it
+ * on SPI_INT_VECTOR.
+ */
+void encInterrupt(void);
+#endif
+
+// The longest package a TX slot holds, without the crc.
+#if ENC_TX_SLOT_SIZE - 8 < 1514
+#define ENC_MAX_PACKAGE_LENGTH (ENC_TX_SLOT_SIZE - 8)
+#else
+#define ENC_MAX_PACKAGE_LENGTH 1514
+#endif
+
 /**
  * Opens a enc package for sending and sets up the write pointer.
  */
@@ -36,9 +54,65 @@ void encWriteChar(uint8_t value);
  */
 void encWriteSequence(void *data, uint8_t length);
 /**
- * Sends the opened package.
+ * Limits the opened package to length bytes. Before a write goes beyond,
+ * full is called. It has to send the package and open the next one, the
+ * rest of the write goes there. The limit ends with the package.
+ */
+void encSetSendLimit(uint16_t length, void (*full)(void));
+/**
+ * Sends the opened package and waits until the enc is done with it.
  */
 void encSend();
+/**
+ * Queues the opened package for sending and returns at once. The next
+ * package can be written while this one is sent. Queued packages are sent
+ * by pollEnc().
+ */
+void encSendAsync();
+/**
+ * Drops the opened package without sending it, its slot is used for the
+ * next one. Writes up to the next encStartPackage() are ignored.
+ */
+void encDiscardPackage();
+
+#define ENC_TX_SLOT_NONE 0xff
+/**
+ * Like encSendAsync(), but the package is kept in its TX slot after it was
+ * sent, until encReleaseRetained() is called. One slot is always left for
+ * other packages, see encGetFreeRetainSlots(): If no slot can be retained,
+ * the package is sent normally and ENC_TX_SLOT_NONE is returned.
+ * @return The slot that holds the package.
+ */
+uint8_t encSendRetained();
+/**
+ * Sends a retained package again.
+ */
+void encResendRetained(uint8_t slot);
+/**
+ * Frees a retained slot as soon as it is not sent any more.
+ */
+void encReleaseRetained(uint8_t slot);
+/**
+ * Gets the number of packages that can still be retained.
+ */
+uint8_t encGetFreeRetainSlots();
+/**
+ * Gets the number of packages that are queued or being sent.
+ */
+uint8_t encGetTxQueueDepth();
+
+#if ENC_TEMPLATES > 0
+/**
+ * Writes length bytes (up to ENC_TEMPLATE_SIZE) to a template in the enc
+ * memory. The package that is being written stays open.
+ */
+void encWriteTemplate(uint8_t index, void *data, uint8_t length);
+/**
+ * Copies the first length bytes of a template to the package with the dma
+ * and moves the write pointer behind them.
+ */
+void encCopyTemplate(uint8_t index, uint8_t length);
+#endif
 
 /**
  * Reads a char.
@@ -46,6 +120,51 @@ void encSend();
 uint8_t encReadChar();
 uint8_t encReadUntil(uint8_t *buffer, uint8_t maxn, char character);
 uint8_t encSkipUntil(char character);
+/**
+ * Hands the received bytes to consume in one SPI burst, until it returns 0.
+ */
+uint16_t encReadEach(uint8_t (*consume)(uint8_t value));
+
+/**
+ * A search for a byte pattern in the received stream. Partial matches are
+ * carried over from one package to the next.
+ */
+typedef struct {
+	uint8_t length;
+	// bytes of the pattern matched at the end of the last package.
+	uint8_t matched;
+	uint8_t pattern[ENC_SCAN_MAX_PATTERN];
+	// KMP table: length of the longest proper prefix that ends at each byte.
+	uint8_t fallback[ENC_SCAN_MAX_PATTERN];
+} EncScan;
+
+// results of encScan()
+// the package ended before the pattern.
+#define ENC_SCAN_END 0
+#define ENC_SCAN_FOUND 1
+// the capture buffer is full, call again to go on.
+#define ENC_SCAN_FULL 2
+
+/**
+ * Starts a search for the length bytes of pattern (at most
+ * ENC_SCAN_MAX_PATTERN, longer ones are cut).
+ */
+void encScanStart(EncScan *scan, const void *pattern, uint8_t length);
+void encScanStart_P(EncScan *scan, PGM_P pattern);
+/**
+ * Reads the received package in one RBM burst until the pattern is found
+ * (it is read too) or the package ends. The bytes in front of the pattern
+ * are appended to buffer at *length when buffer is not 0, size needs to be
+ * longer than the pattern. After ENC_SCAN_FOUND the next search starts.
+ */
+uint8_t encScan(EncScan *scan, uint8_t *buffer, uint16_t size,
+		uint16_t *length);
+/**
+ * Ends a search in a stream that ended before the pattern: copies the bytes
+ * held back as a partial match to buffer (if not 0) and returns their
+ * number.
+ */
+uint8_t encScanEnd(EncScan *scan, uint8_t *buffer);
 uint8_t encReadSequence(uint8_t *buffer, uint8_t length);
 uint8_t encSkip(uint8_t n);
 
@@ -55,6 +174,12 @@ void encSetWritePointerOffseted(uint16_t mark, uint16_t offset);
 
 uint16_t encGetSendLength();
 
+/**
+ * Marks the write position at which the tcp package starts. Everything
+ * written behind it is part of the checksum computed by
+ * encComputeTcpChecksum().
+ */
+void encStartChecksum(uint16_t mark);
 void encComputeTcpChecksum(uint16_t pseudoHeaderChecksum,
 		uint16_t tcpheaderStart);
 uint16_t encGetRemaining();
@@ -62,9 +187,59 @@ void encDecreaseRemainingTo(uint16_t remaining);
 
 void encWriteInt(uint16_t number);
 void encWriteInt32(uint32_t number);
+/**
+ * Puts the decimal digits of number in to, like encWriteInt32() without a
+ * division. to needs room for 10 digits, there is no 0 behind them.
+ * Returns the number of digits.
+ */
+uint8_t encFormatInt32(char *to, uint32_t number);
+/**
+ * Writes message with every '%' replaced by the next of the parameters, in
+ * decimal.
+ */
 void encWriteStringParameters_P(PGM_P message, uint16_t parameters[], uint8_t parametercount);
+/**
+ * Writes a formatted string, format is in PROGMEM. Conversions are
+ * %[-][0][width][.precision][hh|h|l]type, width may be * to take it from
+ * an int argument. Types:
+ * d, i  signed decimal, int8_t with hh, int16_t by default, int32_t with l
+ * u     unsigned decimal, the same sizes
+ * x, X  hexadecimal, the same sizes
+ * k     signed fixed-point: the value times 10^precision, "%.2k" writes
+ *       1234 as 12.34
+ * c     a char
+ * s, S  a string in RAM, in PROGMEM with S. precision limits its length.
+ * %%    a '%'
+ * The digits are generated without divisions and the whole output goes to
+ * the enc in a single WBM frame, unless the package gets full.
+ */
+void encWriteFormat_P(PGM_P format, ...);
 int16_t encReadInt(char *skipped);
+
+// results of the number parsers
+#define ENC_NUMBER_OK 0
+// no digit before the delimiter, the value is 0.
+#define ENC_NUMBER_NONE 1
+// the value is out of range, it is saturated.
+#define ENC_NUMBER_OVERFLOW 2
+
+/**
+ * The number parsers read in one RBM frame up to and including the first
+ * byte that does not belong to the number. That byte is stored in
+ * delimiter, 0 if the package ended before. They return ENC_NUMBER_*.
+ */
+// a decimal with an optional sign
+uint8_t encReadInt32(int32_t *value, char *delimiter);
+uint8_t encReadUint32(uint32_t *value, char *delimiter);
+// hex digits in any case, with an optional "0x"
+uint8_t encReadHex(uint32_t *value, char *delimiter);
+/**
+ * A decimal with an optional sign and '.', as value times 10^scale.
+ * "-1.5" with a scale of 2 is -150, decimals behind scale are dropped.
+ */
+uint8_t encReadFixed(int32_t *value, uint8_t scale, char *delimiter);
 uint8_t encReadUntilSpace(uint8_t *buffer, uint8_t maxn);
 void encCopyIncommingOutgoing(char until);
+void encCopyIncommingOutgoingAll();
 
 #endif /* ENC28J60_H_ */
@@ -0,0 +1,62 @@
+/*
+ * encmemory.h
+ *
+ * The memory map of the 8 KB buffer memory of the enc, derived from the
+ * profile and sizes in config.h:
+ *
+ * ENC_RX_START..ENC_RX_END              receive ring buffer
+ * ENC_TX_START..ENC_TX_END              ENC_TX_SLOTS TX slots
+ * ENC_TEMPLATE_START..ENC_TEMPLATE_END  ENC_TEMPLATES header templates
+ *
+ * The templates sit at the end of the memory, the TX slots below them and
+ * the receive buffer gets all the rest. All addresses are inclusive.
+ */
+
+#ifndef ENCMEMORY_H_
+#define ENCMEMORY_H_
+
+#include "config.h"
+
+#define ENC_MEMORY_SIZE 0x2000
+
+#define ENC_TEMPLATE_START (ENC_MEMORY_SIZE - ENC_TEMPLATES * ENC_TEMPLATE_SIZE)
+#define ENC_TEMPLATE_END (ENC_MEMORY_SIZE - 1)
+
+// The enc sends one TX slot while the next packages are written to the
+// others. A slot holds the control byte, the package (without crc) and the
+// 7 byte status vector the enc writes behind it.
+// The start is aligned to 256 bytes: the headers of a package then share
+// the high byte of their address, which saves register writes when the
+// write pointer jumps between them. The receive buffer ends at an odd
+// address, too.
+#define ENC_TX_START ((ENC_TEMPLATE_START - ENC_TX_SLOTS * ENC_TX_SLOT_SIZE) & ~0xff)
+#define ENC_TX_END (ENC_TX_START + ENC_TX_SLOTS * ENC_TX_SLOT_SIZE - 1)
+
+// errata: the receive buffer needs to start at 0, its internal write pointer
+// may be reset to 0 instead of ERXST.
+#define ENC_RX_START 0x0000
+#define ENC_RX_END (ENC_TX_START - 1)
+#define ENC_RX_SIZE (ENC_RX_END - ENC_RX_START + 1)
+
+// a frame of the maximum length with its 6 byte receive status vector.
+#define ENC_RX_MIN_SIZE (1518 + 6)
+
+#if ENC_TX_SLOTS < 1 || ENC_TX_SLOTS > 16
+#error "ENC_TX_SLOTS needs to be in 1..16"
+#endif
+#if ENC_TX_SLOT_SIZE < 8 + 60
+#error "ENC_TX_SLOT_SIZE needs to hold at least a minimal frame"
+#endif
+#if ENC_TX_START < ENC_RX_START + ENC_RX_MIN_SIZE
+#error "The TX slots and templates leave no room for a receive buffer that holds a full frame."
+#endif
+// errata: ERXRDPT needs to be odd, it is set to ENC_RX_END when the read
+// pointer wraps around.
+#if (ENC_RX_END & 1) == 0
+#error "The receive buffer needs to end at an odd address."
+#endif
+#if ENC_TX_END >= ENC_TEMPLATE_START && ENC_TEMPLATES > 0
+#error "The TX slots overlap the templates."
+#endif
+
+#endif /* ENCMEMORY_H_ */
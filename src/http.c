@@ -0,0 +1,783 @@
+/*
+ * http.c
+ *
+ * Streaming HTTP/1.1 server, see http.h.
+ *
+ * The parser sees every byte of a request once, in one SPI burst per
+ * segment. Method, path and header names are matched against PROGMEM
+ * tables as they arrive: a bit mask keeps the entries that still match.
+ *
+ * The head of a response ends with HTTP_FRAMING_SIZE bytes that are written
+ * when the length is known. If the response ends in its first segment,
+ * they become the Content-Length, padded with spaces in front of the value.
+ * If the first segment fills up before, they become the header of a chunked
+ * response and every segment carries one chunk, whose size is patched
+ * before the segment is sent. HTTP/1.0 clients get no chunks, the end of
+ * the connection ends the response for them. If the framing bytes do not
+ * fit in the segment that ends the head, the response is chunked from the
+ * start.
+ *
+ * A response only takes the segments the send window has room for. A
+ * handler that returns before httpEndResponse() pauses it: the segment is
+ * framed as if it was full and sent, and the handler is called again in a
+ * new segment when acks made room. Requests that arrive meanwhile are left
+ * to the peer to send again.
+ */
+
+#include "http.h"
+#include "enc28j60.h"
+#include <string.h>
+
+#define HTTP_STATE_IDLE 0
+#define HTTP_STATE_METHOD 1
+#define HTTP_STATE_PATH 2
+#define HTTP_STATE_QUERY 3
+#define HTTP_STATE_VERSION 4
+#define HTTP_STATE_HEADER_NAME 5
+#define HTTP_STATE_HEADER_VALUE 6
+#define HTTP_STATE_BODY 7
+#define HTTP_STATE_ERROR 8
+
+#define HTTP_FLAG_VERSION_11 (1 << 0)
+#define HTTP_FLAG_CLOSE (1 << 1)
+#define HTTP_FLAG_RESPONDED (1 << 2)
+// the handler returned before the end of the response.
+#define HTTP_FLAG_PAUSED (1 << 3)
+// the paused response is chunked, not ended by the close.
+#define HTTP_FLAG_CHUNKED (1 << 4)
+
+#define HTTP_HEADER_CONTENT_LENGTH 0
+#define HTTP_HEADER_CONNECTION 1
+#define HTTP_HEADER_TRANSFER_ENCODING 2
+#define HTTP_HEADERS 3
+
+#define HTTP_NONE 0xff
+
+// "Transfer-Encoding: chunked\r\n\r\n" and the size of the first chunk.
+#define HTTP_FRAMING_SIZE 35
+// "xxx\r\n" in front of every chunk.
+#define HTTP_CHUNK_HEADER_SIZE 5
+// room for "\r\n0\r\n\r\n" behind the last chunk.
+#define HTTP_SEGMENT_RESERVE 7
+// segments the head of a response may take, with a small mss.
+#if TCP_SEND_WINDOW > 1
+#define HTTP_HEAD_SEGMENTS 2
+#else
+#define HTTP_HEAD_SEGMENTS 1
+#endif
+
+#define HTTP_FRAMING_PENDING 0
+#define HTTP_FRAMING_CHUNKED 1
+#define HTTP_FRAMING_CLOSE 2
+// the status line and headers are being written.
+#define HTTP_FRAMING_HEAD 3
+// no response is being written.
+#define HTTP_FRAMING_ENDED 4
+
+static const char methodGet[] PROGMEM = "GET";
+static const char methodPost[] PROGMEM = "POST";
+static const char methodPut[] PROGMEM = "PUT";
+static const char methodDelete[] PROGMEM = "DELETE";
+static PGM_P const methodNames[HTTP_METHODS] PROGMEM = { methodGet, methodPost,
+		methodPut, methodDelete };
+
+// lower case, received names are compared in lower case.
+static const char headerContentLength[] PROGMEM = "content-length";
+static const char headerConnection[] PROGMEM = "connection";
+static const char headerTransferEncoding[] PROGMEM = "transfer-encoding";
+static PGM_P const headerNames[HTTP_HEADERS] PROGMEM = { headerContentLength,
+		headerConnection, headerTransferEncoding };
+
+static const char tokenClose[] PROGMEM = "close";
+static PGM_P const connectionTokens[1] PROGMEM = { tokenClose };
+
+static const char httpVersion[] PROGMEM = "HTTP/1.";
+
+// the request being parsed.
+static HttpSession *parsingSession;
+static HttpServer *parsingServer;
+
+// the response being written.
+static HttpSession *responseSession;
+static uint8_t framing = HTTP_FRAMING_ENDED;
+// write marks in the segment: the framing bytes, the first byte of the
+// content and the header of the current chunk.
+static uint16_t framingMark;
+static uint16_t contentStart;
+static uint16_t chunkMark;
+
+static uint16_t allOf(uint8_t count) {
+	return count >= HTTP_MAX_ROUTES ? 0xffff : (1 << count) - 1;
+}
+
+/**
+ * Drops the entries of a PROGMEM table whose string does not have value at
+ * position. Every entry starts with the PGM_P of its string. Entries with
+ * a '*' there move to wildcards, if it is not 0.
+ */
+static uint16_t matchByte(uint16_t candidates, const void *table,
+		uint8_t stride, uint8_t position, uint8_t value, uint16_t *wildcards) {
+	if (value == 0 || position == 0xff) {
+		return 0;
+	}
+	const uint8_t *entry = (const uint8_t*) table;
+	for (uint16_t bit = 1; bit != 0 && bit <= candidates; bit <<= 1) {
+		if (candidates & bit) {
+			PGM_P string = (PGM_P) pgm_read_ptr(entry);
+			uint8_t expected = pgm_read_byte(string + position);
+			if (expected != value) {
+				candidates &= ~bit;
+				if (expected == '*' && wildcards != 0) {
+					*wildcards |= bit;
+				}
+			}
+		}
+		entry += stride;
+	}
+	return candidates;
+}
+
+/**
+ * Gets the first entry whose string ends at position, or a wildcard.
+ */
+static uint8_t findMatch(uint16_t candidates, const void *table,
+		uint8_t stride, uint8_t position, uint16_t wildcards) {
+	const uint8_t *entry = (const uint8_t*) table;
+	uint8_t index = 0;
+	for (uint16_t bit = 1; bit != 0 && bit <= (candidates | wildcards);
+			bit <<= 1) {
+		if (wildcards & bit) {
+			return index;
+		}
+		if (candidates & bit) {
+			PGM_P string = (PGM_P) pgm_read_ptr(entry);
+			if (pgm_read_byte(string + position) == 0) {
+				return index;
+			}
+		}
+		entry += stride;
+		index++;
+	}
+	return HTTP_NONE;
+}
+
+static uint8_t toLower(uint8_t value) {
+	if (value >= 'A' && value <= 'Z') {
+		return value + ('a' - 'A');
+	}
+	return value;
+}
+
+static uint8_t failRequest(HttpSession *session, uint16_t status) {
+	session->status = status;
+	session->state = HTTP_STATE_ERROR;
+	return 0;
+}
+
+static void startRequest(HttpSession *session) {
+	session->state = HTTP_STATE_METHOD;
+	session->flags = 0;
+	session->position = 0;
+	session->candidates = allOf(HTTP_METHODS);
+	session->route = HTTP_NONE;
+	session->status = 0;
+	session->contentLength = 0;
+	session->queryLength = 0;
+	session->query[0] = 0;
+}
+
+static void startHeaderLine(HttpSession *session) {
+	session->state = HTTP_STATE_HEADER_NAME;
+	session->position = 0;
+	session->candidates = allOf(HTTP_HEADERS);
+}
+
+/**
+ * Handles the end of a token of the Connection header.
+ */
+static void connectionToken(HttpSession *session) {
+	if (session->position > 0
+			&& findMatch(session->candidates, connectionTokens, sizeof(PGM_P),
+					session->position, 0) != HTTP_NONE) {
+		session->flags |= HTTP_FLAG_CLOSE;
+	}
+	session->position = 0;
+	session->candidates = 1;
+}
+
+/**
+ * The request line and headers are complete.
+ */
+static uint8_t headersReceived(HttpSession *session) {
+	if (session->status != 0) {
+		// a body we can not read.
+		return failRequest(session, session->status);
+	}
+	if (!(session->flags & HTTP_FLAG_VERSION_11)) {
+		// no keep-alive for HTTP/1.0.
+		session->flags |= HTTP_FLAG_CLOSE;
+	}
+	if (session->route == HTTP_NONE) {
+		session->status = 404;
+	} else if (!(pgm_read_byte(&parsingServer->routes[session->route].methods)
+			& (1 << session->method))) {
+		session->status = 405;
+	}
+	session->state = HTTP_STATE_BODY;
+	return 0;
+}
+
+static uint8_t parseHeaderValue(HttpSession *session, uint8_t value) {
+	if (session->header == HTTP_HEADER_CONTENT_LENGTH) {
+		if (value >= '0' && value <= '9') {
+			if (session->contentLength > 0xfffffff) {
+				return failRequest(session, 413);
+			}
+			session->contentLength = session->contentLength * 10
+					+ (value - '0');
+		} else if (value != ' ' && value != '\t' && value != '\r') {
+			return failRequest(session, 400);
+		}
+	} else if (session->header == HTTP_HEADER_CONNECTION) {
+		if (value == ',' || value == ' ' || value == '\t' || value == '\r') {
+			connectionToken(session);
+		} else {
+			session->candidates = matchByte(session->candidates,
+					connectionTokens, sizeof(PGM_P), session->position,
+					toLower(value), 0);
+			session->position++;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Takes the next byte of the request. Returns 0 when the reading has to
+ * stop: at the end of the headers and on errors.
+ */
+static uint8_t parseByte(uint8_t value) {
+	HttpSession *session = parsingSession;
+	switch (session->state) {
+	case HTTP_STATE_IDLE:
+		if (value == '\r' || value == '\n') {
+			// empty lines between requests are allowed.
+			return 1;
+		}
+		startRequest(session);
+		/* fall through */
+	case HTTP_STATE_METHOD:
+		if (value == ' ') {
+			session->method = findMatch(session->candidates, methodNames,
+					sizeof(PGM_P), session->position, 0);
+			if (session->method == HTTP_NONE) {
+				return failRequest(session, 501);
+			}
+			session->state = HTTP_STATE_PATH;
+			session->position = 0;
+			session->candidates = allOf(parsingServer->routeCount);
+			session->wildcards = 0;
+		} else {
+			session->candidates = matchByte(session->candidates, methodNames,
+					sizeof(PGM_P), session->position, value, 0);
+			session->position++;
+		}
+		break;
+	case HTTP_STATE_PATH:
+		if (value == ' ' || value == '?') {
+			session->route = findMatch(session->candidates,
+					parsingServer->routes, sizeof(HttpRoute),
+					session->position, session->wildcards);
+			session->state =
+					value == '?' ? HTTP_STATE_QUERY : HTTP_STATE_VERSION;
+			session->position = 0;
+		} else if (value == '\r' || value == '\n') {
+			return failRequest(session, 400);
+		} else {
+			session->candidates = matchByte(session->candidates,
+					parsingServer->routes, sizeof(HttpRoute),
+					session->position, value, &session->wildcards);
+			if (session->position < 0xff) {
+				session->position++;
+			}
+		}
+		break;
+	case HTTP_STATE_QUERY:
+		if (value == ' ') {
+			session->state = HTTP_STATE_VERSION;
+		} else if (value == '\r' || value == '\n') {
+			return failRequest(session, 400);
+		} else if (session->queryLength < HTTP_MAX_QUERY) {
+			session->query[session->queryLength++] = value;
+			session->query[session->queryLength] = 0;
+		}
+		break;
+	case HTTP_STATE_VERSION:
+		if (session->position < sizeof(httpVersion) - 1) {
+			if (value != pgm_read_byte(&httpVersion[session->position])) {
+				return failRequest(session, 400);
+			}
+		} else if (session->position == sizeof(httpVersion) - 1) {
+			if (value == '1') {
+				session->flags |= HTTP_FLAG_VERSION_11;
+			} else if (value != '0') {
+				return failRequest(session, 505);
+			}
+		} else if (value == '\n') {
+			startHeaderLine(session);
+			break;
+		} else if (value != '\r') {
+			return failRequest(session, 400);
+		}
+		session->position++;
+		break;
+	case HTTP_STATE_HEADER_NAME:
+		if (value == '\n') {
+			if (session->position == 0) {
+				return headersReceived(session);
+			}
+			// a line without a colon.
+			startHeaderLine(session);
+		} else if (value == ':') {
+			session->header = findMatch(session->candidates, headerNames,
+					sizeof(PGM_P), session->position, 0);
+			if (session->header == HTTP_HEADER_TRANSFER_ENCODING) {
+				// chunked requests are not supported, the body is read
+				// by Content-Length.
+				session->status = 501;
+			}
+			session->state = HTTP_STATE_HEADER_VALUE;
+			session->position = 0;
+			session->candidates = 1;
+		} else if (value != '\r') {
+			session->candidates = matchByte(session->candidates, headerNames,
+					sizeof(PGM_P), session->position, toLower(value), 0);
+			if (session->position < 0xff) {
+				session->position++;
+			}
+		}
+		break;
+	case HTTP_STATE_HEADER_VALUE:
+		if (value == '\n') {
+			if (session->header == HTTP_HEADER_CONNECTION) {
+				connectionToken(session);
+			}
+			startHeaderLine(session);
+		} else {
+			return parseHeaderValue(session, value);
+		}
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+static void skipReceived(uint16_t length) {
+	while (length > 0) {
+		uint8_t part = length > 0xff ? 0xff : length;
+		encSkip(part);
+		length -= part;
+	}
+}
+
+/**
+ * Hands the received part of the body to the route, skips what it does not
+ * read.
+ */
+static void receiveBody(HttpServer *server, HttpSession *session) {
+	uint16_t length = encGetRemaining();
+	if (length > session->contentLength) {
+		length = session->contentLength;
+	}
+	if (length == 0) {
+		return;
+	}
+	uint16_t remaining = encGetRemaining();
+	if (session->status == 0) {
+		void (*body)(HttpSession*, uint16_t) = (void (*)(HttpSession*,
+				uint16_t)) pgm_read_ptr(&server->routes[session->route].body);
+		if (body != 0) {
+			body(session, length);
+		}
+	}
+	uint16_t read = remaining - encGetRemaining();
+	if (read < length) {
+		skipReceived(length - read);
+	}
+	session->contentLength -= length;
+}
+
+static PGM_P reasonPhrase(uint16_t status) {
+	switch (status) {
+	case 200:
+		return PSTR("OK");
+	case 201:
+		return PSTR("Created");
+	case 400:
+		return PSTR("Bad Request");
+	case 404:
+		return PSTR("Not Found");
+	case 405:
+		return PSTR("Method Not Allowed");
+	case 413:
+		return PSTR("Payload Too Large");
+	case 500:
+		return PSTR("Internal Server Error");
+	case 501:
+		return PSTR("Not Implemented");
+	case 505:
+		return PSTR("HTTP Version Not Supported");
+	default:
+		return PSTR("");
+	}
+}
+
+/**
+ * Overwrites the framing bytes with the header name, spaces and value.
+ */
+static void writeFraming(PGM_P name, const char *value, uint8_t valueLength) {
+	char buffer[HTTP_FRAMING_SIZE];
+	memset(buffer, ' ', sizeof(buffer));
+	memcpy_P(buffer, name, strlen_P(name));
+	memcpy(buffer + sizeof(buffer) - valueLength, value, valueLength);
+	encSetWritePointer(framingMark);
+	encWriteSequence(buffer, sizeof(buffer));
+}
+
+/**
+ * Writes 3 hex digits, enough for a segment.
+ */
+static void formatChunkSize(char *to, uint16_t size) {
+	static const char hexDigits[] PROGMEM = "0123456789abcdef";
+	to[0] = pgm_read_byte(&hexDigits[(size >> 8) & 0xf]);
+	to[1] = pgm_read_byte(&hexDigits[(size >> 4) & 0xf]);
+	to[2] = pgm_read_byte(&hexDigits[size & 0xf]);
+}
+
+/**
+ * Writes the size of the chunk that started at chunkMark and ends at end.
+ */
+static void patchChunkSize(uint16_t end) {
+	char size[3];
+	formatChunkSize(size, end - chunkMark - HTTP_CHUNK_HEADER_SIZE);
+	encSetWritePointer(chunkMark);
+	encWriteSequence(size, sizeof(size));
+}
+
+/**
+ * The response does not fit in its first segment: it is sent chunked, or
+ * to HTTP/1.0 clients until the connection is closed.
+ */
+static void leaveFirstSegment(uint16_t end) {
+	if (responseSession->flags & HTTP_FLAG_VERSION_11) {
+		char value[] = "chunked\r\n\r\nxxx\r\n";
+		uint8_t length = sizeof(value) - 1;
+		if (end == contentStart) {
+			// paused before the content, the first chunk comes later.
+			length -= HTTP_CHUNK_HEADER_SIZE;
+		}
+		formatChunkSize(value + 11, end - contentStart);
+		writeFraming(PSTR("Transfer-Encoding:"), value, length);
+		framing = HTTP_FRAMING_CHUNKED;
+	} else {
+		writeFraming(PSTR("Connection:"), "close\r\n\r\n", 9);
+		framing = HTTP_FRAMING_CLOSE;
+	}
+}
+
+/**
+ * Called by the tcp layer around every segment after the first one.
+ */
+static void frameSegment(TCPChannel *channel, uint8_t event) {
+	(void) channel;
+	if (framing == HTTP_FRAMING_HEAD) {
+		// the head goes on in the next segment as it is.
+		return;
+	}
+	if (event == TCP_SEGMENT_FULL) {
+		uint16_t end = encGetWriteMark();
+		if (framing == HTTP_FRAMING_PENDING) {
+			leaveFirstSegment(end);
+		} else if (framing == HTTP_FRAMING_CHUNKED) {
+			patchChunkSize(end);
+		}
+		encSetWritePointer(end);
+		if (framing == HTTP_FRAMING_CHUNKED) {
+			encWriteSequence("\r\n", 2);
+		}
+	} else if (framing == HTTP_FRAMING_CHUNKED) {
+		chunkMark = encGetWriteMark();
+		encWriteSequence("000\r\n", HTTP_CHUNK_HEADER_SIZE);
+	}
+}
+
+/**
+ * Ends a head that left too little room for the framing bytes in its
+ * segment: chunked, or closed for HTTP/1.0. The padding behind the header
+ * name moves the rest of the head into the next segment, so that the
+ * first chunk header is not split.
+ */
+static void writeEarlyFraming(uint16_t space) {
+	if (responseSession->flags & HTTP_FLAG_VERSION_11) {
+		uint16_t padding = space > 20 ? space - 19 : 1;
+		encWriteFormat_P(PSTR("\r\nTransfer-Encoding:%*schunked\r\n\r\n"),
+				padding, "");
+		framing = HTTP_FRAMING_CHUNKED;
+		chunkMark = encGetWriteMark();
+		encWriteSequence("000\r\n", HTTP_CHUNK_HEADER_SIZE);
+	} else {
+		// the head has "Connection: close" already.
+		encWriteFormat_P(PSTR("\r\n\r\n"));
+		framing = HTTP_FRAMING_CLOSE;
+	}
+	contentStart = encGetWriteMark();
+}
+
+/**
+ * Writes the head of a response, allowed are the methods of a 405.
+ */
+static void writeResponseHead(HttpSession *session, uint16_t status,
+		PGM_P contentType, uint8_t allowed) {
+	session->flags |= HTTP_FLAG_RESPONDED;
+	responseSession = session;
+	sendTcpResponseHeader(&session->channel,
+			(1 << TCP_FLAG_ACK) | (1 << TCP_FLAG_PSH));
+	framing = HTTP_FRAMING_HEAD;
+	tcpSetSegmentHook(frameSegment, HTTP_SEGMENT_RESERVE);
+
+	encWriteFormat_P(PSTR("HTTP/1.1 %u %S"), status, reasonPhrase(status));
+	if (contentType != 0) {
+		encWriteFormat_P(PSTR("\r\nContent-Type: %S"), contentType);
+	}
+	if (allowed != 0) {
+		encWriteFormat_P(PSTR("\r\nAllow:"));
+		for (uint8_t i = 0; i < HTTP_METHODS; i++) {
+			if (allowed & (1 << i)) {
+				allowed &= ~(1 << i);
+				encWriteFormat_P(PSTR(" %S%S"),
+						(PGM_P) pgm_read_ptr(&methodNames[i]),
+						allowed != 0 ? PSTR(",") : PSTR(""));
+			}
+		}
+	}
+	if (session->flags & HTTP_FLAG_CLOSE) {
+		encWriteFormat_P(PSTR("\r\nConnection: close"));
+	}
+
+	// a first chunk needs at least one byte, "000" would end the response.
+	uint16_t space = tcpGetSegmentSpace();
+	if (space <= 2 + HTTP_FRAMING_SIZE) {
+		writeEarlyFraming(space);
+		return;
+	}
+	// the framing goes behind the "\r\n", in the segment with the end of
+	// the head.
+	framingMark = encGetWriteMark() + 2;
+	encWriteFormat_P(PSTR("\r\n%*s"), HTTP_FRAMING_SIZE, "");
+	contentStart = encGetWriteMark();
+	chunkMark = contentStart - HTTP_CHUNK_HEADER_SIZE;
+	framing = HTTP_FRAMING_PENDING;
+}
+
+uint8_t httpStartResponse(HttpSession *session, uint16_t status,
+		PGM_P contentType) {
+	if (session->flags & HTTP_FLAG_PAUSED) {
+		// called again, the head is sent already.
+		return 0;
+	}
+	writeResponseHead(session, status, contentType, 0);
+	return 1;
+}
+
+uint16_t httpGetSendSpace(HttpSession *session) {
+	TCPChannel *channel = &session->channel;
+	uint8_t window = tcpGetFreeSendWindow(channel);
+	if (window == 0) {
+		return 0;
+	}
+	// every further segment carries a chunk header and the end of a chunk.
+	return tcpGetSegmentSpace() + (window - 1) * (tcpGetSegmentSize(channel)
+			- HTTP_CHUNK_HEADER_SIZE - HTTP_SEGMENT_RESERVE);
+}
+
+void httpEndResponse(HttpSession *session) {
+	// the reserved bytes are free for the end now.
+	tcpSetSegmentHook(0, 0);
+	uint16_t end = encGetWriteMark();
+	if (framing == HTTP_FRAMING_PENDING) {
+		// the framing bytes are overwritten in one burst, so the digits are
+		// put together in RAM.
+		char value[14];
+		uint8_t length = encFormatInt32(value, end - contentStart);
+		memcpy(value + length, "\r\n\r\n", 4);
+		writeFraming(PSTR("Content-Length:"), value, length + 4);
+		encSetWritePointer(end);
+	} else if (framing == HTTP_FRAMING_CHUNKED) {
+		if (end - chunkMark > HTTP_CHUNK_HEADER_SIZE) {
+			patchChunkSize(end);
+			encSetWritePointer(end);
+			encWriteSequence("\r\n0\r\n\r\n", 7);
+		} else {
+			// "000\r\n" is the last chunk already.
+			encWriteSequence("\r\n", 2);
+		}
+	}
+	framing = HTTP_FRAMING_ENDED;
+	if (!sendTcpResponse(&session->channel)) {
+		// a segment found no room in the send window.
+		session->flags |= HTTP_FLAG_CLOSE;
+	}
+}
+
+/**
+ * Sends what the handler wrote so far as if the segment was full, the
+ * handler goes on in resumeResponse().
+ */
+static void pauseResponse(HttpSession *session) {
+	tcpSetSegmentHook(0, 0);
+	uint16_t end = encGetWriteMark();
+	if (framing == HTTP_FRAMING_PENDING && end == contentStart) {
+		leaveFirstSegment(end);
+		encSetWritePointer(end);
+	} else if (framing == HTTP_FRAMING_CHUNKED
+			&& end - chunkMark == HTTP_CHUNK_HEADER_SIZE) {
+		// an empty chunk would end the response.
+		encSetWritePointer(chunkMark);
+	} else {
+		frameSegment(&session->channel, TCP_SEGMENT_FULL);
+	}
+	if (framing == HTTP_FRAMING_CHUNKED) {
+		session->flags |= HTTP_FLAG_CHUNKED;
+	} else {
+		session->flags &= ~HTTP_FLAG_CHUNKED;
+	}
+	session->flags |= HTTP_FLAG_PAUSED;
+	framing = HTTP_FRAMING_ENDED;
+	if (!sendTcpResponse(&session->channel)) {
+		session->flags = (session->flags | HTTP_FLAG_CLOSE) & ~HTTP_FLAG_PAUSED;
+	}
+}
+
+/**
+ * Opens the next segment of a paused response.
+ */
+static void resumeResponse(HttpSession *session) {
+	responseSession = session;
+	sendTcpResponseHeader(&session->channel,
+			(1 << TCP_FLAG_ACK) | (1 << TCP_FLAG_PSH));
+	framing = (session->flags & HTTP_FLAG_CHUNKED) ?
+			HTTP_FRAMING_CHUNKED : HTTP_FRAMING_CLOSE;
+	tcpSetSegmentHook(frameSegment, HTTP_SEGMENT_RESERVE);
+	frameSegment(&session->channel, TCP_SEGMENT_OPENED);
+}
+
+/**
+ * Answers a request the route does not handle.
+ */
+static void sendStatus(HttpServer *server, HttpSession *session) {
+	uint8_t allowed = 0;
+	if (session->status == 405) {
+		allowed = pgm_read_byte(&server->routes[session->route].methods);
+	}
+	writeResponseHead(session, session->status, 0, allowed);
+	httpEndResponse(session);
+}
+
+static void callHandler(HttpServer *server, HttpSession *session) {
+	void (*handler)(HttpSession*) = (void (*)(HttpSession*)) pgm_read_ptr(
+			&server->routes[session->route].handler);
+	handler(session);
+}
+
+/**
+ * Writes the response to the request, or the next part of a paused one.
+ */
+static void respond(HttpServer *server, HttpSession *session) {
+	if (session->flags & HTTP_FLAG_PAUSED) {
+		uint8_t fullWindow = tcpGetFreeSendWindow(&session->channel)
+				== TCP_SEND_WINDOW;
+		resumeResponse(session);
+		uint16_t mark = encGetWriteMark();
+		callHandler(server, session);
+		if (framing != HTTP_FRAMING_ENDED && fullWindow
+				&& encGetWriteMark() == mark) {
+			// the handler waits for more room than there will ever be.
+			pauseResponse(session);
+			session->flags |= HTTP_FLAG_CLOSE;
+		}
+	} else {
+		session->flags &= ~HTTP_FLAG_RESPONDED;
+		if (session->status == 0) {
+			callHandler(server, session);
+			if (!(session->flags & HTTP_FLAG_RESPONDED)) {
+				session->status = 500;
+			}
+		}
+		if (session->status != 0) {
+			sendStatus(server, session);
+		}
+	}
+	if (framing != HTTP_FRAMING_ENDED) {
+		pauseResponse(session);
+	} else {
+		session->flags &= ~HTTP_FLAG_PAUSED;
+	}
+}
+
+/**
+ * A new response needs room for its head, a paused one for a segment.
+ */
+static uint8_t canRespond(HttpSession *session) {
+	uint8_t window = tcpGetFreeSendWindow(&session->channel);
+	if (session->flags & HTTP_FLAG_PAUSED) {
+		return window > 0;
+	}
+	return window >= HTTP_HEAD_SEGMENTS;
+}
+
+/**
+ * Receive callback of the TCPApp of a server.
+ */
+void httpReceive(TCPChannel *channel) {
+	HttpSession *session = (HttpSession*) channel;
+	HttpServer *server = (HttpServer*) channel->app;
+	while (1) {
+		if (session->state == HTTP_STATE_BODY
+				&& !(session->flags & HTTP_FLAG_PAUSED)) {
+			receiveBody(server, session);
+			if (session->contentLength > 0) {
+				// the rest comes with the next segments.
+				return;
+			}
+		}
+		if (session->state == HTTP_STATE_BODY
+				|| session->state == HTTP_STATE_ERROR) {
+			if (!canRespond(session)) {
+				// the request waits for acks, the peer sends what follows
+				// it again.
+				tcpRefuseReceived(channel);
+				return;
+			}
+			if (session->state == HTTP_STATE_ERROR) {
+				// the rest of the request can not be parsed.
+				session->flags |= HTTP_FLAG_CLOSE;
+			}
+			respond(server, session);
+			if (session->flags & HTTP_FLAG_PAUSED) {
+				tcpRefuseReceived(channel);
+				return;
+			}
+			if (session->flags & HTTP_FLAG_CLOSE) {
+				finTcpSession(channel);
+				return;
+			}
+			session->state = HTTP_STATE_IDLE;
+		} else if (encGetRemaining() == 0) {
+			return;
+		} else {
+			parsingSession = session;
+			parsingServer = server;
+			encReadEach(parseByte);
+		}
+	}
+}
@@ -0,0 +1,126 @@
+/*
+ * http.h
+ *
+ * A streaming HTTP/1.1 server as a TCPApp. Requests are parsed byte by byte
+ * straight from the receive buffer of the enc; only the method, the route,
+ * the query and the headers the server needs are kept. The handler of the
+ * route writes the response with the encWrite* functions, the server frames
+ * it: a response that fits in one segment gets a back-patched
+ * Content-Length, a longer one is sent chunked, one chunk per segment.
+ * A response larger than the send window is written in parts, see
+ * HttpRoute.handler.
+ */
+
+#ifndef HTTP_H_
+#define HTTP_H_
+
+#include "tcpip.h"
+#include <avr/pgmspace.h>
+
+// Bytes of the query (behind the '?') kept for the handler, longer ones are cut.
+#ifndef HTTP_MAX_QUERY
+#define HTTP_MAX_QUERY 16
+#endif
+// Routes of a server, the rest of the table is never matched.
+#define HTTP_MAX_ROUTES 16
+
+#define HTTP_METHOD_GET 0
+#define HTTP_METHOD_POST 1
+#define HTTP_METHOD_PUT 2
+#define HTTP_METHOD_DELETE 3
+#define HTTP_METHODS 4
+// methods of a route
+#define HTTP_GET (1 << HTTP_METHOD_GET)
+#define HTTP_POST (1 << HTTP_METHOD_POST)
+#define HTTP_PUT (1 << HTTP_METHOD_PUT)
+#define HTTP_DELETE (1 << HTTP_METHOD_DELETE)
+
+typedef struct HttpSession HttpSession;
+
+/**
+ * A route, in PROGMEM like its path. A path ending in '*' matches every path
+ * that starts with it. The first route in the table that matches is taken.
+ */
+typedef struct {
+	// has to stay the first field.
+	PGM_P path;
+	// HTTP_GET | HTTP_POST ...
+	uint8_t methods;
+	/**
+	 * Called when the request and its body are received. Writes the
+	 * response with httpStartResponse(), the encWrite* functions and
+	 * httpEndResponse(). Only httpGetSendSpace() bytes fit in the send
+	 * window: to write more, the handler returns before httpEndResponse()
+	 * and is called again when acks made room. A handler that writes
+	 * nothing although the window is empty ends the connection. With a
+	 * TCP_SEND_WINDOW of 1, the head has to fit in one segment.
+	 */
+	void (*handler)(HttpSession *session);
+	/**
+	 * Called while the body is received. Reads at most length bytes with
+	 * the encRead* functions, the rest is skipped. May be 0.
+	 */
+	void (*body)(HttpSession *session, uint16_t length);
+} HttpRoute;
+
+typedef struct {
+	// has to stay the first field.
+	TCPApp app;
+	const HttpRoute *routes;
+	uint8_t routeCount;
+} HttpServer;
+
+/**
+ * The session of a connection. Take them from a pool (which zeroes them on
+ * connect), an app can add its own fields behind it.
+ */
+struct HttpSession {
+	TCPChannel channel;
+	// set by the library.
+	uint8_t state;
+	uint8_t flags;
+	uint8_t position;
+	uint8_t header;
+	uint16_t candidates;
+	uint16_t wildcards;
+	// HTTP_METHOD_* of the request.
+	uint8_t method;
+	// index in the route table.
+	uint8_t route;
+	// status the server answers with instead of the route, 0 if none.
+	uint16_t status;
+	// length of the body, the bytes still to come while it is received.
+	uint32_t contentLength;
+	uint8_t queryLength;
+	// the query of the request, 0 terminated.
+	char query[HTTP_MAX_QUERY + 1];
+};
+
+void httpReceive(TCPChannel *channel);
+
+/**
+ * Declares a server named name on port, with a PROGMEM route table and a
+ * TCPChannelPool of HttpSessions. Register it with addTcpApp(&name.app).
+ */
+#define HTTP_SERVER(name, port, routeTable, pool) \
+	HttpServer name = { { port, 0, httpReceive, 0, &pool }, routeTable, \
+			sizeof(routeTable) / sizeof(HttpRoute) }
+
+/**
+ * Writes the status line and headers. contentType is in PROGMEM, may be 0.
+ * @return 0 if the handler is called again for a paused response, the head
+ * is sent then.
+ */
+uint8_t httpStartResponse(HttpSession *session, uint16_t status,
+		PGM_P contentType);
+/**
+ * Gets the number of content bytes the send window has room for.
+ */
+uint16_t httpGetSendSpace(HttpSession *session);
+/**
+ * Completes the framing and sends the rest of the response. If the request
+ * asked for it, the connection is closed behind it.
+ */
+void httpEndResponse(HttpSession *session);
+
+#endif /* HTTP_H_ */
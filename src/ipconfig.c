@@ -10,6 +10,7 @@
  */
 
 #include "tcpip.h"
+#include "enc28j60.h"
 #include <avr/eeprom.h>
 #include <string.h>
 
@@ -42,7 +43,8 @@ uint8_t isMyIp(IpAddress *address) {
 void setMyIp(IpAddress *address) {
 	eeprom_write_block(address, &ipAddressEEMEM, sizeof(IpAddress));
 
-	memcpy(&ipAddressCache, address, sizeof(address));
+	memcpy(&ipAddressCache, address, sizeof(IpAddress));
+	encSetArpFilter(address);
 }
 
 void setToMyIp(IpAddress *address) {
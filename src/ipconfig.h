@@ -8,7 +8,7 @@
 #ifndef IPCONFIG_H_
 #define IPCONFIG_H_
 
-void getMyIp(IpAddress *address);
+IpAddress *getMyIp();
 void setMyIp(IpAddress *address);
 void setToMyIp(IpAddress *address);
 uint8_t isMyIp(IpAddress *address);
@@ -0,0 +1,88 @@
+/*
+ * spiport.h
+ *
+ * The SPI connection to the enc. On the avr, the functions are inlined and
+ * talk to the SPI hardware directly. A host build (ENC_HOST) links its own
+ * implementation, e.g. an emulated enc.
+ */
+
+#ifndef SPIPORT_H_
+#define SPIPORT_H_
+
+#include <stdint.h>
+
+#ifdef ENC_HOST
+
+void spiPortInit(void);
+/**
+ * Pulls the chip select low.
+ */
+void spiPortSelect(void);
+void spiPortDeselect(void);
+/**
+ * Sends a byte and returns the byte received at the same time.
+ */
+uint8_t spiPortTransfer(uint8_t value);
+
+/**
+ * Lets the INT pin of the enc call encInterrupt() while it is low.
+ */
+void spiPortEnableInterrupt(void);
+void spiPortDisableInterrupt(void);
+
+#else
+
+#include <avr/io.h>
+
+#define SPI_SS_PIN 4
+#define SPI_MOSI_PIN 5
+#define SPI_MISO_PIN 6
+#define SPI_SCK_PIN 7
+#define SPI_PORT PORTB
+#define SPI_DDR DDRB
+
+static inline void spiPortInit(void) {
+	SPI_DDR = (1 << SPI_MOSI_PIN) | (1 << SPI_SCK_PIN) | (1 << SPI_SS_PIN);
+	SPCR = (1 << SPE) | (1 << MSTR);
+	SPSR = (1 << SPI2X);
+	SPI_PORT |= (1 << SPI_SS_PIN);
+}
+
+static inline void spiPortSelect(void) {
+	SPI_PORT &= ~(1 << SPI_SS_PIN);
+}
+
+static inline void spiPortDeselect(void) {
+	SPI_PORT |= (1 << SPI_SS_PIN);
+}
+
+static inline uint8_t spiPortTransfer(uint8_t value) {
+	SPDR = value;
+	while (!(SPSR & (1 << SPIF))) {
+	}
+	return SPDR;
+}
+
+// INT0 with the default low level trigger, so it fires again as long as the
+// enc has work.
+#ifndef SPI_INT_MASK
+#ifdef EIMSK
+#define SPI_INT_MASK EIMSK
+#else
+#define SPI_INT_MASK GICR
+#endif
+#define SPI_INT_BIT INT0
+#define SPI_INT_VECTOR INT0_vect
+#endif
+
+static inline void spiPortEnableInterrupt(void) {
+	SPI_INT_MASK |= 1 << SPI_INT_BIT;
+}
+
+static inline void spiPortDisableInterrupt(void) {
+	SPI_INT_MASK &= ~(1 << SPI_INT_BIT);
+}
+
+#endif
+
+#endif /* SPIPORT_H_ */
@@ -0,0 +1,42 @@
+/*
+ * stats.c
+ *
+ * Hot path counters, see stats.h.
+ */
+
+#include "stats.h"
+
+#ifdef NET_STATISTICS
+
+#include <string.h>
+
+NetStatistics netStatistics;
+uint8_t statsSpiAccount = STATS_SPI_REGISTER;
+uint8_t statsTxAccount = STATS_SPI_TX_PAYLOAD;
+
+void statsTimerAdd(StatsTimer *timer, StatsCycles cycles) {
+	timer->calls++;
+	timer->cycles += cycles;
+	if (cycles > timer->maxCycles) {
+		timer->maxCycles = cycles;
+	}
+}
+
+void netStatisticsSnapshot(NetStatistics *snapshot) {
+	memcpy(snapshot, &netStatistics, sizeof(NetStatistics));
+}
+
+void netStatisticsReset(void) {
+	memset(&netStatistics, 0, sizeof(NetStatistics));
+}
+
+void netStatisticsSpiTotal(NetStatistics *statistics, StatsSpi *total) {
+	total->bytes = 0;
+	total->selects = 0;
+	for (uint8_t i = 0; i < STATS_SPI_ACCOUNTS; i++) {
+		total->bytes += statistics->spi[i].bytes;
+		total->selects += statistics->spi[i].selects;
+	}
+}
+
+#endif
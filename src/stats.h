@@ -0,0 +1,137 @@
+/*
+ * stats.h
+ *
+ * Optional counters for the hot paths: SPI traffic split by what it is used
+ * for, frames per layer, the tx queue, the receive buffer and cycle counts
+ * of the main entry points.
+ *
+ * Enable them with NET_STATISTICS in config.h. Without it, all macros in
+ * here are empty and nothing is counted.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include "config.h"
+
+// What SPI traffic is used for.
+#define STATS_SPI_REGISTER 0
+#define STATS_SPI_RX 1
+#define STATS_SPI_TX_HEADER 2
+#define STATS_SPI_TX_PAYLOAD 3
+#define STATS_SPI_CHECKSUM 4
+#define STATS_SPI_ACCOUNTS 5
+
+#ifdef NET_STATISTICS
+
+#ifdef ENC_HOST
+typedef uint32_t StatsCycles;
+#else
+// a free running 16 bit timer
+typedef uint16_t StatsCycles;
+#endif
+
+#ifndef STATS_CYCLES
+#ifdef ENC_HOST
+StatsCycles statsHostCycles(void);
+#define STATS_CYCLES() statsHostCycles()
+#else
+#include <avr/io.h>
+// Timer 1 needs to run, e.g. with the cpu clock.
+#define STATS_CYCLES() TCNT1
+#endif
+#endif
+
+typedef struct {
+	uint32_t bytes;
+	// chip select cycles
+	uint32_t selects;
+} StatsSpi;
+
+typedef struct {
+	uint32_t calls;
+	uint32_t cycles;
+	StatsCycles maxCycles;
+} StatsTimer;
+
+typedef struct {
+	StatsSpi spi[STATS_SPI_ACCOUNTS];
+	uint32_t bankSwitches;
+
+	uint32_t ethFrames;
+	uint32_t arpFrames;
+	uint32_t ipFrames;
+	uint32_t tcpFrames;
+	// frames that are not for us (type, mac, ip or protocol)
+	uint32_t droppedByFilter;
+	// tcp frames for a port without app
+	uint32_t droppedNoApp;
+	// tcp frames for a connection we do not know
+	uint32_t droppedNoChannel;
+	// syns and segments with data that were left for the peer to send again,
+	// because the send window had no room for the answer
+	uint32_t refusedNoSlot;
+
+	// packages that started sending
+	uint32_t txSent;
+	// times encStartPackage() had to wait for a free tx slot
+	uint32_t txStalls;
+	// most packages that were waiting in the tx queue at the same time
+	uint8_t txMaxQueueDepth;
+	// packages handed to ENC_RECEIVE_PACKAGE
+	uint32_t rxReceived;
+	// times the receive buffer was full and packages were lost (EIR.RXERIF)
+	uint32_t rxOverflows;
+	// most packages that were waiting in the receive buffer at a poll
+	uint8_t rxMaxPending;
+
+	StatsTimer pollEnc;
+	StatsTimer tcpHeaderReceived;
+	StatsTimer encSend;
+} NetStatistics;
+
+extern NetStatistics netStatistics;
+// account the next SPI frame is counted on.
+extern uint8_t statsSpiAccount;
+// account for writes to the send buffer.
+extern uint8_t statsTxAccount;
+
+void statsTimerAdd(StatsTimer *timer, StatsCycles cycles);
+
+#define STATS_COUNT(field) (netStatistics.field++)
+#define STATS_MAX(field, value) do { \
+	if ((value) > netStatistics.field) netStatistics.field = (value); \
+} while (0)
+#define STATS_SPI_ACCOUNT(account) (statsSpiAccount = (account))
+#define STATS_TX_ACCOUNT(account) (statsTxAccount = (account))
+#define STATS_SPI_BYTE() (netStatistics.spi[statsSpiAccount].bytes++)
+#define STATS_SPI_SELECT() (netStatistics.spi[statsSpiAccount].selects++)
+#define STATS_TIMER_START(name) StatsCycles name##StartCycles = STATS_CYCLES()
+#define STATS_TIMER_STOP(name) \
+	statsTimerAdd(&netStatistics.name, STATS_CYCLES() - name##StartCycles)
+
+/**
+ * Copies the current counters.
+ */
+void netStatisticsSnapshot(NetStatistics *snapshot);
+void netStatisticsReset(void);
+/**
+ * Sums up the SPI traffic of all accounts.
+ */
+void netStatisticsSpiTotal(NetStatistics *statistics, StatsSpi *total);
+
+#else
+
+#define STATS_COUNT(field)
+#define STATS_MAX(field, value)
+#define STATS_SPI_ACCOUNT(account)
+#define STATS_TX_ACCOUNT(account)
+#define STATS_SPI_BYTE()
+#define STATS_SPI_SELECT()
+#define STATS_TIMER_START(name)
+#define STATS_TIMER_STOP(name)
+
+#endif
+
+#endif /* STATS_H_ */
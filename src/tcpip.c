@@ -9,9 +9,12 @@
 #include "enc28j60.h"
 #include "config.h"
 #include "ipconfig.h"
+#include "stats.h"
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <util/atomic.h>
 
 //#define DEBUG_TCP
 
@@ -26,8 +29,34 @@
 
 #define WINDOW_SIZE 5792
 
+#if TCP_MAX_CHANNELS >= 255
+#error "TCP_MAX_CHANNELS needs to be smaller than 255"
+#endif
+#if (TCP_CHANNEL_HASH_SIZE & (TCP_CHANNEL_HASH_SIZE - 1)) || TCP_CHANNEL_HASH_SIZE > 256
+#error "TCP_CHANNEL_HASH_SIZE needs to be a power of two up to 256"
+#endif
+#if (TCP_TIMER_WHEEL_SIZE & (TCP_TIMER_WHEEL_SIZE - 1)) || TCP_TIMER_WHEEL_SIZE > 256
+#error "TCP_TIMER_WHEEL_SIZE needs to be a power of two up to 256"
+#endif
+#if TCP_KEEPALIVE_TIME >= TCP_TIMEOUT
+#error "TCP_KEEPALIVE_TIME needs to be shorter than TCP_TIMEOUT"
+#endif
+
+#define CHANNEL_NONE 0xff
+
+// the ethernet and ip header of a channel.
+#define HEADER_TEMPLATE_SIZE 34
+#if ENC_TEMPLATES > 0 && ENC_TEMPLATE_SIZE < HEADER_TEMPLATE_SIZE
+#error "ENC_TEMPLATE_SIZE needs to be at least 34"
+#endif
+
 TCPApp *apps[TCP_MAX_APPS];
 TCPChannel *channels[TCP_MAX_CHANNELS];
+// first channel in every hash bucket
+static uint8_t channelBuckets[TCP_CHANNEL_HASH_SIZE];
+// next channel in the same bucket. For free positions, the next free one.
+static uint8_t channelNext[TCP_MAX_CHANNELS];
+static uint8_t firstFreeChannel;
 
 IPHeader incommingIpHeader;
 EthernetHeader incommingEthHeader;
@@ -36,10 +65,33 @@ TCPHeader incommingTcpHeader;
 uint16_t tcpipHeaderStartPointer;
 uint16_t tcpHeaderStartPosition;
 uint16_t tcpipStartPosition;
-uint32_t ipHeaderCecksum; //ip header, recomputed, without length!
-uint16_t tcpHeaderPreChecksum;
+uint8_t tcpResponseFlags;
+// ack number in the segment being written.
+static uint32_t tcpResponseAck;
+// set when a segment of the response found no room in the send window, the
+// rest of the response is dropped.
+static uint8_t tcpResponseFailed;
+// set once a segment of the response was sent.
+static uint8_t tcpResponseStarted;
+// channel and data length of the segment in the receive callback.
+static TCPChannel *receivingChannel;
+static uint16_t receivedDataLength;
 #define TCP_LENGTH_OFFSET 2
 #define TCP_CHECKSUM_OFFSET 10
+#define TCP_FLAGS_OFFSET 13
+// length of the tcp header with options of the segment being written.
+static uint8_t tcpHeaderLength;
+// channel of the segment being written.
+static TCPChannel *tcpResponseChannel;
+// write mark behind the last byte that fits in the segment being written.
+static uint16_t tcpSegmentEnd;
+// see tcpSetSegmentHook()
+static TCPSegmentHook tcpSegmentHook;
+static uint8_t tcpSegmentReserve;
+
+#define TCP_OPTION_END 0
+#define TCP_OPTION_NOP 1
+#define TCP_OPTION_MSS 2
 
 static uint8_t isBroadcast(MacAddress* address) {
 	for (int i = 0; i < 6; i++) {
@@ -74,7 +126,13 @@ void initTcpIp() {
 	}
 	for (int i = 0; i < TCP_MAX_CHANNELS; i++) {
 		channels[i] = 0;
+		channelNext[i] = i + 1 < TCP_MAX_CHANNELS ? i + 1 : CHANNEL_NONE;
 	}
+	for (int i = 0; i < TCP_CHANNEL_HASH_SIZE; i++) {
+		channelBuckets[i] = CHANNEL_NONE;
+	}
+	firstFreeChannel = 0;
+	encSetArpFilter(getMyIp());
 }
 
 static TCPApp *findAppWithPort(uint16_t port) {
@@ -96,30 +154,335 @@ uint8_t addTcpApp(TCPApp *app) {
 	return 0;
 }
 
-static void freeChannel(TCPChannel *channel) {
-	for (int i = 0; i < TCP_MAX_CHANNELS; i++) {
-		if (channels[i] == channel) {
-			channels[i] = 0;
+/* ======================== Timers ======================== */
+// timers due in the same millisecond modulo the wheel size.
+static TCPTimer *timerWheel[TCP_TIMER_WHEEL_SIZE];
+// the bucket of the current millisecond.
+static uint8_t timerPosition;
+// counted by tcpTimerTick(), the poll catches up with it. 16 bits, so a
+// main loop that stalls for up to a minute loses no ticks.
+static volatile uint16_t timerTicks;
+static uint16_t timerTicksDone;
+
+static void unlinkTimer(TCPTimer *timer) {
+	*timer->link = timer->next;
+	if (timer->next != 0) {
+		timer->next->link = timer->link;
+	}
+	timer->link = 0;
+}
+
+static void linkTimer(TCPTimer *timer, TCPTimer **bucket) {
+	timer->next = *bucket;
+	if (timer->next != 0) {
+		timer->next->link = &timer->next;
+	}
+	*bucket = timer;
+	timer->link = bucket;
+}
+
+static void cancelTimer(TCPChannel *channel, uint8_t kind) {
+	TCPTimer *timer = &channel->timers[kind];
+	if (timer->link != 0) {
+		unlinkTimer(timer);
+	}
+}
+
+/**
+ * (Re)starts a timer of the channel, it runs out after time milliseconds.
+ */
+static void armTimer(TCPChannel *channel, uint8_t kind, uint32_t time) {
+	TCPTimer *timer = &channel->timers[kind];
+	if (timer->link != 0) {
+		unlinkTimer(timer);
+	}
+	if (time == 0) {
+		time = 1;
+	}
+	timer->kind = kind;
+	timer->rounds = (time - 1) / TCP_TIMER_WHEEL_SIZE;
+	uint8_t bucket = (timerPosition + (uint8_t) time)
+			& (TCP_TIMER_WHEEL_SIZE - 1);
+	linkTimer(timer, &timerWheel[bucket]);
+}
+
+static void cancelTimers(TCPChannel *channel) {
+	for (uint8_t kind = 0; kind < TCP_TIMERS; kind++) {
+		cancelTimer(channel, kind);
+	}
+}
+
+// set while other channels hold the TX slots. The app gets a receive
+// callback without data when one is released.
+#define TCP_SEND_BLOCKED (1 << 0)
+// the oldest segment was sent again, the others follow with the acks.
+#define TCP_SEND_RECOVERING (1 << 1)
+// a response was cut, the channel is reset once the app returns.
+#define TCP_SEND_FAILED (1 << 2)
+
+// set when segments are released, channels that waited for a TX slot go on.
+static uint8_t sendWindowReleased;
+// channels with TCP_SEND_BLOCKED.
+static uint8_t blockedChannels;
+// set when a channel got TCP_SEND_FAILED.
+static uint8_t resetPending;
+
+/**
+ * Forgets all segments that are kept for retransmission.
+ */
+static void releaseSendWindow(TCPChannel *channel) {
+	if (channel->unackedCount > 0) {
+		sendWindowReleased = 1;
+	}
+	for (uint8_t i = 0; i < channel->unackedCount; i++) {
+		encReleaseRetained(channel->unackedSlots[i]);
+	}
+	channel->unackedCount = 0;
+}
+
+/**
+ * Releases the segments that are covered by the ack number.
+ */
+static void acknowledgeSent(TCPChannel *channel, uint32_t ack) {
+	uint8_t acked = 0;
+	while (acked < channel->unackedCount
+			&& (int32_t) (ack - channel->unackedEnds[acked]) >= 0) {
+		encReleaseRetained(channel->unackedSlots[acked]);
+		acked++;
+	}
+	if (acked > 0) {
+		sendWindowReleased = 1;
+		channel->unackedCount -= acked;
+		memmove(channel->unackedSlots, channel->unackedSlots + acked,
+				channel->unackedCount * sizeof(channel->unackedSlots[0]));
+		memmove(channel->unackedEnds, channel->unackedEnds + acked,
+				channel->unackedCount * sizeof(channel->unackedEnds[0]));
+		if (channel->unackedCount > 0) {
+			if (channel->sendFlags & TCP_SEND_RECOVERING) {
+				// what was sent behind a lost segment was dropped, too.
+				encResendRetained(channel->unackedSlots[0]);
+			}
+			armTimer(channel, TCP_TIMER_RETRANSMIT, TCP_RETRANSMIT_TIMEOUT);
+		} else {
+			channel->sendFlags &= ~TCP_SEND_RECOVERING;
+			cancelTimer(channel, TCP_TIMER_RETRANSMIT);
 		}
 	}
 }
 
-static uint8_t getFreeChannelPos() {
-	for (int i = 0; i < TCP_MAX_CHANNELS; i++) {
-		if (channels[i] == 0) {
-			return i;
+static TCPChannel *getPoolSession(TCPChannelPool *pool, uint8_t index) {
+	return (TCPChannel*) ((uint8_t*) pool->sessions
+			+ index * pool->sessionSize);
+}
+
+/**
+ * Takes a zeroed session from the pool, 0 if all are used.
+ */
+static TCPChannel *allocateFromPool(TCPChannelPool *pool) {
+	TCPChannel *channel;
+	if (pool->firstFree) {
+		channel = getPoolSession(pool, pool->firstFree - 1);
+		pool->firstFree = channel->nextFree;
+	} else if (pool->fresh) {
+		channel = getPoolSession(pool, --pool->fresh);
+	} else {
+		return 0;
+	}
+	memset(channel, 0, pool->sessionSize);
+	pool->used++;
+	if (pool->used > pool->highWater) {
+		pool->highWater = pool->used;
+	}
+	return channel;
+}
+
+static void returnToPool(TCPChannelPool *pool, TCPChannel *channel) {
+	uint8_t index = ((uint8_t*) channel - (uint8_t*) pool->sessions)
+			/ pool->sessionSize;
+	channel->nextFree = pool->firstFree;
+	pool->firstFree = index + 1;
+	pool->used--;
+}
+
+static TCPChannel *connectApp(TCPApp *app) {
+	if (app->pool != 0) {
+		return allocateFromPool(app->pool);
+	} else {
+		return app->connect();
+	}
+}
+
+static void disconnectApp(TCPApp *app, TCPChannel *channel) {
+	if (app->disconnect != 0) {
+		app->disconnect(channel);
+	}
+}
+
+static uint8_t channelHash(IpAddress *ip, uint16_t remotePort,
+		uint16_t localPort) {
+	uint8_t hash = ip->addr1 ^ ip->addr2 ^ ip->addr3 ^ ip->addr4;
+	// rotate, so that the same change in ip and port does not cancel out.
+	hash = (uint8_t) ((hash << 3) | (hash >> 5));
+	hash ^= (uint8_t) remotePort ^ (uint8_t) (remotePort >> 8)
+			^ (uint8_t) localPort;
+#if TCP_CHANNEL_HASH_SIZE <= 16
+	hash ^= hash >> 4;
+#endif
+	return hash & (TCP_CHANNEL_HASH_SIZE - 1);
+}
+
+static uint8_t getChannelBucket(TCPChannel *channel) {
+	return channelHash(&channel->ip, channel->port, channel->app->port);
+}
+
+/**
+ * Adds a channel with ip, port and app set to the channel table.
+ * Returns 0 if the table is full.
+ */
+static uint8_t addChannel(TCPChannel *channel) {
+	uint8_t slot = firstFreeChannel;
+	if (slot == CHANNEL_NONE) {
+		return 0;
+	}
+	firstFreeChannel = channelNext[slot];
+
+	uint8_t bucket = getChannelBucket(channel);
+	channelNext[slot] = channelBuckets[bucket];
+	channelBuckets[bucket] = slot;
+	channels[slot] = channel;
+	channel->slot = slot;
+	return 1;
+}
+
+static uint8_t isChannelOpen(TCPChannel *channel) {
+	return channel->slot < TCP_MAX_CHANNELS && channels[channel->slot] == channel;
+}
+
+static uint8_t isClosing(TCPChannel *channel) {
+	return channel->idleState >= TCP_IDLE_FIN_WAIT;
+}
+
+static void setWindowBlocked(TCPChannel *channel, uint8_t blocked) {
+	if (((channel->sendFlags & TCP_SEND_BLOCKED) != 0) != blocked) {
+		channel->sendFlags ^= TCP_SEND_BLOCKED;
+		if (blocked) {
+			blockedChannels++;
+		} else {
+			blockedChannels--;
 		}
 	}
-	return TCP_MAX_CHANNELS;
 }
 
-void finTcpSession(TCPChannel *channel) {
-	TCPApp *app = channel->app;
-	app->disconnect(channel);
+/**
+ * Gets the number of segments that can still be kept for retransmission,
+ * in the window of the channel and in the TX slots all channels share.
+ */
+static uint8_t getSendCapacity(TCPChannel *channel) {
+	uint8_t free = TCP_SEND_WINDOW - channel->unackedCount;
+	uint8_t slots = encGetFreeRetainSlots();
+	return slots < free ? slots : free;
+}
+
+/**
+ * Gets the number of segments the app can send on the channel. While other
+ * channels wait for a TX slot, a channel with segments in flight gets none
+ * and goes on with its next ack.
+ */
+uint8_t tcpGetFreeSendWindow(TCPChannel *channel) {
+	if (channel->sendFlags & TCP_SEND_FAILED) {
+		return 0;
+	}
+	uint8_t free = TCP_SEND_WINDOW - channel->unackedCount;
+	uint8_t window = getSendCapacity(channel);
+	if (blockedChannels > 0 && !(channel->sendFlags & TCP_SEND_BLOCKED)
+			&& channel->unackedCount > 0) {
+		window = 0;
+	}
+	if (window < free) {
+		// other channels hold the slots, see wakeBlockedChannels().
+		if (isChannelOpen(channel)) {
+			setWindowBlocked(channel, 1);
+		}
+	} else {
+		setWindowBlocked(channel, 0);
+	}
+	return window;
+}
 
-	sendTcpResponseHeader(channel, (1 << TCP_FLAG_FIN));
+static void freeChannel(TCPChannel *channel) {
+	if (channel == 0) {
+		return;
+	}
+	releaseSendWindow(channel);
+	setWindowBlocked(channel, 0);
+	cancelTimers(channel);
+	uint8_t slot = channel->slot;
+	if (slot == CHANNEL_NONE || channels[slot] != channel) {
+		return;
+	}
+
+	uint8_t *link = &channelBuckets[getChannelBucket(channel)];
+	while (*link != slot) {
+		link = &channelNext[*link];
+	}
+	*link = channelNext[slot];
+
+	channels[slot] = 0;
+	channelNext[slot] = firstFreeChannel;
+	firstFreeChannel = slot;
+	channel->slot = CHANNEL_NONE;
+	if (isClosing(channel)) {
+		// closed by finTcpSession(), the app gets the session back only now.
+		disconnectApp(channel->app, channel);
+	}
+	if (channel->app->pool != 0) {
+		returnToPool(channel->app->pool, channel);
+	}
+}
+
+static void sendFin(TCPChannel *channel) {
+	sendTcpResponseHeader(channel, (1 << TCP_FLAG_ACK) | (1 << TCP_FLAG_FIN));
 	sendTcpResponse(channel);
-	freeChannel(channel);
+	channel->idleState = TCP_IDLE_FIN_WAIT;
+}
+
+/**
+ * Sends the fin that waited for room in the send window. Returns 1 if it
+ * was sent.
+ */
+static uint8_t sendPendingFin(TCPChannel *channel) {
+	if (channel->idleState == TCP_IDLE_FIN_PENDING
+			&& tcpGetFreeSendWindow(channel) > 0) {
+		sendFin(channel);
+		return 1;
+	}
+	return 0;
+}
+
+static void freeIfFinAcknowledged(TCPChannel *channel, uint32_t ack) {
+	if (channel->idleState == TCP_IDLE_FIN_WAIT && ack == channel->seqnumber) {
+		freeChannel(channel);
+	}
+}
+
+void finTcpSession(TCPChannel *channel) {
+	if (isClosing(channel) || (channel->sendFlags & TCP_SEND_FAILED)) {
+		// a fin behind a cut response would pass it off as complete.
+		return;
+	}
+	if (isChannelOpen(channel)) {
+		// the fin is sent again until it is acknowledged, so it needs a
+		// place in the send window.
+		if (tcpGetFreeSendWindow(channel) == 0) {
+			channel->idleState = TCP_IDLE_FIN_PENDING;
+		} else {
+			sendFin(channel);
+		}
+		armTimer(channel, TCP_TIMER_IDLE, TCP_FIN_WAIT_TIME);
+	} else {
+		disconnectApp(channel->app, channel);
+		sendFin(channel);
+	}
 }
 
 static void writeSequenceNumber(SequenceNumber *to, uint32_t from) {
@@ -134,6 +497,14 @@ static uint32_t decodeSeqNumber(SequenceNumber *number) {
 			| ((uint32_t) number->part3 << 8) | (uint32_t) number->part4;
 }
 
+/**
+ * Folds a sum of 16 bit words to a 16 bit ones complement sum.
+ */
+static uint16_t foldChecksum(uint32_t checksum) {
+	checksum = (checksum >> 16) + (checksum & 0xffff);
+	return (uint16_t) (checksum >> 16) + (uint16_t) checksum;
+}
+
 static uint16_t getTcpPreChecksum(IPHeader *ipHeader) {
 	uint32_t checksum = 0;
 	checksum += (uint16_t) (ipHeader->source.addr1 << 8)
@@ -145,9 +516,7 @@ static uint16_t getTcpPreChecksum(IPHeader *ipHeader) {
 	checksum += (uint16_t) (ipHeader->destination.addr3 << 8)
 			| ipHeader->destination.addr4;
 	checksum += PROTOCOL_TCP;
-
-	uint16_t realChecksum = (uint16_t) (checksum >> 16) + (uint16_t) checksum;
-	return realChecksum;
+	return foldChecksum(checksum);
 }
 
 static uint32_t precomputeIpHeaderChecksum(IPHeader *header) {
@@ -166,43 +535,99 @@ static uint32_t precomputeIpHeaderChecksum(IPHeader *header) {
 	return checksum;
 }
 
+static void fillEthernetHeader(EthernetHeader *header,
+		MacAddress *destination, uint16_t type) {
+	memcpy(&(header->destination), destination, sizeof(MacAddress));
+	setToMyMac(&header->source);
+	header->typeh = (uint8_t) (type >> 8);
+	header->typel = (uint8_t) type;
+}
+
 /**
  * generates and writes the ethernet header to the enc.
  */
 static void writeEthernetheader(MacAddress *destination, uint16_t type) {
 	EthernetHeader header;
-	memcpy(&(header.destination), destination, sizeof(MacAddress));
-	setToMyMac(&header.source);
-	header.typeh = (uint8_t) (type >> 8);
-	header.typel = (uint8_t) type;
+	STATS_TX_ACCOUNT(STATS_SPI_TX_HEADER);
+	fillEthernetHeader(&header, destination, type);
 	encWriteSequence(&header, sizeof(EthernetHeader));
 }
+
+/**
+ * Fills the ip header of a segment to the channel, length and checksum are
+ * 0.
+ */
+static void fillIpHeader(IPHeader *ipHeader, TCPChannel *channel) {
+	ipHeader->headerlength = (4 << 4) | 5;
+	ipHeader->ds_field = 0;
+	ipHeader->lengthh = 0;
+	ipHeader->lengthl = 0;
+	ipHeader->identificationh = 0; // unsupported
+	ipHeader->identificationl = 0;
+	ipHeader->fragmentoffset1 = 0;
+	ipHeader->fragmentoffset2 = 0;
+	ipHeader->ttl = 64;
+	ipHeader->protocol = PROTOCOL_TCP;
+	ipHeader->checksumh = 0;
+	ipHeader->checksuml = 0;
+	setToMyIp(&ipHeader->source);
+	memcpy(&ipHeader->destination, &channel->ip, sizeof(IpAddress));
+}
+
+#if ENC_TEMPLATES > 0
+static uint8_t hasHeaderTemplate(TCPChannel *channel) {
+	return channel->slot < ENC_TEMPLATES;
+}
+#endif
+
+/**
+ * The ethernet and ip header only depend on the channel. Their checksums
+ * (without the length) are computed once, and with a template, they are
+ * written to the enc once and copied by the dma for every segment.
+ */
+static void prepareChannelHeaders(TCPChannel *channel) {
+	uint8_t header[HEADER_TEMPLATE_SIZE];
+	IPHeader *ipHeader = (IPHeader*) (header + sizeof(EthernetHeader));
+	fillIpHeader(ipHeader, channel);
+	channel->ipHeaderChecksum = foldChecksum(
+			precomputeIpHeaderChecksum(ipHeader));
+	channel->tcpPreChecksum = getTcpPreChecksum(ipHeader);
+#if ENC_TEMPLATES > 0
+	if (hasHeaderTemplate(channel)) {
+		STATS_TX_ACCOUNT(STATS_SPI_TX_HEADER);
+		fillEthernetHeader((EthernetHeader*) header, &channel->mac, 0x0800);
+		encWriteTemplate(channel->slot, header, sizeof(header));
+	}
+#endif
+}
+
 static void writeHeaders(TCPChannel *channel, uint8_t flags) {
 	TCPApp *app = channel->app;
+	tcpResponseFlags = flags;
+	// only what the app has read of the received segment is acknowledged.
+	tcpResponseAck = channel->acknumber;
+	if (channel == receivingChannel) {
+		tcpResponseAck -= encGetRemaining();
+	}
+	STATS_TX_ACCOUNT(STATS_SPI_TX_HEADER);
 	//ip
-	writeEthernetheader(&channel->mac, 0x0800);
-	static IPHeader ipHeader;
-	ipHeader.headerlength = (4 << 4) | 5;
-	ipHeader.ds_field = 0;
-	ipHeader.identificationh = 0; // unsupported
-	ipHeader.identificationl = 0;
-	ipHeader.fragmentoffset1 = 0;
-	ipHeader.fragmentoffset2 = 0;
-	ipHeader.ttl = 64;
-	ipHeader.protocol = PROTOCOL_TCP;
-	ipHeader.checksumh = 0;
-	ipHeader.checksuml = 0;
-	setToMyIp(&ipHeader.source);
-	memcpy(&ipHeader.destination, &channel->ip, sizeof(IpAddress));
-
-	tcpipStartPosition = encGetSendLength();
-	tcpipHeaderStartPointer = encGetWriteMark();
-	encWriteSequence(&ipHeader, sizeof(IPHeader));
-
-	ipHeaderCecksum = precomputeIpHeaderChecksum(&ipHeader);
-	tcpHeaderPreChecksum = getTcpPreChecksum(&ipHeader);
+	uint16_t start = encGetWriteMark();
+#if ENC_TEMPLATES > 0
+	if (hasHeaderTemplate(channel)) {
+		encCopyTemplate(channel->slot, HEADER_TEMPLATE_SIZE);
+	} else
+#endif
+	{
+		static IPHeader ipHeader;
+		fillIpHeader(&ipHeader, channel);
+		writeEthernetheader(&channel->mac, 0x0800);
+		encWriteSequence(&ipHeader, sizeof(IPHeader));
+	}
+	tcpipStartPosition = start + sizeof(EthernetHeader);
+	tcpipHeaderStartPointer = tcpipStartPosition;
 
 	tcpHeaderStartPosition = encGetWriteMark();
+	encStartChecksum(tcpHeaderStartPosition);
 
 	//tcp
 	static TCPHeader tcpHeader;
@@ -210,11 +635,14 @@ static void writeHeaders(TCPChannel *channel, uint8_t flags) {
 	tcpHeader.source.portl = (uint8_t) app->port;
 	tcpHeader.destination.porth = (uint8_t) (channel->port >> 8);
 	tcpHeader.destination.portl = (uint8_t) channel->port;
-	tcpHeader.flagsh = 5 << 4;
+	// a syn announces our maximum segment size.
+	uint8_t hasMss = (flags & (1 << TCP_FLAG_SYN)) != 0;
+	tcpHeaderLength = sizeof(TCPHeader) + (hasMss ? 4 : 0);
+	tcpHeader.flagsh = (tcpHeaderLength / 4) << 4;
 	tcpHeader.flagsl = flags;
 	writeSequenceNumber(&tcpHeader.seqenceNumber, channel->seqnumber);
 	if (flags & (1 << TCP_FLAG_ACK)) {
-		writeSequenceNumber(&tcpHeader.ackNumber, channel->acknumber);
+		writeSequenceNumber(&tcpHeader.ackNumber, tcpResponseAck);
 	} else {
 		writeSequenceNumber(&tcpHeader.ackNumber, 0);
 	}
@@ -223,54 +651,203 @@ static void writeHeaders(TCPChannel *channel, uint8_t flags) {
 	tcpHeader.urgent1 = 0;
 	tcpHeader.urgent2 = 0;
 	encWriteSequence(&tcpHeader, sizeof(TCPHeader));
+	if (hasMss) {
+		uint8_t option[4] = { TCP_OPTION_MSS, 4, (uint8_t) (TCP_MSS >> 8),
+				(uint8_t) TCP_MSS };
+		encWriteSequence(option, sizeof(option));
+	}
+	STATS_TX_ACCOUNT(STATS_SPI_TX_PAYLOAD);
 	debugString("TCP header sent\n");
 }
 
+static void sendFullSegment();
+
+static void openSegment(TCPChannel *channel, uint8_t flags) {
+	encStartPackage();
+	writeHeaders(channel, flags);
+
+	uint16_t dataStart = encGetWriteMark();
+	uint16_t segmentSize = ENC_MAX_PACKAGE_LENGTH - dataStart;
+	if (channel->mss < segmentSize) {
+		segmentSize = channel->mss;
+	}
+	tcpResponseChannel = channel;
+	tcpSegmentEnd = dataStart + segmentSize;
+	encSetSendLimit(tcpSegmentEnd - tcpSegmentReserve, sendFullSegment);
+}
+
 /**
- * Writes the header to enc
+ * Writes the header to enc. Whatever the app writes behind it goes out in
+ * segments of at most the mss of the peer.
  */
 void sendTcpResponseHeader(TCPChannel *channel, uint8_t flags) {
-	encStartPackage();
-	writeHeaders(channel, flags);
+	tcpSegmentHook = 0;
+	tcpSegmentReserve = 0;
+	tcpResponseFailed = 0;
+	tcpResponseStarted = 0;
+	openSegment(channel, flags);
+}
+
+void tcpSetSegmentHook(TCPSegmentHook hook, uint8_t reserve) {
+	tcpSegmentHook = hook;
+	tcpSegmentReserve = hook != 0 ? reserve : 0;
+	encSetSendLimit(tcpSegmentEnd - tcpSegmentReserve, sendFullSegment);
+}
+
+uint16_t tcpGetSegmentSpace() {
+	uint16_t limit = tcpSegmentEnd - tcpSegmentReserve;
+	uint16_t length = encGetWriteMark();
+	return length < limit ? limit - length : 0;
 }
 
 /**
- * Final send method, after sendTcpResponseHeader
+ * Sends the segment that is being written. It is kept for retransmission
+ * if it has data, a syn or a fin and retain is set, and dropped if there is
+ * no room for it. Only a response that was sent in part is reset then.
  */
-void sendTcpResponse(TCPChannel *channel) {
+static uint8_t finishSegment(TCPChannel *channel, uint8_t retain) {
+	if (tcpResponseFailed) {
+		return 0;
+	}
+	if (channel->sendFlags & TCP_SEND_FAILED) {
+		// nothing goes out behind a cut response.
+		encDiscardPackage();
+		tcpResponseFailed = 1;
+		return 0;
+	}
+	STATS_TX_ACCOUNT(STATS_SPI_TX_HEADER);
 	uint16_t length = encGetSendLength() - tcpipStartPosition;
+	uint32_t sequenceLength = length - sizeof(IPHeader) - tcpHeaderLength;
+	if (tcpResponseFlags & ((1 << TCP_FLAG_SYN) | (1 << TCP_FLAG_FIN))) {
+		sequenceLength++;
+	}
+	if (sequenceLength == 0) {
+		retain = 0;
+	} else if (retain && getSendCapacity(channel) == 0) {
+		// it could not be sent again if it got lost.
+		debugString("TCP response dropped, the send window is full\n");
+		encDiscardPackage();
+		tcpResponseFailed = 1;
+		if (tcpResponseStarted) {
+			// the peer must not take what was sent for the whole response,
+			// see resetFailedChannels().
+			channel->sendFlags |= TCP_SEND_FAILED;
+			resetPending = 1;
+		}
+		return 0;
+	}
+	if ((tcpResponseFlags & (1 << TCP_FLAG_ACK))
+			&& tcpResponseAck == channel->acknumber) {
+		channel->ackPending = 0;
+		cancelTimer(channel, TCP_TIMER_ACK);
+	}
 
 	uint16_t endPointer = encGetWriteMark();
 	encSetWritePointerOffseted(tcpipHeaderStartPointer, TCP_LENGTH_OFFSET);
 	encWriteChar((uint8_t) (length >> 8));
 	encWriteChar((uint8_t) length);
 
-	uint32_t withLength = ipHeaderCecksum + length;
-	uint16_t checksum = ((uint16_t) withLength + (uint16_t) (withLength >> 16))
-			^ 0xffff;
+	// RFC 1624: the length was 0 in the cached sum, so adding it is all.
+	uint16_t checksum = foldChecksum(
+			(uint32_t) channel->ipHeaderChecksum + length) ^ 0xffff;
 	encSetWritePointerOffseted(tcpipHeaderStartPointer, TCP_CHECKSUM_OFFSET);
 	encWriteChar((uint8_t) (checksum >> 8));
 	encWriteChar((uint8_t) checksum);
 
 	encSetWritePointer(endPointer);
 
-	encComputeTcpChecksum(tcpHeaderPreChecksum, tcpHeaderStartPosition);
+	encComputeTcpChecksum(channel->tcpPreChecksum, tcpHeaderStartPosition);
 
-	encSend();
-	channel->seqnumber += length - sizeof(IPHeader) - sizeof(TCPHeader);
+	channel->seqnumber += sequenceLength;
+	if (retain) {
+		if (channel->unackedCount == 0) {
+			armTimer(channel, TCP_TIMER_RETRANSMIT, TCP_RETRANSMIT_TIMEOUT);
+		}
+		channel->unackedSlots[channel->unackedCount] = encSendRetained();
+		channel->unackedEnds[channel->unackedCount] = channel->seqnumber;
+		channel->unackedCount++;
+	} else {
+		encSendAsync();
+	}
+	tcpResponseStarted = 1;
 	debugString("TCP response completed\n");
+	return 1;
+}
+
+/**
+ * Final send method, after sendTcpResponseHeader. Segments with data, a syn
+ * or a fin are kept until they are acknowledged; if the send window has no
+ * room for one, it is dropped with the rest of the response and 0 is
+ * returned. The channel is only reset if a part of the response went out.
+ */
+uint8_t sendTcpResponse(TCPChannel *channel) {
+	return finishSegment(channel, isChannelOpen(channel));
+}
+
+/**
+ * Resets the channels whose response was cut, once their app returned.
+ */
+static void resetFailedChannels() {
+	resetPending = 0;
+	for (uint8_t i = 0; i < TCP_MAX_CHANNELS; i++) {
+		TCPChannel *channel = channels[i];
+		if (channel != 0 && (channel->sendFlags & TCP_SEND_FAILED)) {
+			channel->sendFlags &= ~TCP_SEND_FAILED;
+			sendTcpResponseHeader(channel,
+					(1 << TCP_FLAG_RST) | (1 << TCP_FLAG_ACK));
+			finishSegment(channel, 0);
+			if (!isClosing(channel)) {
+				disconnectApp(channel->app, channel);
+			}
+			freeChannel(channel);
+		}
+	}
+}
+
+/**
+ * Called by the enc when the app writes more than fits in the segment.
+ * Sends it and continues in a new segment with the same flags, but a fin
+ * only goes with the last one. Only as many segments as the send window
+ * holds, finishSegment() cuts the response after that.
+ */
+static void sendFullSegment() {
+	TCPChannel *channel = tcpResponseChannel;
+	uint8_t flags = tcpResponseFlags;
+	if (tcpSegmentHook != 0) {
+		tcpSegmentHook(channel, TCP_SEGMENT_FULL);
+	}
+	if (flags & (1 << TCP_FLAG_FIN)) {
+		uint16_t endPointer = encGetWriteMark();
+		tcpResponseFlags &= ~(1 << TCP_FLAG_FIN);
+		encSetWritePointerOffseted(tcpHeaderStartPosition, TCP_FLAGS_OFFSET);
+		encWriteChar(tcpResponseFlags);
+		encSetWritePointer(endPointer);
+	}
+	if (!sendTcpResponse(channel)) {
+		// the writes of the app go nowhere until the response ends.
+		return;
+	}
+	openSegment(channel, flags);
+	if (tcpSegmentHook != 0) {
+		tcpSegmentHook(channel, TCP_SEGMENT_OPENED);
+	}
 }
 
 /**
  * Resends the last package to an other session,
  * assuming the package was send directly before this one.
  */
-void resendTcpResponse(TCPChannel *channel, uint8_t flags) {
+uint8_t resendTcpResponse(TCPChannel *channel, uint8_t flags) {
+	if (tcpResponseFailed) {
+		return 0;
+	}
 	uint16_t endPointer = encGetWriteMark();
 	encRestartPackage();
 	writeHeaders(channel, flags);
 	encSetWritePointer(endPointer);
-	sendTcpResponse(channel);
+	// nothing of it went to this channel yet.
+	tcpResponseStarted = 0;
+	return sendTcpResponse(channel);
 }
 
 static void tcpSendSynAck(TCPChannel *channel) {
@@ -282,41 +859,141 @@ static uint8_t ipEquals(IpAddress *ip1, IpAddress *ip2) {
 			&& ip1->addr2 == ip2->addr2 && ip1->addr1 == ip2->addr1;
 }
 
-static uint8_t portEquals(TCPPort *p1, uint16_t port) {
-	return p1->portl == (uint8_t) port && p1->porth == (uint8_t) (port >> 8);
-}
-static TCPChannel* getChannelFor(TCPApp *app, IpAddress *sourceip,
-		TCPHeader * header) {
-	for (int i = 0; i < TCP_MAX_CHANNELS; i++) {
-		if (channels[i] != 0 && portEquals(&header->destination, app->port)
-				&& portEquals(&header->source, channels[i]->port)
-				&& ipEquals(sourceip, &channels[i]->ip)) {
-			return channels[i];
+/**
+ * Finds the open channel for a connection.
+ * @param remotePort The port of the peer.
+ * @param localPort The port of the app.
+ */
+TCPChannel *tcpFindChannel(IpAddress *ip, uint16_t remotePort,
+		uint16_t localPort) {
+	uint8_t slot = channelBuckets[channelHash(ip, remotePort, localPort)];
+	while (slot != CHANNEL_NONE) {
+		TCPChannel *channel = channels[slot];
+		if (channel->port == remotePort && channel->app->port == localPort
+				&& ipEquals(ip, &channel->ip)) {
+			return channel;
 		}
+		slot = channelNext[slot];
 	}
 	return 0;
 }
 
 TCPChannel temporaryCahnnel;
 
+/**
+ * Skips the start of the received segment if it was received before.
+ * Returns 0 if the segment does not go on where the received data ends,
+ * its data is dropped then.
+ */
+static uint8_t takeInOrder(TCPChannel *channel) {
+	uint16_t dataLength = encGetRemaining();
+	uint32_t received = channel->acknumber
+			- decodeSeqNumber(&incommingTcpHeader.seqenceNumber);
+	if (dataLength == 0 || received == 0) {
+		return 1;
+	}
+	if (received < dataLength) {
+		while (received > 0) {
+			received -= encSkip(received > 0xff ? 0xff : received);
+		}
+		return 1;
+	}
+	encDecreaseRemainingTo(0);
+	return 0;
+}
+
+void tcpRefuseReceived(TCPChannel *channel) {
+	uint16_t remaining = encGetRemaining();
+	if (channel != receivingChannel || remaining == 0) {
+		return;
+	}
+	channel->acknumber -= remaining;
+	if (remaining == receivedDataLength && channel->ackPending > 0) {
+		// nothing of the segment is left to acknowledge.
+		channel->ackPending--;
+		if (channel->ackPending == 0) {
+			cancelTimer(channel, TCP_TIMER_ACK);
+		}
+	}
+	encDecreaseRemainingTo(0);
+}
+
+uint16_t tcpGetSegmentSize(TCPChannel *channel) {
+	uint16_t size = ENC_MAX_PACKAGE_LENGTH - sizeof(EthernetHeader)
+			- sizeof(IPHeader) - sizeof(TCPHeader);
+	return channel->mss < size ? channel->mss : size;
+}
+
+uint16_t tcpGetSendSpace(TCPChannel *channel) {
+	return tcpGetFreeSendWindow(channel) * tcpGetSegmentSize(channel);
+}
+
+/**
+ * Reads the options of a syn and returns the maximum segment size in them.
+ */
+static uint16_t readMssOption(uint8_t length) {
+	uint8_t options[40];
+	if (length > sizeof(options)) {
+		length = sizeof(options);
+	}
+	length = encReadSequence(options, length);
+	uint8_t i = 0;
+	while (i < length && options[i] != TCP_OPTION_END) {
+		if (options[i] == TCP_OPTION_NOP) {
+			i++;
+			continue;
+		}
+		if (i + 1 >= length || options[i + 1] < 2) {
+			break;
+		}
+		if (options[i] == TCP_OPTION_MSS && options[i + 1] == 4
+				&& i + 4 <= length) {
+			uint16_t mss = ((uint16_t) options[i + 2] << 8) | options[i + 3];
+			if (mss > 0) {
+				return mss;
+			}
+		}
+		i += options[i + 1];
+	}
+	return TCP_DEFAULT_MSS;
+}
+
 void tcpHeaderReceived() {
 	debugString("TCP: Received tcp header\n");
+	STATS_COUNT(tcpFrames);
+	STATS_TIMER_START(tcpHeaderReceived);
 
 	uint8_t readBytes = encReadSequence((uint8_t*) &incommingTcpHeader,
 			sizeof(TCPHeader));
 
 	uint8_t headerlength = (incommingTcpHeader.flagsh >> 4) * 4;
+	uint16_t mss = TCP_DEFAULT_MSS;
 	if (headerlength > readBytes) {
 		uint8_t toSkip = headerlength - readBytes;
-		encSkip(toSkip);
+		if (incommingTcpHeader.flagsl & (1 << TCP_FLAG_SYN)) {
+			mss = readMssOption(toSkip);
+		} else {
+			encSkip(toSkip);
+		}
 	}
 
 	uint16_t port = ((uint16_t) incommingTcpHeader.destination.porth << 8)
 			| incommingTcpHeader.destination.portl;
-	TCPApp *app = findAppWithPort(port);
+	uint16_t remotePort = ((uint16_t) incommingTcpHeader.source.porth << 8)
+			| incommingTcpHeader.source.portl;
+	TCPChannel *channel = tcpFindChannel(&incommingIpHeader.source,
+			remotePort, port);
+	TCPApp *app;
+	if (channel != 0) {
+		app = channel->app;
+	} else {
+		app = findAppWithPort(port);
+	}
 
 	if (app == 0) {
 		debugString("TCP: No app found for port.\n");
+		STATS_COUNT(droppedNoApp);
+		STATS_TIMER_STOP(tcpHeaderReceived);
 		//we only accept packages on registered ports.
 		return;
 	}
@@ -327,14 +1004,19 @@ void tcpHeaderReceived() {
 			//new connection is to be established. Only incoming supported yet.
 			debugString("================= Incomming syn reqest on port "); debugHex(incommingTcpHeader.destination.porth); debugHex(incommingTcpHeader.destination.portl); debugString("\n");
 
-			uint8_t freeChannelPos = getFreeChannelPos();
-			if (app != 0 && freeChannelPos < TCP_MAX_CHANNELS) {
-				TCPChannel *channel;
+			if (channel != 0) {
+				// a repeated syn, the retransmit timer sends the syn ack.
+				debugString("TCP: syn of a known channel.\n");
+			} else if (encGetFreeRetainSlots() == 0) {
+				// the syn ack is kept for retransmission. Without a slot for
+				// it, the peer sends its syn again.
+				debugString("TCP: syn refused, no slot for the syn ack.\n");
+				STATS_COUNT(refusedNoSlot);
+			} else if (firstFreeChannel != CHANNEL_NONE) {
 				debugString("Connecting application.\n");
-				channel = app->connect();
+				channel = connectApp(app);
 				if (channel != 0) {
 					debugString("Application accepted connection.\n");
-					channels[freeChannelPos] = channel;
 					channel->acknumber = decodeSeqNumber(
 							&incommingTcpHeader.seqenceNumber) + 1;
 					channel->seqnumber = 0x100; //TODO: initial seq number?
@@ -342,69 +1024,134 @@ void tcpHeaderReceived() {
 							sizeof(MacAddress));
 					memcpy(&channel->ip, &incommingIpHeader.source,
 							sizeof(IpAddress));
-					channel->port = ((uint16_t) incommingTcpHeader.source.porth
-							<< 8) | incommingTcpHeader.source.portl;
+					channel->port = remotePort;
 					channel->app = app;
-					channel->timeRemaining = TCP_TIMEOUT;
+					channel->unackedCount = 0;
+					channel->sendFlags = 0;
+					channel->ackPending = 0;
+					channel->mss = mss;
+					channel->idleState = TCP_IDLE_OPEN;
+					memset(channel->timers, 0, sizeof(channel->timers));
+					armTimer(channel, TCP_TIMER_IDLE, TCP_KEEPALIVE_TIME);
+					addChannel(channel);
+					prepareChannelHeaders(channel);
 					tcpSendSynAck(channel);
 				}
 			}
 		}
 	} else if (incommingTcpHeader.flagsl & (1 << TCP_FLAG_RST)) {
 		debugString("TCP: Resetting.\n");
-		TCPChannel *channel = getChannelFor(app, &incommingIpHeader.source,
-				&incommingTcpHeader);
 		if (channel != 0) {
-			app->disconnect(channel);
+			if (!isClosing(channel)) {
+				disconnectApp(app, channel);
+			}
+		} else {
+			STATS_COUNT(droppedNoChannel);
 		}
 		freeChannel(channel);
 	} else if (incommingTcpHeader.flagsl & (1 << TCP_FLAG_FIN)) {
 		debugString("TCP: Closing connection.\n");
-		TCPChannel *channel = getChannelFor(app, &incommingIpHeader.source,
-				&incommingTcpHeader);
+		if (channel != 0 && isClosing(channel)) {
+			// we closed already, the peer closes, too.
+			channel->acknumber = decodeSeqNumber(
+					&incommingTcpHeader.seqenceNumber) + 1;
+			uint32_t ack = decodeSeqNumber(&incommingTcpHeader.ackNumber);
+			acknowledgeSent(channel, ack);
+			if (!sendPendingFin(channel)) {
+				sendSimpleAck(channel);
+			}
+			freeIfFinAcknowledged(channel, ack);
+			STATS_TIMER_STOP(tcpHeaderReceived);
+			return;
+		}
 		if (channel != 0) {
-			app->disconnect(channel);
+			disconnectApp(app, channel);
 		} else {
 			channel = &temporaryCahnnel;
 			channel->mac = incommingEthHeader.source;
 			channel->ip = incommingIpHeader.source;
-			channel->port = (incommingTcpHeader.source.porth << 8)
-					+ incommingTcpHeader.source.portl;
+			channel->port = remotePort;
 			channel->app = app;
+			channel->unackedCount = 0;
+			channel->sendFlags = 0;
+			channel->mss = TCP_DEFAULT_MSS;
+			channel->slot = CHANNEL_NONE;
+			prepareChannelHeaders(channel);
 		}
 		channel->acknumber = decodeSeqNumber(&incommingTcpHeader.seqenceNumber)
 				+ 1;
 		channel->seqnumber = decodeSeqNumber(&incommingTcpHeader.ackNumber);
-		channel->timeRemaining = TCP_TIMEOUT;
 
+		// the channel is freed at once, so the answer is not kept. If it is
+		// lost, the repeated fin of the peer is answered without a channel.
 		sendTcpResponseHeader(channel,
 				(1 << TCP_FLAG_ACK) | (1 << TCP_FLAG_FIN));
-		sendTcpResponse(channel);
+		finishSegment(channel, 0);
 		freeChannel(channel);
 	} else {
 		debugString("TCP: passing normal package to app.\n");
-		TCPChannel *channel = getChannelFor(app, &incommingIpHeader.source,
-				&incommingTcpHeader);
-		uint16_t dataLength = encGetRemaining();
 		if (channel != 0) {
-			channel->acknumber = decodeSeqNumber(
-					&incommingTcpHeader.seqenceNumber) + dataLength;
-			channel->seqnumber = decodeSeqNumber(&incommingTcpHeader.ackNumber);
-			channel->timeRemaining = TCP_TIMEOUT;
+			uint8_t inOrder = takeInOrder(channel);
+			uint16_t dataLength = encGetRemaining();
+			channel->acknumber += dataLength;
+			uint32_t ack = decodeSeqNumber(&incommingTcpHeader.ackNumber);
+			acknowledgeSent(channel, ack);
+			if (isClosing(channel)) {
+				// the app is gone, only the acks matter.
+				sendPendingFin(channel);
+				freeIfFinAcknowledged(channel, ack);
+				STATS_TIMER_STOP(tcpHeaderReceived);
+				return;
+			}
+			channel->idleState = TCP_IDLE_OPEN;
+			armTimer(channel, TCP_TIMER_IDLE, TCP_KEEPALIVE_TIME);
 
-			if (dataLength > 0) {
+			if (!inOrder) {
+				// tells the peer where the data has to go on.
 				sendSimpleAck(channel);
 			}
+			if (dataLength > 0) {
+#if TCP_DELAYED_ACK > 0
+				if (channel->ackPending == 0) {
+					armTimer(channel, TCP_TIMER_ACK, TCP_DELAYED_ACK);
+				}
+#endif
+				channel->ackPending++;
+			}
 
+			receivingChannel = channel;
+			receivedDataLength = dataLength;
+			if (dataLength > 0 && getSendCapacity(channel) == 0) {
+				// an answer could not be kept, the peer sends the data again.
+				// The app still gets the acks, as a callback without data.
+				debugString("TCP: data refused, the send window is full.\n");
+				STATS_COUNT(refusedNoSlot);
+				tcpRefuseReceived(channel);
+			}
 			app->receivePackage(channel);
+			receivingChannel = 0;
+#if TCP_DELAYED_ACK == 0
+			if (isChannelOpen(channel) && channel->ackPending > 0) {
+#else
+			// no response of the app carried the ack for two segments.
+			if (isChannelOpen(channel) && channel->ackPending >= 2) {
+#endif
+				sendSimpleAck(channel);
+			}
+			if (resetPending) {
+				resetFailedChannels();
+			}
+		} else {
+			STATS_COUNT(droppedNoChannel);
 		}
 	}
-
+	STATS_TIMER_STOP(tcpHeaderReceived);
 }
 
 /* ============================= IP =========================== */
 void ipPackageReceived() {
 	debugString("IP: Received ip header\n");
+	STATS_COUNT(ipFrames);
 	uint8_t readBytes = encReadSequence((uint8_t*) &incommingIpHeader,
 			sizeof(incommingIpHeader));
 
@@ -423,8 +1170,10 @@ void ipPackageReceived() {
 			tcpHeaderReceived();
 		} else {
 			debugString("IP: Wrong protocol\n");
+			STATS_COUNT(droppedByFilter);
 		}
 	} else {
+		STATS_COUNT(droppedByFilter);
 		debugString("IP: The package is NOT addressed at me: "); debugHex(incommingIpHeader.destination.addr1); debugString("."); debugHex(incommingIpHeader.destination.addr2); debugString("."); debugHex(incommingIpHeader.destination.addr3); debugString("."); debugHex(incommingIpHeader.destination.addr4); debugString("\n");
 	}
 }
@@ -432,6 +1181,7 @@ void ipPackageReceived() {
 /* ============================= ARP =========================== */
 void arpPackageReceived() {
 	debugString("ARP: Got arp package\n");
+	STATS_COUNT(arpFrames);
 	if (isBroadcast(&(incommingEthHeader.destination))
 			|| isMyMac(&(incommingEthHeader.destination))) {
 		//received broadcast arp package.
@@ -456,9 +1206,14 @@ void arpPackageReceived() {
 
 			encStartPackage();
 			writeEthernetheader(&arpPackage.targetMac, 0x0806);
+			STATS_TX_ACCOUNT(STATS_SPI_TX_PAYLOAD);
 			encWriteSequence(&arpPackage, sizeof(ArpPackage));
-			encSend();
+			encSendAsync();
+		} else {
+			STATS_COUNT(droppedByFilter);
 		}
+	} else {
+		STATS_COUNT(droppedByFilter);
 	}
 }
 
@@ -467,6 +1222,7 @@ void arpPackageReceived() {
  */
 void ethernetPackageReceived() {
 	encReadSequence((uint8_t*) &incommingEthHeader, sizeof(incommingEthHeader));
+	STATS_COUNT(ethFrames);
 
 	debugString("ETH: Received network package with type "); debugHex(incommingEthHeader.typeh); debugHex(incommingEthHeader.typel); debugString("\n");
 
@@ -475,6 +1231,8 @@ void ethernetPackageReceived() {
 	} else if (incommingEthHeader.typeh == 0x08
 			&& incommingEthHeader.typel == 0x06) {
 		arpPackageReceived();
+	} else {
+		STATS_COUNT(droppedByFilter);
 	} debugString("ETH: Network package handled\n");
 }
 
@@ -491,29 +1249,118 @@ static void sendKeepAlive(TCPChannel *channel) {
 	sendTcpResponse(channel);
 }
 
-uint8_t tcpTimeoutDowncountFlag;
+/**
+ * Sends the oldest unacknowledged segment again, straight from the enc
+ * memory. The others are sent again one per ack, see acknowledgeSent().
+ */
+static void retransmit(TCPChannel *channel) {
+	debugString("TCP: retransmitting\n");
+	if (channel->unackedCount > 0) {
+		encResendRetained(channel->unackedSlots[0]);
+		channel->sendFlags |= TCP_SEND_RECOVERING;
+		armTimer(channel, TCP_TIMER_RETRANSMIT, TCP_RETRANSMIT_TIMEOUT);
+	}
+}
+
+static void idleTimeout(TCPChannel *channel) {
+	if (channel->idleState == TCP_IDLE_OPEN) {
+		sendKeepAlive(channel);
+		channel->idleState = TCP_IDLE_KEEPALIVE_SENT;
+		armTimer(channel, TCP_TIMER_IDLE, TCP_TIMEOUT - TCP_KEEPALIVE_TIME);
+	} else if (channel->idleState == TCP_IDLE_KEEPALIVE_SENT) {
+		//kill it
+		finTcpSession(channel);
+	} else {
+		// the fin was not acknowledged, or found no room to be sent.
+		freeChannel(channel);
+	}
+}
 
-void tcpTimeoutDowncount() {
-	tcpTimeoutDowncountFlag = 1;
+static void timerDue(TCPTimer *timer) {
+	uint8_t kind = timer->kind;
+	TCPChannel *channel = (TCPChannel*) ((uint8_t*) (timer - kind)
+			- offsetof(TCPChannel, timers));
+	if (kind == TCP_TIMER_RETRANSMIT) {
+		retransmit(channel);
+	} else if (kind == TCP_TIMER_ACK) {
+		// the ack for received data that no response carried.
+		if (channel->ackPending) {
+			sendSimpleAck(channel);
+		}
+	} else {
+		idleTimeout(channel);
+	}
 }
 
-void tcpTimeoutPoll() {
+/**
+ * Moves the wheel on by one millisecond and runs the timers that are due.
+ * Only the bucket of that millisecond is looked at.
+ */
+static void advanceTimerWheel() {
+	timerPosition = (timerPosition + 1) & (TCP_TIMER_WHEEL_SIZE - 1);
+	TCPTimer **bucket = &timerWheel[timerPosition];
+	// a due timer may cancel others in the same bucket, so they are
+	// unlinked one by one from a list of their own.
+	TCPTimer *due = *bucket;
+	*bucket = 0;
+	if (due != 0) {
+		due->link = &due;
+	}
+	while (due != 0) {
+		TCPTimer *timer = due;
+		unlinkTimer(timer);
+		if (timer->rounds) {
+			timer->rounds--;
+			linkTimer(timer, bucket);
+		} else {
+			timerDue(timer);
+		}
+	}
+}
 
-	if (tcpTimeoutDowncountFlag) {
-		uint8_t i;
-		for (i = 0; i < sizeof(channels) / sizeof(channels[0]); i++) {
-			if (channels[i] == 0) {
-				continue;
-			} else if (channels[i]->timeRemaining) {
-				channels[i]->timeRemaining--;
-				if (channels[i]->timeRemaining == TCP_WARNING) {
-					sendKeepAlive(channels[i]);
-				}
+void tcpTimerTick() {
+	timerTicks++;
+}
+
+void tcpTimeoutDowncount() {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		timerTicks += 1000;
+	}
+}
+
+/**
+ * Calls the apps of channels that waited for the TX slots of others, now
+ * that segments were released. A closed channel sends its fin.
+ */
+static void wakeBlockedChannels() {
+	sendWindowReleased = 0;
+	for (uint8_t i = 0; i < TCP_MAX_CHANNELS && blockedChannels > 0
+			&& encGetFreeRetainSlots() > 0; i++) {
+		TCPChannel *channel = channels[i];
+		if (channel != 0 && (channel->sendFlags & TCP_SEND_BLOCKED)) {
+			setWindowBlocked(channel, 0);
+			if (isClosing(channel)) {
+				sendPendingFin(channel);
 			} else {
-				//kill it
-				finTcpSession(channels[i]);
+				channel->app->receivePackage(channel);
 			}
 		}
-		tcpTimeoutDowncountFlag = 0;
 	}
 }
+
+void tcpTimeoutPoll() {
+	if (sendWindowReleased) {
+		wakeBlockedChannels();
+	}
+	if (resetPending) {
+		resetFailedChannels();
+	}
+	uint16_t ticks;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		ticks = timerTicks;
+	}
+	for (uint16_t delta = ticks - timerTicksDone; delta > 0; delta--) {
+		advanceTimerWheel();
+	}
+	timerTicksDone = ticks;
+}
@@ -9,14 +9,70 @@
 #define TCPIP_H_
 
 #include <stdint.h>
+#include "config.h"
 
 #define PROTOCOL_TCP 0x06
+#ifndef TCP_MAX_CHANNELS
 #define TCP_MAX_CHANNELS 10
+#endif
+// Buckets to find the channel of a segment, a power of two.
+#ifndef TCP_CHANNEL_HASH_SIZE
+#if TCP_MAX_CHANNELS <= 8
+#define TCP_CHANNEL_HASH_SIZE 8
+#elif TCP_MAX_CHANNELS <= 16
+#define TCP_CHANNEL_HASH_SIZE 16
+#elif TCP_MAX_CHANNELS <= 32
+#define TCP_CHANNEL_HASH_SIZE 32
+#else
+#define TCP_CHANNEL_HASH_SIZE 64
+#endif
+#endif
+#ifndef TCP_MAX_APPS
 #define TCP_MAX_APPS 5
-//counter value to set after every reception.
-#define TCP_TIMEOUT 100
-// Counter value at which a keep-alive is sent. low = later.
-#define TCP_WARNING 20
+#endif
+// All times are in milliseconds, see tcpTimerTick().
+// Time without reception after which a keep-alive is sent.
+#ifndef TCP_KEEPALIVE_TIME
+#define TCP_KEEPALIVE_TIME 80000
+#endif
+// Time without reception after which the channel is closed.
+#ifndef TCP_TIMEOUT
+#define TCP_TIMEOUT 100000
+#endif
+// Time a closed channel waits for the ack of its fin.
+#ifndef TCP_FIN_WAIT_TIME
+#define TCP_FIN_WAIT_TIME 2000
+#endif
+// Buckets of the timer wheel, a power of two up to 256. A timer is looked
+// at once per turn of the wheel until it is due.
+#ifndef TCP_TIMER_WHEEL_SIZE
+#define TCP_TIMER_WHEEL_SIZE 64
+#endif
+// Number of sent segments per channel that are kept in the enc until they are acknowledged.
+// The enc keeps one TX slot for other packages, the rest is shared by all channels.
+#if ENC_TX_SLOTS < 2
+#error "ENC_TX_SLOTS needs to be at least 2, sent segments are kept in the enc"
+#endif
+#ifndef TCP_SEND_WINDOW
+#define TCP_SEND_WINDOW (ENC_TX_SLOTS - 1)
+#endif
+// Time after which unacknowledged segments are sent again.
+#ifndef TCP_RETRANSMIT_TIMEOUT
+#define TCP_RETRANSMIT_TIMEOUT 500
+#endif
+// Received data is acknowledged with the next segment the app sends. A
+// pure ack is sent for every second segment or after this time. 0
+// acknowledges every segment at once.
+#ifndef TCP_DELAYED_ACK
+#define TCP_DELAYED_ACK 200
+#endif
+// Maximum segment size announced in the syn ack, the most data we take in
+// one segment. 1460 fills an ethernet frame.
+#ifndef TCP_MSS
+#define TCP_MSS 1460
+#endif
+// Maximum segment size of a peer that does not announce one.
+#define TCP_DEFAULT_MSS 536
 
 typedef union {
 	struct {
@@ -108,17 +164,89 @@ typedef struct {
 
 typedef struct TCPApp TCPApp;
 
+/**
+ * A timer in the timer wheel.
+ */
+typedef struct TCPTimer {
+	struct TCPTimer *next;
+	// the pointer to this timer, 0 if it is not armed.
+	struct TCPTimer **link;
+	// turns of the wheel until it is due.
+	uint16_t rounds;
+	// index in the timers of the channel.
+	uint8_t kind;
+} TCPTimer;
+
+#define TCP_TIMER_RETRANSMIT 0
+#define TCP_TIMER_ACK 1
+// keep-alive, timeout and the wait for the ack of a fin.
+#define TCP_TIMER_IDLE 2
+#define TCP_TIMERS 3
+
 typedef struct {
 	TCPApp *app;
-	// timeout counter.
-	uint16_t timeRemaining;
 	uint32_t seqnumber; // the next sequence number to send.
 	uint32_t acknumber; // The next ack number to send. This number is one more than the seq number of the last received package. If the package is a sync ack, it is just the seq of the last package.
 	IpAddress ip;
 	MacAddress mac;
 	uint16_t port;
+	// enc TX slots of sent segments that are not acknowledged, oldest first.
+	uint8_t unackedSlots[TCP_SEND_WINDOW];
+	// sequence number behind each of those segments.
+	uint32_t unackedEnds[TCP_SEND_WINDOW];
+	uint8_t unackedCount;
+	// TCP_SEND_* state of the sent segments, set by the library.
+	uint8_t sendFlags;
+	// position in the channel table, set by the library.
+	uint8_t slot;
+	// ones complement sums of the ip header and of the tcp pseudo header,
+	// both without the length. Set by the library.
+	uint16_t ipHeaderChecksum;
+	uint16_t tcpPreChecksum;
+	// received segments that were not acknowledged yet.
+	uint8_t ackPending;
+	// what the idle timer does next: TCP_IDLE_*
+	uint8_t idleState;
+	// set by the library.
+	TCPTimer timers[TCP_TIMERS];
+	// maximum segment size of the peer. Longer responses are split.
+	uint16_t mss;
+	// while the session is free in its TCPChannelPool: next free one + 1.
+	uint8_t nextFree;
 } TCPChannel;
 
+#define TCP_IDLE_OPEN 0
+#define TCP_IDLE_KEEPALIVE_SENT 1
+#define TCP_IDLE_FIN_WAIT 2
+// closed by the app, the fin waits for room in the send window.
+#define TCP_IDLE_FIN_PENDING 3
+
+/**
+ * Sessions of one app, reserved statically by TCP_CHANNEL_POOL. Every
+ * session starts with its TCPChannel.
+ */
+typedef struct {
+	void *sessions;
+	uint16_t sessionSize;
+	uint8_t sessionCount;
+	// sessions that were never used, from the end.
+	uint8_t fresh;
+	// first free session + 1, 0 if none. The nextFree field of a free
+	// channel links to the next one.
+	uint8_t firstFree;
+	uint8_t used;
+	// most sessions used at the same time.
+	uint8_t highWater;
+} TCPChannelPool;
+
+/**
+ * Declares a pool named name of count sessions of the given type.
+ */
+#define TCP_CHANNEL_POOL(name, SessionType, count) \
+	static SessionType name##Sessions[count]; \
+	TCPChannelPool name = { name##Sessions, sizeof(SessionType), count, \
+			count, 0, 0, 0 }
+
 struct TCPApp {
 	uint16_t port;
 	/**
@@ -128,16 +256,28 @@ struct TCPApp {
 	 *
 	 * The returned channel does not have to have the port, ip and sequence
 	 * number fields set, they are added automatically.
+	 *
+	 * Not used if the app has a pool.
 	 */
 	TCPChannel* (*connect)();
 	/**
-	 * Receives a package.
+	 * Receives a segment, its data is read with the encRead* functions.
+	 * It is also called for segments without data, such as acks that made
+	 * room in the send window, and once without a segment when a TX slot
+	 * other channels held is free again (see tcpGetFreeSendWindow()).
+	 * encGetRemaining() is 0 then, which is no empty request.
 	 */
 	void (*receivePackage)(TCPChannel *channel);
 	/**
-	 * Called when a given channel is forced to disconnect.
+	 * Called when a given channel is forced to disconnect, or when a channel
+	 * closed by finTcpSession() is released. May be 0.
 	 */
 	void (*disconnect)(TCPChannel *channel);
+	/**
+	 * Optional pool the sessions are taken from. They are zeroed on connect
+	 * and given back after disconnect.
+	 */
+	TCPChannelPool *pool;
 };
 
 void ethernetPackageReceived();
@@ -146,11 +286,79 @@ void initTcpIp();
 
 void sendSimpleAck(TCPChannel *channel);
 void sendTcpResponseHeader(TCPChannel *channel, uint8_t flags);
-void sendTcpResponse();
-void resendTcpResponse(TCPChannel *channel, uint8_t flags);
+/**
+ * Sends the response. Every segment with data is kept until the peer
+ * acknowledges it, so a response may only take as many segments as
+ * tcpGetFreeSendWindow() allows. If it takes more, the rest is dropped,
+ * 0 is returned and the channel is reset when the app returns, so that
+ * the peer never takes the cut response for a complete one. If not even
+ * its first segment fits, the response is dropped whole and 0 is returned,
+ * but the channel stays open.
+ */
+uint8_t sendTcpResponse(TCPChannel *channel);
 
+#define TCP_SEGMENT_FULL 0
+#define TCP_SEGMENT_OPENED 1
+typedef void (*TCPSegmentHook)(TCPChannel *channel, uint8_t event);
+/**
+ * Lets a protocol frame the segments of the response that is being
+ * written: hook is called with TCP_SEGMENT_FULL before a full segment is
+ * sent, it may still write reserve bytes to it, and with TCP_SEGMENT_OPENED
+ * when the next segment is opened. The hook ends with the response, 0
+ * removes it.
+ */
+void tcpSetSegmentHook(TCPSegmentHook hook, uint8_t reserve);
+/**
+ * Bytes that can still be written before the current segment is full.
+ */
+uint16_t tcpGetSegmentSpace();
+uint8_t resendTcpResponse(TCPChannel *channel, uint8_t flags);
+
+/**
+ * Gets the number of segments that can be sent before an ack makes room.
+ * If other channels hold the TX slots of the enc, it is less than the free
+ * window of the channel, and the app gets a receive callback without data
+ * when there is room again.
+ */
+uint8_t tcpGetFreeSendWindow(TCPChannel *channel);
+/**
+ * Bytes of data in a full segment to the channel.
+ */
+uint16_t tcpGetSegmentSize(TCPChannel *channel);
+/**
+ * Bytes one response can take, tcpGetFreeSendWindow() full segments.
+ * Longer data is sent in several responses, each from a receive callback
+ * that brought an ack or a free TX slot.
+ */
+uint16_t tcpGetSendSpace(TCPChannel *channel);
+/**
+ * In the receive callback: the unread rest of the segment is not taken and
+ * not acknowledged, the peer sends it again. For apps that can not answer
+ * it now.
+ */
+void tcpRefuseReceived(TCPChannel *channel);
+TCPChannel *tcpFindChannel(IpAddress *ip, uint16_t remotePort,
+		uint16_t localPort);
+
+/**
+ * Closes the channel: a fin is sent and the channel is kept until the fin
+ * is acknowledged, or TCP_FIN_WAIT_TIME. Only then the app is disconnected,
+ * so the session must stay untouched until its disconnect callback.
+ */
 void finTcpSession(TCPChannel *channel);
+/**
+ * Call every millisecond, e.g. from a timer interrupt. The timers run in
+ * tcpTimeoutPoll().
+ */
+void tcpTimerTick();
+/**
+ * Former API, counts 1000 ticks at once: call it every second instead of
+ * tcpTimerTick(). Timers then run with a resolution of one second.
+ */
 void tcpTimeoutDowncount();
+/**
+ * Handles the timers that are due, call it in the main loop.
+ */
 void tcpTimeoutPoll();
 
 #endif /* TCPIP_H_ */